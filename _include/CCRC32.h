@@ -1,6 +1,14 @@
 #pragma once
 
 #include <stddef.h> 
+#include "comm.h"
+
+//CRC32的几种算法，算出来的值完全一样（IEEE多项式，和以前的查表法兼容），只是快慢不同
+#define CRC32_IMPL_TABLE    0   //一次一个字节查一张表，最慢，所有CPU都能用
+#define CRC32_IMPL_SLICE8   1   //一次8个字节查8张表
+#define CRC32_IMPL_SLICE16  2   //一次16个字节查16张表，没有PCLMULQDQ时默认用这个
+#define CRC32_IMPL_PCLMUL   3   //x86的PCLMULQDQ无进位乘法折叠，一次64字节，CPU支持就默认用这个
+#define CRC32_IMPL_COUNT    4
 
 class CCRC32
 {
@@ -48,8 +56,50 @@ public:
 	//int   Get_CRC(unsigned char* buffer, unsigned long dwSize);
 	int   Get_CRC(unsigned char* buffer, unsigned int dwSize);
 
+	//分段计算：crc = Begin(); 每收到一段 crc = Update(crc, ...); 收完 Final(crc)，结果和一次Get_CRC()相同
+	static unsigned int Begin() { return 0xffffffff; }
+	unsigned int Update(unsigned int crc, const unsigned char* buffer, size_t len) const { return m_pfnUpdate(this, crc, buffer, len); }
+	static int Final(unsigned int crc) { return (int)(crc ^ 0xffffffff); }
+
+	//CRC-32C（Castagnoli多项式），Begin()/Final()和上面通用；CPU支持SSE4.2就用crc32指令，否则查切片表
+	unsigned int Update32C(unsigned int crc, const unsigned char* buffer, size_t len) const;
+	int   Get_CRC32C(unsigned char* buffer, unsigned int dwSize);
+
+	//按包头校验算法（_PKG_INTEGRITY_xxx）算crc32字段该填的值，_PKG_INTEGRITY_NONE返回0
+	int   Get_Checksum(int mode, unsigned char* buffer, unsigned int dwSize);
+	//这种算法能不能Begin()/UpdateChecksum()/Final()分段算，XXH3只能收完整包再算
+	static bool IsStreamable(int mode) { return mode == _PKG_INTEGRITY_CRC32 || mode == _PKG_INTEGRITY_CRC32C; }
+	unsigned int UpdateChecksum(int mode, unsigned int crc, const unsigned char* buffer, size_t len) const
+	{
+		return mode == _PKG_INTEGRITY_CRC32C ? Update32C(crc, buffer, len) : Update(crc, buffer, len);
+	}
+	static const char* GetIntegrityName(int mode);
+
+	bool  SetImpl(int impl);                  //指定用哪种算法（CRC32_IMPL_xxx），CPU不支持返回false，不改变当前算法
+	int   GetImpl() const { return m_iImpl; }
+	static const char* GetImplName(int impl);
+	static bool IsImplSupported(int impl);    //按cpuid判断当前CPU能不能用这种算法
+
 public:
 	//unsigned long crc32_table[256]; // Lookup table arrays
 	unsigned int crc32_table[256]; // Lookup table arrays
+
+private:
+	typedef unsigned int (*UpdateFunc)(const CCRC32* pThis, unsigned int crc, const unsigned char* buffer, size_t len);
+
+	//crc是还没取反的中间值，返回处理完len字节后的中间值
+	static unsigned int updateTable(const CCRC32* pThis, unsigned int crc, const unsigned char* buffer, size_t len);
+	static unsigned int updateSlice8(const CCRC32* pThis, unsigned int crc, const unsigned char* buffer, size_t len);
+	static unsigned int updateSlice16(const CCRC32* pThis, unsigned int crc, const unsigned char* buffer, size_t len);
+	static unsigned int updatePclmul(const CCRC32* pThis, unsigned int crc, const unsigned char* buffer, size_t len);
+
+	void  initCrc32cTable();
+
+	unsigned int m_sliceTable[16][256];      //m_sliceTable[k][i]：字节i后面再跟k个0字节的CRC，m_sliceTable[0]就是crc32_table
+	int          m_iImpl;                    //当前用的算法
+	UpdateFunc   m_pfnUpdate;
+
+	unsigned int m_slice32c[8][256];         //CRC-32C的切片表，和m_sliceTable的排法一样
+	bool         m_bHw32c;                   //CPU有SSE4.2的crc32指令
 };
 
@@ -0,0 +1,112 @@
+#pragma once
+#include <coroutine>
+#include <atomic>
+#include <cstddef>
+
+#include "CMsgBuf.h"
+
+class CThreadPool;
+
+/**
+ * @class CCoTask
+ * @brief 业务处理协程的返回类型
+ *
+ * 命令处理函数返回CCoTask时就是一个协程，需要等待（定时、其他服务的应答、存储回调等）时 co_await，
+ * 挂起期间不占用线程池的线程，只占一个协程帧；就绪后被交回线程池，由任意一条线程接着执行。
+ * 协程创建后先挂起，由 Start() 交给它消息内存后才开始执行，跑完自己销毁帧并释放消息内存。
+ *
+ * 写协程处理函数时要注意：
+ *   1) 不能跨 co_await 持有 logicPorcMutex 之类的锁，恢复时很可能已经换了一条线程；
+ *   2) 每次 co_await 回来后都要重新比较消息头和连接里的 iCurrsequence，连接可能已经断开甚至被复用；
+ *   3) 连接亲和模式下，同一连接的消息只在两次挂起之间保证串行。
+ */
+class CCoTask
+{
+public:
+	struct promise_type
+	{
+		CMsgBuf ownedMsg;                   //协程接管的消息内存（消息头+包头+包体），帧销毁时随之释放
+
+		promise_type();
+		~promise_type();
+		CCoTask get_return_object() { return CCoTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; } //先挂起，等Start()交代好消息内存再跑
+		std::suspend_never final_suspend() noexcept { return {}; }    //跑完自己销毁帧
+		void return_void() {}
+		void unhandled_exception();
+
+		//协程帧也从内存池分配，和消息内存一样在线程之间流转
+		static void* operator new(size_t size);
+		static void operator delete(void* ptr);
+	};
+
+	CCoTask(CCoTask&& other) noexcept : m_handle(other.m_handle) { other.m_handle = nullptr; }
+	CCoTask(const CCoTask&) = delete;
+	CCoTask& operator=(const CCoTask&) = delete;
+	~CCoTask();                             //没有Start()过的协程直接销毁
+
+	void Start(CMsgBuf&& msg);              //接管消息内存并开始执行，之后本对象不再持有协程
+
+	static int GetLiveCount() { return s_iLiveCount; } //还没跑完（包括挂起中）的协程数量
+
+private:
+	explicit CCoTask(std::coroutine_handle<promise_type> h) : m_handle(h) {}
+
+	std::coroutine_handle<promise_type> m_handle;
+	static std::atomic<int> s_iLiveCount;
+};
+
+//co_await CCoSleep(毫秒)：挂起，到期后回到线程池继续执行，精度为线程池管理线程的采样间隔
+struct CCoSleep
+{
+	int iMs;
+	explicit CCoSleep(int ms) : iMs(ms) {}
+	bool await_ready() const noexcept { return iMs <= 0; }
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume() noexcept {}
+};
+
+//co_await CCoYield()：让出线程，排到线程池恢复队列的末尾，适合长时间计算中间让别的消息先处理
+struct CCoYield
+{
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume() noexcept {}
+};
+
+/**
+ * @class CCoEvent
+ * @brief 只有一个等待者的一次性事件
+ *
+ * 协程 co_await 它挂起，其他任何线程（存储回调、收包线程等）调用 Set() 后，挂起的协程被交回原来的线程池继续执行。
+ * 先 Set() 后 co_await 的不会挂起。Set() 和 co_await 各只能发生一次。
+ * 挂起的协程在线程池登记着，线程池退出时还没等到的协程被销毁，事件被标成已Set()，之后再Set()什么都不做。
+ */
+class CCoEvent
+{
+public:
+	CCoEvent() : m_state(nullptr), m_pPool(nullptr) {}
+	CCoEvent(const CCoEvent&) = delete;
+	CCoEvent& operator=(const CCoEvent&) = delete;
+
+	void Set();
+	bool IsSet() const { return m_state.load(std::memory_order_acquire) == setMark(); }
+
+	struct Awaiter
+	{
+		CCoEvent* pEvent;
+		bool await_ready() const noexcept { return pEvent->IsSet(); }
+		bool await_suspend(std::coroutine_handle<> h) noexcept;
+		void await_resume() noexcept {}
+	};
+	Awaiter operator co_await() noexcept { return Awaiter{ this }; }
+
+private:
+	friend class CThreadPool;               //线程池退出时销毁等待者，要先把事件标成已Set()
+
+	//已经Set()的标记，用事件自己的地址，不可能和协程帧地址相同
+	void* setMark() const { return const_cast<CCoEvent*>(this); }
+
+	std::atomic<void*> m_state;             //nullptr：没Set()也没人等；setMark()：已Set()；其他：等待者的协程句柄地址
+	CThreadPool*       m_pPool;             //等待者挂起时所在的线程池，Set()后回到这里继续执行
+};
@@ -0,0 +1,35 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+/**
+ * @class CEventCount
+ * @brief 基于futex的事件计数器，用于让空闲线程睡眠、有活时再唤醒
+ *
+ * 用法（消费者）：
+ *   uint32_t key = ev.PrepareWait();
+ *   if (队列里有东西) { ev.CancelWait(); 去干活; }
+ *   else ev.Wait(key);
+ * 用法（生产者）：先把数据放进队列，再调用 Notify()。
+ * 生产者只有在确实有人在睡眠时才会进入内核，没人等待时 Notify() 只是一次原子读。
+ */
+class CEventCount
+{
+public:
+	CEventCount() : m_epoch(0), m_waiters(0) {}
+
+	CEventCount(const CEventCount&) = delete;
+	CEventCount& operator=(const CEventCount&) = delete;
+
+	uint32_t PrepareWait();          //登记为等待者，返回当前纪元，之后必须再检查一次条件
+	void     CancelWait();           //条件已满足，不睡了
+	void     Wait(uint32_t key);     //纪元没变就睡眠，直到被Notify()唤醒
+	void     Notify(int count = 1);  //唤醒最多count个等待者，没有等待者则什么也不做
+	void     NotifyAll();            //唤醒所有等待者，退出时用
+
+	int      GetWaiters() const { return m_waiters.load(std::memory_order_relaxed); } //当前睡眠（或准备睡眠）的线程数
+
+private:
+	std::atomic<uint32_t> m_epoch;   //每次唤醒都+1，futex就睡在这个变量上
+	std::atomic<int>      m_waiters; //等待者数量
+};
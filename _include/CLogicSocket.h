@@ -1,6 +1,8 @@
 #pragma once
 #include"CSocket.h"
 #include"logiccomm.h"
+#include"CCoroutine.h"
+#include"CUserStore.h"
 
 class CLogicSocket :public CSocket
 {
@@ -8,20 +10,31 @@ public:
 	CLogicSocket();                                                         //构造函数
 	virtual ~CLogicSocket();                                                //析构函数
 	virtual bool Initialize();                                              //初始化函数
+	virtual bool Initialize_subproc();                                      //子进程初始化
 
 public:
 
 	//通信相关函数
+	void  lockConnLogic(std::unique_lock<std::mutex>& lock);   //按线程池的分派方式决定是否需要对连接加业务逻辑锁
 	void  SendNoBodyPkgToClient(LPSTRUC_MSG_HEADER pMsgHeader, unsigned short iMsgCode);
 
 	//业务逻辑相关函数
-	bool _HandleRegister(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength);
+	CCoTask _HandleRegister(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength);
 	bool _HandleLogIn(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength);
 	bool _HandlePing(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength);
+	bool _HandleIntegrity(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength);
+	void _HandlePingInline(lpconnection_t pConn, LPCOMM_PKG_HEADER pPkgHeader);
 
 	virtual void procPingTimeOutChecking(LPSTRUC_MSG_HEADER tmpmsg, time_t cur_time);      //心跳包检测
+	virtual const MsgMeta* getMsgMeta(unsigned short iMsgCode);                             //命令的元数据：包体长度、限速、优先级、线程池
+	virtual void procInlinePkg(lpconnection_t pConn, LPCOMM_PKG_HEADER pPkgHeader);         //在收包线程上直接处理只有包头的包
 
 public:
-	virtual void threadRecvProcFunc(char* pMsgBuf);
+	virtual void threadRecvProcFunc(CMsgBuf& msg);
+	virtual void procRejectedMsg(const CMsgBuf& msg);                                       //请求被线程池丢弃，回个"服务器忙"
+
+private:
+	CUserStore m_userStore;                                                                  //账号和会话，注册、登录用
+	int        m_iRegisterFailDelayMs;                                                       //注册失败时晚这么多毫秒再回包，0表示马上回
 };
 
@@ -0,0 +1,188 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#define CACHE_LINE_SIZE 64  //缓存行大小，用来把生产者/消费者各自频繁修改的变量隔开，避免伪共享
+
+/**
+ * @class CMPMCQueue
+ * @brief 有界无锁多生产者多消费者环形队列
+ *
+ * 采用每个槽位带序号的环形数组（Dmitry Vyukov 的 bounded MPMC 算法）：
+ * 入队/出队各自只需要一次CAS抢占位置，再用一次release写序号把槽位交给对方，没有锁，也没有任何堆内存分配。
+ * 容量在 Init() 时确定并向上取整为2的幂，队列满时 Push() 返回false，由调用者决定如何处理。
+ */
+template <typename T>
+class CMPMCQueue
+{
+public:
+	CMPMCQueue() : m_buffer(nullptr), m_mask(0), m_enqueuePos(0), m_dequeuePos(0) {}
+	~CMPMCQueue() { delete[] m_buffer; }
+
+	CMPMCQueue(const CMPMCQueue&) = delete;
+	CMPMCQueue& operator=(const CMPMCQueue&) = delete;
+
+	/**
+	 * @brief 分配环形数组，必须在任何线程使用队列之前调用
+	 * @param capacity 期望容量，会被向上取整为2的幂（最小为2）
+	 */
+	void Init(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+
+		delete[] m_buffer;
+		m_buffer = new Cell[size];
+		for (size_t i = 0; i < size; ++i)
+			m_buffer[i].sequence.store(i, std::memory_order_relaxed);
+		m_mask = size - 1;
+		m_enqueuePos.store(0, std::memory_order_relaxed);
+		m_dequeuePos.store(0, std::memory_order_relaxed);
+	}
+
+	size_t Capacity() const { return m_mask + 1; }
+
+	/**
+	 * @brief 入队一个元素
+	 * @return 成功返回true，队列满返回false
+	 */
+	bool Push(const T& data)
+	{
+		Cell* cell;
+		size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &m_buffer[pos & m_mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if (dif == 0)
+			{
+				//这个槽位空闲，抢占入队位置
+				if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (dif < 0)
+			{
+				//槽位还没被上一轮的消费者取走，队列满
+				return false;
+			}
+			else
+			{
+				//被其他生产者抢先了，重新读取位置
+				pos = m_enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+		cell->data = data;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * @brief 批量入队，一次CAS预留一段连续槽位，再逐个填入
+	 * @param data  要入队的元素数组
+	 * @param count 元素个数
+	 * @return 实际入队的个数，队列剩余空间不足时只入队前面一部分（可能为0）
+	 */
+	size_t PushBulk(const T* data, size_t count)
+	{
+		if (count == 0)
+			return 0;
+
+		size_t n;
+		size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			size_t head = m_dequeuePos.load(std::memory_order_acquire);
+			intptr_t used = (intptr_t)(pos - head);
+			if (used < 0)
+			{
+				//pos是旧值，消费者已经越过它了，重新读
+				pos = m_enqueuePos.load(std::memory_order_relaxed);
+				continue;
+			}
+			size_t freeCount = (size_t)used >= Capacity() ? 0 : Capacity() - (size_t)used;
+			n = (count < freeCount) ? count : freeCount;
+			if (n == 0)
+				return 0;
+			if (m_enqueuePos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+				break;
+		}
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			Cell* cell = &m_buffer[(pos + i) & m_mask];
+			//预留时按消费者位置算过空间，上一轮占用这个槽位的消费者已经取得了位置，这里最多短暂等它读完
+			while (cell->sequence.load(std::memory_order_acquire) != pos + i)
+				;
+			cell->data = data[i];
+			cell->sequence.store(pos + i + 1, std::memory_order_release);
+		}
+		return n;
+	}
+
+	/**
+	 * @brief 出队一个元素
+	 * @return 成功返回true，队列空返回false
+	 */
+	bool Pop(T& data)
+	{
+		Cell* cell;
+		size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &m_buffer[pos & m_mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (dif == 0)
+			{
+				if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (dif < 0)
+			{
+				//槽位还没有数据，队列空
+				return false;
+			}
+			else
+			{
+				pos = m_dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+		data = cell->data;
+		cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * @brief 粗略的队列长度，并发修改时只是个近似值，用于负载均衡之类的启发式判断
+	 */
+	size_t SizeApprox() const
+	{
+		size_t tail = m_enqueuePos.load(std::memory_order_relaxed);
+		size_t head = m_dequeuePos.load(std::memory_order_relaxed);
+		return (tail > head) ? (tail - head) : 0;
+	}
+
+	/**
+	 * @brief 粗略判断队列是否为空，只用于"要不要去睡眠"这类判断，不作为精确依据
+	 */
+	bool Empty() const
+	{
+		return m_dequeuePos.load(std::memory_order_acquire) >= m_enqueuePos.load(std::memory_order_acquire);
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;  //槽位序号：==pos表示可写，==pos+1表示可读
+		T                   data;
+	};
+
+	Cell*                                     m_buffer;      //环形数组
+	size_t                                    m_mask;        //容量-1，用于取模
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_enqueuePos; //生产者位置，独占一个缓存行
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_dequeuePos; //消费者位置，独占一个缓存行，整个类按缓存行对齐，后面的对象也挤不进这一行
+};
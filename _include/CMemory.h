@@ -1,11 +1,70 @@
 #pragma once
 #include <stddef.h>  //NULL
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+//内存池：按大小分档，每档是固定大小的内存块
+//每条线程先从自己的缓存里取/还，不加锁；缓存空了从全局仓库整批取，缓存多了整批还给全局仓库；全局仓库也空了再向系统要一大块切开
+//收包线程分配、业务线程释放这类跨线程的内存，就这样成批在线程之间流转，不会每次都抢一把锁
+#define MEM_BLOCK_HEADER     16                    //每个内存块前面的块头大小，记录档位，同时保证返回的地址16字节对齐
+#define MEM_MIN_CLASS_SHIFT  6                     //最小一档64字节（含块头）
+#define MEM_CLASS_COUNT      10                    //64,128,...,32768字节共10档，最大一档放得下消息头+最大的包(_PKG_MAX_LENGTH)
+#define MEM_CLASS_LARGE      MEM_CLASS_COUNT       //超过最大一档的直接向系统要，统计时单独算一档
+#define MEM_BATCH_BYTES      (64 * 1024)           //线程缓存和全局仓库之间一次搬运大约这么多字节的内存块
+#define MEM_BATCH_MAX        32                    //一次最多搬这么多块
+#define MEM_SLAB_BYTES       (256 * 1024)          //全局仓库不够时一次向系统要这么多字节
+
+//内存池向系统要内存的方式；大页模式下向系统按2MB整块要，再从里面切出一块块MEM_SLAB_BYTES
+#define MEM_BACKING_HEAP     0                     //普通堆内存
+#define MEM_BACKING_THP      1                     //2MB对齐的匿名映射，建议内核用透明大页
+#define MEM_BACKING_HUGETLB  2                     //显式大页(MAP_HUGETLB)，系统没有预留大页时退回透明大页
+#define MEM_HUGE_PAGE_BYTES  (2 * 1024 * 1024)
+
+//分配时标明内存是哪个子系统要的，打开内存统计后按这个分开统计
+#define MEM_TAG_OTHER        0                     //没有标明的
+#define MEM_TAG_RECV         1                     //收包缓冲（消息头+包头+包体），一直到业务处理完
+#define MEM_TAG_SEND         2                     //回包、发送缓冲
+#define MEM_TAG_TIMER        3                     //心跳检测时间队列里的消息头
+#define MEM_TAG_CONN         4                     //连接池里的连接
+#define MEM_TAG_CORO         5                     //协程帧
+#define MEM_TAG_ARENA        6                     //请求临时内存不够时要的块
+#define MEM_TAG_STORE        7                     //账号、会话表
+#define MEM_TAG_COUNT        8
+
+//内存统计方式
+#define MEM_PROFILE_OFF      0                     //不统计，分配释放时只多一次判断
+#define MEM_PROFILE_SAMPLED  1                     //每条线程每N次分配统计一次，统计值按N放大，开销很小，可以在线上一直开着
+#define MEM_PROFILE_FULL     2                     //每次分配都统计，数字准确，多线程抢同一个计数器，排查问题时用
+#define MEM_PROFILE_SAMPLE_MAX 0xFFFFFF            //采样间隔最大值，块头里只有24位记采样权重
+
+//某一档的统计
+struct MemClassStats
+{
+	size_t   iBlockSize;     //块大小（含块头），超大内存这里为0
+	uint64_t iCarved;        //从系统要来切好的块数，超大内存为当前还没释放的块数
+	uint64_t iDepotFree;     //全局仓库里空闲的块数
+	uint64_t iAllocCount;    //累计分配次数
+	uint64_t iFreeCount;     //累计释放次数
+};
+
+//某个子系统（MEM_TAG_xxx）的统计，采样方式下都是按采样间隔放大后的估计值
+struct MemTagStats
+{
+	uint64_t iAllocCount;    //累计分配次数
+	uint64_t iAllocBytes;    //累计分配字节数（按块大小算，含块头）
+	uint64_t iFreeCount;     //累计释放次数
+	int64_t  iLiveBytes;     //当前在用的字节数
+	int64_t  iPeakBytes;     //在用字节数的最高值
+	uint64_t iHist[MEM_CLASS_COUNT + 1]; //按档位的分配次数，最后一个是超大内存
+};
 
 //内存相关类
 class CMemory
 {
 private:
-	CMemory() {}  //构造函数，因为要做成单例类，所以构造函数是私有的
+	CMemory();  //构造函数，因为要做成单例类，所以构造函数是私有的
 
 public:
 	~CMemory() {};
@@ -42,8 +101,83 @@ public:
 	};
 
 public:
-	void* AllocMemory(int memCount, bool ifmemset);  //分配内存
-	void FreeMemory(void* point);                    //释放内存
-};
+	void* AllocMemory(int memCount, bool ifmemset, int tag = MEM_TAG_OTHER);  //分配内存，tag标明是哪个子系统要的
+	void FreeMemory(void* point);                    //释放内存，可以在任何线程上释放，不要求和分配在同一条线程
+	void GetStats(MemClassStats* pStats);            //取各档统计，pStats要有MEM_CLASS_COUNT+1个元素，最后一个是超大内存
+	static size_t GetCapacity(void* point);          //AllocMemory()分配出去的内存实际可用的字节数（块大小减块头）
+	static int GetClass(void* point);                //AllocMemory()分配出去的内存在哪一档，超大内存返回MEM_CLASS_LARGE
+
+	//设置向系统要内存的方式，在worker进程开始分配连接池、起线程之前调用
+	//preallocBytes：马上要这么多内存并且把每一页都碰一遍，运行期间不再有缺页；lockMem：锁住内存不让换出
+	void SetBacking(int backing, size_t preallocBytes, bool lockMem);
+	void GetBackingInfo(size_t& hugeBytes, size_t& thpBytes, size_t& lockedBytes); //显式大页/透明大页方式映射的字节数，以及锁住的字节数
+
+	//内存统计：mode为MEM_PROFILE_xxx，sampleEvery是采样方式下每多少次分配统计一次
+	//打开之前分配的内存释放时不计入，所以在用字节数只反映打开之后分配的内存
+	void SetProfiling(int mode, int sampleEvery);
+	int GetProfilingMode() const { return m_iProfileMode.load(std::memory_order_relaxed); }
+	void GetTagStats(MemTagStats* pStats);           //取各子系统统计，pStats要有MEM_TAG_COUNT个元素
+	static const char* GetTagName(int tag);
 
+	struct ThreadCache;
 
+private:
+	struct FreeBlock
+	{
+		FreeBlock* next;
+	};
+
+	//全局仓库，每档一个
+	struct Depot
+	{
+		std::mutex mutex;
+		FreeBlock* head;
+		int        count;
+	};
+
+	static int  sizeClass(size_t size);              //size字节（含块头）落在哪一档，超过最大一档返回MEM_CLASS_LARGE
+	static size_t classSize(int cls) { return (size_t)1 << (cls + MEM_MIN_CLASS_SHIFT); }
+	static int  batchCount(int cls);                 //这一档一次搬运多少块
+	ThreadCache* getThreadCache();                   //当前线程的缓存，第一次用时创建
+	void refill(ThreadCache* pCache, int cls);       //线程缓存空了，从全局仓库取一批
+	void flush(ThreadCache* pCache, int cls, int keep); //线程缓存多了，只留keep块，其余还给全局仓库
+	void carve(int cls);                             //全局仓库也空了，向系统要一大块切成这一档的块放进仓库
+	char* allocSlab(size_t bytes);                   //向系统要一大块，调用者持有m_slabMutex
+	bool mapRegion(size_t bytes);                    //按大页方式映射一段新的区域，调用者持有m_slabMutex
+	void carveTail();                                //当前区域剩下的切成小块放进全局仓库，调用者持有m_slabMutex
+	uint32_t sampleWeight(ThreadCache* pCache, int mode); //这次分配要不要统计，要统计返回权重，不统计返回0
+	void recordAlloc(int tag, int cls, size_t bytes, uint32_t weight);
+	void recordFree(int tag, size_t bytes, uint32_t weight);
+	void registerCache(ThreadCache* pCache);
+	void unregisterCache(ThreadCache* pCache);       //线程退出时调用，缓存的块还给全局仓库，统计并入已退出线程的累计值
+
+	Depot                   m_depot[MEM_CLASS_COUNT];
+	std::atomic<uint64_t>   m_iCarved[MEM_CLASS_COUNT + 1];  //各档从系统要来的块数；超大内存为当前没释放的块数
+	std::mutex              m_slabMutex;                     //保护m_slabs和下面几个向系统要内存有关的成员
+	std::vector<void*>      m_slabs;                         //向系统要来的大块，进程退出前一直留在池里
+	int                     m_iBacking;                      //MEM_BACKING_xxx
+	bool                    m_bLockMem;                      //新映射的区域要不要锁住
+	char*                   m_pRegionCur;                    //大页模式下当前区域还没切出去的部分
+	char*                   m_pRegionEnd;
+	size_t                  m_iHugeBytes;                    //用显式大页映射的字节数
+	size_t                  m_iThpBytes;                     //用透明大页映射的字节数
+	size_t                  m_iLockedBytes;                  //锁住的字节数
+	std::mutex              m_cacheMutex;                    //保护下面两个成员
+	std::vector<ThreadCache*> m_caches;                      //所有线程的缓存，统计时遍历
+	uint64_t                m_iRetiredAlloc[MEM_CLASS_COUNT + 1]; //已退出线程的累计分配次数
+	uint64_t                m_iRetiredFree[MEM_CLASS_COUNT + 1];  //已退出线程的累计释放次数
+
+	//各子系统的统计计数，每个子系统独占缓存行，不同子系统之间不互相干扰
+	struct alignas(64) TagCounter
+	{
+		std::atomic<uint64_t> iAllocCount;
+		std::atomic<uint64_t> iAllocBytes;
+		std::atomic<uint64_t> iFreeCount;
+		std::atomic<int64_t>  iLiveBytes;
+		std::atomic<int64_t>  iPeakBytes;
+		std::atomic<uint64_t> iHist[MEM_CLASS_COUNT + 1];
+	};
+	std::atomic<int>        m_iProfileMode;                  //MEM_PROFILE_xxx
+	std::atomic<int>        m_iSampleEvery;                  //采样间隔
+	TagCounter              m_tags[MEM_TAG_COUNT];
+};
@@ -0,0 +1,71 @@
+#pragma once
+#include <stddef.h>
+
+#include "CMemory.h"
+
+struct _STRUC_MSG_HEADER;
+
+/**
+ * @class CMsgBuf
+ * @brief 独占所有权的消息内存句柄
+ *
+ * 收包、入线程池、业务处理、协程挂起、回包、发送，消息内存在整条链路上都由一个 CMsgBuf 持有，
+ * 只能移动不能复制，句柄析构时把内存还给内存池，不用再到处记着"这块内存这时候该谁释放"。
+ * 容量和所在档位记在内存池的块头里，连接和序号记在消息头里，句柄本身只有一个指针大小。
+ * 只有交给无锁队列时才用 Release() 交出裸指针，从队列里取出来马上 Adopt() 接回来。
+ */
+class CMsgBuf
+{
+public:
+	CMsgBuf() : m_pBuf(nullptr) {}
+	CMsgBuf(CMsgBuf&& other) noexcept : m_pBuf(other.m_pBuf) { other.m_pBuf = nullptr; }
+	CMsgBuf& operator=(CMsgBuf&& other) noexcept
+	{
+		if (this != &other)
+		{
+			Reset();
+			m_pBuf = other.m_pBuf;
+			other.m_pBuf = nullptr;
+		}
+		return *this;
+	}
+	CMsgBuf(const CMsgBuf&) = delete;
+	CMsgBuf& operator=(const CMsgBuf&) = delete;
+	~CMsgBuf() { Reset(); }
+
+	//从内存池分配iLen字节，tag见MEM_TAG_xxx
+	static CMsgBuf Alloc(int iLen, bool ifmemset = false, int tag = MEM_TAG_OTHER)
+	{
+		return CMsgBuf((char*)CMemory::GetInstance()->AllocMemory(iLen, ifmemset, tag));
+	}
+	//接管从内存池分配的裸指针，只用于从队列里取出之前Release()交出去的内存
+	static CMsgBuf Adopt(char* pBuf) { return CMsgBuf(pBuf); }
+
+	char* Data() const { return m_pBuf; }
+	//交出所有权，调用者负责之后再Adopt()回来
+	char* Release()
+	{
+		char* p = m_pBuf;
+		m_pBuf = nullptr;
+		return p;
+	}
+	//释放持有的内存，之后句柄为空
+	void Reset()
+	{
+		if (m_pBuf != nullptr)
+		{
+			CMemory::GetInstance()->FreeMemory(m_pBuf);
+			m_pBuf = nullptr;
+		}
+	}
+	explicit operator bool() const { return m_pBuf != nullptr; }
+
+	size_t Capacity() const { return m_pBuf != nullptr ? CMemory::GetCapacity(m_pBuf) : 0; } //实际可用的字节数
+	int PoolClass() const { return m_pBuf != nullptr ? CMemory::GetClass(m_pBuf) : -1; } //来自内存池的哪一档，空句柄返回-1
+	_STRUC_MSG_HEADER* Header() const { return (_STRUC_MSG_HEADER*)m_pBuf; } //消息头，里面有连接和序号
+
+private:
+	explicit CMsgBuf(char* pBuf) : m_pBuf(pBuf) {}
+
+	char* m_pBuf;
+};
@@ -0,0 +1,138 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+//proto/*.msg生成的消息编解码代码用的公共部分，业务代码一般不直接用
+//
+//包体编码（和包头一样都是网络序）：
+//  字段类型只有bool、u8～u64、i8～i64、string，整数和bool可以是数组
+//  整数、bool    定长，大端，bool占1字节
+//  string        2字节长度 + 内容，没有结尾的0，内容按字节原样放，也可以装二进制数据
+//  数组          2字节元素个数 + 元素（只支持整数和bool元素）
+//  optional      1字节是否带了(0/1) + 带了才有的值；optional字段只能在消息末尾，
+//                包体在某个optional字段之前结束就当后面的都没带，所以老客户端不带新加的字段也能解析
+//新版本只能在消息末尾加optional字段，而且服务器要先升级：包体比服务器认识的最大长度还长会在收包线程被扔掉
+
+/**
+ * @class CMsgCodec
+ * @brief 大端读写定长整数，按字节拷贝，不要求对齐
+ */
+class CMsgCodec
+{
+public:
+	template<typename T> static T Load(const char* p)
+	{
+		static_assert(std::is_integral<T>::value, "只能读整数");
+		if constexpr (sizeof(T) == 1)
+		{
+			return (T)*p;
+		}
+		else
+		{
+			std::make_unsigned_t<T> v;
+			memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			v = byteSwap(v);
+#endif
+			return (T)v;
+		}
+	}
+
+	template<typename T> static void Store(char* p, T value)
+	{
+		static_assert(std::is_integral<T>::value, "只能写整数");
+		if constexpr (sizeof(T) == 1)
+		{
+			*p = (char)value;
+		}
+		else
+		{
+			std::make_unsigned_t<T> v = (std::make_unsigned_t<T>)value;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			v = byteSwap(v);
+#endif
+			memcpy(p, &v, sizeof(v));
+		}
+	}
+
+private:
+	static uint16_t byteSwap(uint16_t v) { return __builtin_bswap16(v); }
+	static uint32_t byteSwap(uint32_t v) { return __builtin_bswap32(v); }
+	static uint64_t byteSwap(uint64_t v) { return __builtin_bswap64(v); }
+};
+
+/**
+ * @class CMsgArray
+ * @brief 包体里一个数组的只读视图，不拷贝，取元素时才按大端读
+ */
+template<typename T>
+class CMsgArray
+{
+public:
+	CMsgArray() : m_p(nullptr), m_iCount(0) {}
+	CMsgArray(const char* p, unsigned short iCount) : m_p(p), m_iCount(iCount) {}
+
+	unsigned short size() const { return m_iCount; }
+	bool empty() const { return m_iCount == 0; }
+	//调用者保证i < size()
+	T operator[](unsigned short i) const { return CMsgCodec::Load<T>(m_p + (size_t)i * sizeof(T)); }
+
+private:
+	const char*    m_p;
+	unsigned short m_iCount;
+};
+
+/**
+ * @class CMsgCursor
+ * @brief 生成的Parse()用来顺着包体检查每个字段的边界并记下位置
+ *
+ * 所有长度检查都在这里做，Parse()成功之后访问器按记下的位置直接读，不会越界。
+ */
+class CMsgCursor
+{
+public:
+	CMsgCursor(const char* p, size_t iLen) : m_p(p), m_iLen(iLen), m_iPos(0) {}
+
+	bool AtEnd() const { return m_iPos == m_iLen; }
+
+	//定长字段，iOffset记下字段的位置
+	bool Fixed(size_t iSize, unsigned short& iOffset)
+	{
+		if (m_iLen - m_iPos < iSize)
+			return false;
+		iOffset = (unsigned short)m_iPos;
+		m_iPos += iSize;
+		return true;
+	}
+
+	//变长字段：2字节个数 + 个数*iElemSize字节，个数不能超过iMaxCount；iOffset记下内容（不含个数）的位置
+	bool Var(size_t iElemSize, size_t iMaxCount, unsigned short& iOffset, unsigned short& iCount)
+	{
+		if (m_iLen - m_iPos < 2)
+			return false;
+		size_t n = CMsgCodec::Load<uint16_t>(m_p + m_iPos);
+		if (n > iMaxCount || m_iLen - m_iPos - 2 < n * iElemSize)
+			return false;
+		iOffset = (unsigned short)(m_iPos + 2);
+		iCount = (unsigned short)n;
+		m_iPos += 2 + n * iElemSize;
+		return true;
+	}
+
+	//optional字段前的1字节，只能是0或者1
+	bool Presence(bool& bHas)
+	{
+		if (m_iPos >= m_iLen || (unsigned char)m_p[m_iPos] > 1)
+			return false;
+		bHas = (m_p[m_iPos] != 0);
+		m_iPos++;
+		return true;
+	}
+
+private:
+	const char* m_p;
+	size_t      m_iLen;
+	size_t      m_iPos;
+};
@@ -0,0 +1,26 @@
+#pragma once
+#include <vector>
+
+#define NUMA_MAX_NODES   64        //最多认这么多个节点，set_mempolicy的节点掩码用一个unsigned long
+
+/**
+ * @class CNuma
+ * @brief NUMA节点拓扑和绑定
+ *
+ * 从/sys/devices/system/node读出有几个节点、每个节点有哪些CPU，不依赖libnuma。
+ * worker进程在起线程、分配连接池和内存池之前调用BindToNode()：CPU亲和性和内存策略都会被之后创建的线程继承，
+ * 所以收包、业务线程都跑在这个节点上，连接池、消息内存也都优先从这个节点分配。
+ */
+class CNuma
+{
+public:
+	static const std::vector<int>& OnlineNodes();           //在线节点的编号，按/sys/devices/system/node/online，读不到拓扑只有节点0
+	static int NodeCount() { return (int)OnlineNodes().size(); } //节点数
+	static bool NodeCpus(int node, std::vector<int>& cpus); //节点上的CPU编号，只取当前进程允许用的
+	static int WorkerNode(int workerIndex) { return OnlineNodes()[workerIndex % NodeCount()]; } //第几个worker进程放在哪个节点上，轮流分到各节点
+	static bool BindToNode(int node);                       //当前进程绑到这个节点的CPU上，内存优先从这个节点分配
+
+	//每个CPU上收到的连接该交给哪个worker：交给这个CPU所在节点上的worker，节点上有多个worker时按CPU轮流分
+	//返回的下标对应cpuWorker里的CPU编号，没有worker的节点上的CPU为-1
+	static void CpuToWorker(int workerCount, std::vector<int>& cpuWorker);
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#define REQ_ARENA_INLINE_SIZE   4096      //业务线程处理一个请求时栈上自带的临时内存，一般的请求用不完
+#define REQ_ARENA_CHUNK_SIZE    8192      //自带的用完了，每次从内存池要这么大一块（含块头），要的更大就按要的大小
+
+/**
+ * @class CReqArena
+ * @brief 一个请求的临时内存，只分配不单独释放，请求处理完整体回收
+ *
+ * 处理函数里要用的临时对象、临时缓冲都从这里按指针递增分配，不用一次次找内存池要、一次次还。
+ * 先用构造时给的一段内存（通常在业务线程的栈上或者协程帧里），用完了才向内存池要块，析构时一次还掉。
+ * 只能放不需要析构的对象；只在处理这个请求的线程上用，不加锁。
+ * 处理函数要用就在函数里定义一个CReqArenaBuf局部变量，用不着的处理函数什么都不用做，也不多花一次初始化。
+ */
+class CReqArena
+{
+public:
+	CReqArena(char* pInline, size_t iInlineSize) : m_pCur(pInline), m_pEnd(pInline + iInlineSize), m_pChunks(nullptr), m_pInline(pInline), m_iInlineSize(iInlineSize) {}
+	CReqArena(const CReqArena&) = delete;
+	CReqArena& operator=(const CReqArena&) = delete;
+	~CReqArena() { freeChunks(); }
+
+	//分配size字节，align必须是2的幂，不超过16；内存池也要不到时返回nullptr
+	void* Alloc(size_t size, size_t align = 16)
+	{
+		char* p = (char*)(((uintptr_t)m_pCur + (align - 1)) & ~(uintptr_t)(align - 1));
+		if (p > m_pEnd || size > (size_t)(m_pEnd - p))  //不写成p + size > m_pEnd，size很大时指针会绕回去
+			return allocSlow(size, align);
+		m_pCur = p + size;
+		return p;
+	}
+
+	//在临时内存上构造一个对象，对象不会被析构，所以只能是不需要析构的类型；要不到内存返回nullptr
+	template<typename T, typename... Args>
+	T* New(Args&&... args)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "CReqArena上的对象不会被析构");
+		static_assert(alignof(T) <= 16, "CReqArena最多16字节对齐");
+		void* p = Alloc(sizeof(T), alignof(T));
+		return (p != nullptr) ? new (p) T(std::forward<Args>(args)...) : nullptr;
+	}
+
+	//一段连续的数组，不初始化；count太大或者要不到内存返回nullptr
+	template<typename T>
+	T* NewArray(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "CReqArena上的对象不会被析构");
+		static_assert(alignof(T) <= 16, "CReqArena最多16字节对齐");
+		if (count > SIZE_MAX / sizeof(T))
+			return nullptr;
+		return (T*)Alloc(sizeof(T) * count, alignof(T));
+	}
+
+	void Reset();                                   //整体回收，向内存池要的块还回去，回到只用自带内存的状态
+
+	static uint64_t GetChunkAllocCount() { return s_iChunkAllocCount.load(std::memory_order_relaxed); } //自带内存不够而向内存池要块的累计次数
+
+private:
+	struct Chunk
+	{
+		Chunk* next;
+		size_t iSize;                               //块里可用的字节数，不含Chunk本身
+	};
+
+	void* allocSlow(size_t size, size_t align);     //当前这块不够了，向内存池要一块
+	void freeChunks();
+
+	char*  m_pCur;                                  //下一次从这里分配
+	char*  m_pEnd;                                  //当前这块的末尾
+	Chunk* m_pChunks;                               //向内存池要来的块，最新的在前
+	char*  m_pInline;                               //构造时给的内存
+	size_t m_iInlineSize;
+
+	static std::atomic<uint64_t> s_iChunkAllocCount;
+};
+
+//自带N字节内存的CReqArena，放在栈上或者协程帧里用
+template<size_t N>
+class CReqArenaBuf : public CReqArena
+{
+public:
+	CReqArenaBuf() : CReqArena(m_buf, N) {}
+
+private:
+	alignas(16) char m_buf[N];
+};
@@ -2,6 +2,7 @@
 
 #include <vector>       //vector
 #include <list>         //list
+#include <deque>
 #include <sys/epoll.h>  //epoll
 #include <sys/socket.h>
 #include <pthread.h>    //多线程
@@ -11,11 +12,15 @@
 #include<mutex>
 #include<memory>
 #include<thread>
+#include <type_traits>
 
 #include"comm.h"
+#include"CMsgBuf.h"
+#include"CMPMCQueue.h"
 
 #define LISTEN_BACKLOG 511  //已完成连接的队列
 #define MAX_EVENTS     512  //epoll_wait一次最多接收这么多个事件
+#define SEND_PURGE_QUEUE_SIZE   1024 //等发送线程清掉发送队列里的包的已关闭连接最多排这么多个，满了就由发送线程遇到时逐个丢弃
 
 typedef struct listening_s   listening_t, * lplistening_t;
 typedef struct connection_s  connection_t, * lpconnection_t;
@@ -37,6 +42,8 @@ struct listening_s
 	int                       port;        //监听的端口号
 	int                       fd;          //套接字句柄socket
 	lpconnection_t        connection;  //连接池中的一个连接，注意这是个指针 
+	int                       worker;      //按NUMA节点分发连接时这个socket归第几个worker进程，-1表示所有worker共用
+	int                       integrity;   //从这个端口连进来的连接默认用哪种包校验算法_PKG_INTEGRITY_xxx
 };
 
 
@@ -76,16 +83,20 @@ struct connection_s
 
 	//和收包有关
 	unsigned char             curStat;                        //当前收包的状态
+	unsigned short            rateCount[_MSG_RATE_SLOTS];     //每个限速命令在当前1秒窗口里已经收了几个包，只有收包线程访问
+	uint64_t                  rateWindowStart[_MSG_RATE_SLOTS]; //每个限速命令当前窗口的开始时间（毫秒）
 	char                      dataHeadInfo[_DATA_BUFSIZE_];   //用于保存收到的数据的包头信息			
 	char* precvbuf;                      //接收数据的缓冲区的头指针，对收到不全的包非常有用，看具体应用的代码
 	unsigned int              irecvlen;                       //要收到多少数据，由这个变量指定，和precvbuf配套使用，看具体应用的代码
-	char* precvMemPointer;               //new出来的用于收包的内存首地址，释放用的
+	CMsgBuf                   precvMemPointer;                //收包用的消息内存（消息头+包头+包体），收完整后移交给线程池
+	unsigned int              irecvcrc;                       //边收包体边算的CRC中间值，只有Sock_StreamCrc打开时有用
+	std::atomic<unsigned char> iIntegrity;                    //这个连接收发包用的校验算法_PKG_INTEGRITY_xxx，业务线程处理切换命令时会改
 
 	std::mutex          logicPorcMutex;                 //逻辑处理相关的互斥量      
 
 	//和发包有关
 	std::atomic<int>          iThrowsendCount;                //发送消息，如果发送缓冲区满了，则需要通过epoll事件来驱动消息的继续发送，所以如果发送缓冲区满，则用这个变量标记
-	char* psendMemPointer;               //发送完成后释放用的，整个数据的头指针，其实是 消息头 + 包头 + 包体
+	CMsgBuf                   psendMemPointer;                //正在发送的消息内存（消息头+包头+包体），发送完成后Reset()释放
 	char* psendbuf;                      //发送数据的缓冲区的头指针，开始 其实是包头+包体
 	unsigned int              isendlen;                       //要发送多少数据
 
@@ -93,12 +104,14 @@ struct connection_s
 	time_t                    inRecyTime;                     //入到资源回收站里去的时间
 
 	//和心跳包有关
-	time_t                    lastPingTime;                   //上次ping的时间【上次发送心跳包的事件】
+	std::atomic<time_t>       lastPingTime;                   //上次ping的时间【上次发送心跳包的事件】，收包线程、业务线程写，超时检测线程读
 
 	//和网络安全有关	
 	uint64_t                  FloodkickLastTime;              //Flood攻击上次收到包的时间
 	int                       FloodAttackCount;               //Flood攻击在该时间内收到包的次数统计
+	int                       RejectPkgCount;                 //连着被命令表扔掉的包数，收到一个合法的包清0
 	std::atomic<int>          iSendCount;                     //发送队列中有的数据条目数，若client只发不收，则可能造成此数过大，依据此数做出踢出处理 
+	std::deque<std::list<CMsgBuf>::iterator> sendQueued;      //本连接在发送队列里的包，按入队顺序，关连接时按这个直接删，受发送队列的锁保护
 
 
 	//--------------------------------------------------
@@ -115,9 +128,79 @@ typedef struct _STRUC_MSG_HEADER
 {
 	lpconnection_t pConn;         //记录对应的链接，注意这是个指针
 	uint64_t           iCurrsequence; //收到数据包时记录对应连接的序号，将来能用于比较是否连接已经作废用
+	uint64_t           iEnqueueTime;  //进入线程池接收队列的时刻(steady_clock，微秒)，用来统计排队时延
+	unsigned char      iPriority;     //消息优先级_MSG_PRIO_xxx，收到包头时按命令码确定
+	unsigned char      iPool;         //交给哪个线程池_MSG_POOL_xxx，收到包头时按命令码确定
+	unsigned char      iCrcChecked;   //收包线程已经边收边校验过CRC，业务线程不用再算
+	unsigned char      iIntegrity;    //收到包头时连接用的校验算法，包体按这个校验，中途切换算法不影响已经在收的包
 	//......其他以后扩展	
 }STRUC_MSG_HEADER, * LPSTRUC_MSG_HEADER;
 
+/**
+ * @class CPkgBuilder
+ * @brief 组一个要发出去的包
+ *
+ * 构造时按包体长度从内存池一次分配 消息头+包头+包体，只填发送线程要用的连接和序号，不拷贝整个收到的消息头；
+ * 处理函数直接往Body()里写包体，写完交给CSocket::msgSend()，那里再填包长、命令码、按连接的校验算法算crc32，然后入发送队列。
+ * 变长的包先按最大长度构造，写完用SetBodyLen()改成实际长度。
+ */
+class CPkgBuilder
+{
+public:
+	//回复一个请求：连接、序号、校验算法都用收到请求时的
+	CPkgBuilder(LPSTRUC_MSG_HEADER pReqHeader, unsigned short iMsgCode, unsigned short iBodyLen)
+		: CPkgBuilder(pReqHeader->pConn, pReqHeader->iCurrsequence, pReqHeader->iIntegrity, iMsgCode, iBodyLen) {}
+	//主动发给一个连接：校验算法用连接当前的
+	CPkgBuilder(lpconnection_t pConn, unsigned short iMsgCode, unsigned short iBodyLen)
+		: CPkgBuilder(pConn, pConn->iCurrsequence, pConn->iIntegrity.load(std::memory_order_relaxed), iMsgCode, iBodyLen) {}
+	CPkgBuilder(CPkgBuilder&&) = default;
+
+	char* Body() const { return m_msg.Data() + sizeof(STRUC_MSG_HEADER) + sizeof(COMM_PKG_HEADER); }
+	template<typename T> T* BodyAs() const
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "包体只能是可以直接按字节读写的结构");
+		return (T*)Body();
+	}
+	unsigned short BodyLen() const { return m_iBodyLen; }
+	void SetBodyLen(unsigned short iLen) { m_iBodyLen = (iLen < m_iMaxBodyLen) ? iLen : m_iMaxBodyLen; } //只能改小
+	void SetIntegrity(int iIntegrity) { m_iIntegrity = (unsigned char)iIntegrity; } //这个包改用别的校验算法，比如切换校验算法的回包
+
+private:
+	friend class CSocket;
+	CPkgBuilder(lpconnection_t pConn, uint64_t iCurrsequence, unsigned char iIntegrity, unsigned short iMsgCode, unsigned short iBodyLen)
+		: m_msg(CMsgBuf::Alloc(sizeof(STRUC_MSG_HEADER) + sizeof(COMM_PKG_HEADER) + iBodyLen, false, MEM_TAG_SEND)),
+		  m_iMsgCode(iMsgCode), m_iBodyLen(iBodyLen), m_iMaxBodyLen(iBodyLen), m_iIntegrity(iIntegrity)
+	{
+		LPSTRUC_MSG_HEADER pMsgHeader = m_msg.Header();
+		pMsgHeader->pConn = pConn;
+		pMsgHeader->iCurrsequence = iCurrsequence;
+	}
+
+	CMsgBuf        m_msg;
+	unsigned short m_iMsgCode;
+	unsigned short m_iBodyLen;
+	unsigned short m_iMaxBodyLen;
+	unsigned char  m_iIntegrity;
+};
+
+/**
+ * @struct MsgMeta
+ * @brief 一个命令的元数据
+ *
+ * 子类的命令表在编译期生成，收包线程收到包头时按命令码直接下标取一次，包体长度、限速在分配内存之前就检查掉，
+ * 优先级和线程池记进消息头给线程池用，业务处理函数拿到的包体长度一定在范围内。
+ */
+struct MsgMeta
+{
+	unsigned short minBodyLen;   //包体最短长度
+	unsigned short maxBodyLen;   //包体最长长度，定长的包两个一样
+	unsigned short rateLimit;    //每个连接每秒最多收这么多个这个命令的包，0表示不限
+	unsigned char  rateSlot;     //限速计数用连接的第几个槽，编译期分配
+	unsigned char  priority;     //_MSG_PRIO_xxx
+	unsigned char  pool;         //_MSG_POOL_xxx
+	bool           inlineSafe;   //只有包头时能在收包线程上直接处理
+};
+
 /**
  * @class CSocket
  * @brief 用于处理套接字连接和网络事件的类
@@ -135,22 +218,36 @@ public:
     virtual void Shutdown_subproc(); ///< 子进程资源清理
 
     void printTDInfo(); ///< 打印线程数据
+    void printMemProfile(); ///< 把内存池按子系统的统计输出到控制台日志
 
-    virtual void threadRecvProcFunc(char* pMsgBuf); ///< 处理客户端请求的虚函数
+    virtual void threadRecvProcFunc(CMsgBuf& msg); ///< 处理客户端请求的虚函数，交给协程时把msg移走
+    virtual void procRejectedMsg(const CMsgBuf& msg); ///< 线程池丢弃一条消息前调用
     virtual void procPingTimeOutChecking(LPSTRUC_MSG_HEADER tmpmsg, time_t cur_time); ///< 心跳包超时检测
+    virtual const MsgMeta* getMsgMeta(unsigned short iMsgCode); ///< 命令码对应的元数据，不认识的命令返回nullptr
+    virtual void procInlinePkg(lpconnection_t pConn, LPCOMM_PKG_HEADER pPkgHeader); ///< 在收包线程上直接处理只有包头的包
 
+    void SetWorkerIndex(int index) { m_iWorkerIndex = index; } ///< 当前是第几个worker进程，在epoll_init()之前设置
+    void CloseWorkerListenSockets(); ///< 主进程起完worker后调用，关掉每个worker专用的监听socket
     int epoll_init(); ///< 初始化 epoll 功能
     //int epoll_add_event(int fd, int readevent, int writevent, uint32_t otherflag, uint32_t eventtype, std::shared_ptr<connection_t> c); ///< 添加 epoll 事件
     int epoll_process_events(int timer); ///< 处理 epoll 事件
     int epoll_oper_event(int fd, uint32_t eventtype, uint32_t flag, int bcaction, lpconnection_t pConn);///<epoll操作事件
 
 protected:
-    void msgSend(char* psendbuf); ///< 发送数据
+    void msgSend(CMsgBuf&& msg); ///< 发送数据，消息内存交给发送队列
+    void msgSend(CPkgBuilder&& pkg); ///< 填好包头、算好校验值后发送
+    void sendPkgInline(lpconnection_t pConn, char* pPkg, unsigned short iPkgLen); ///< 收包线程上直接回包，只能由收包线程调用
     void zdClosesocketProc(lpconnection_t p_Conn); ///< 关闭连接
+    void purgeSendQueue(lpconnection_t pConn); ///< 让发送线程清掉已关闭连接在发送队列里的包
 
 private:
     void ReadConf(); ///< 读取配置
+    CMsgBuf sealPkg(CPkgBuilder&& pkg); ///< 填包长、命令码、crc32，交出消息内存
+    void drainSendPurge(); ///< 清掉已关闭连接在发送队列里的包，调用者持有发送队列的锁
+    void pushSendQueue(CMsgBuf&& msg); ///< 放到发送队列末尾并记进连接的待发列表，调用者持有发送队列的锁
+    std::list<CMsgBuf>::iterator eraseSendQueue(lpconnection_t pConn, std::list<CMsgBuf>::iterator pos); ///< 从发送队列和连接的待发列表里删掉，调用者持有发送队列的锁
     bool open_listening_sockets(); ///< 打开监听套接字
+    bool attach_reuseport_steering(int fd, int workerCount); ///< 给一组SO_REUSEPORT监听socket装上按CPU所在节点选socket的BPF程序
     void close_listening_sockets(); ///< 关闭监听套接字
     bool setnonblocking(int sockfd); ///< 设置非阻塞模式
 
@@ -162,10 +259,14 @@ private:
 
     ssize_t recvproc(lpconnection_t pConn, char* buff, ssize_t buflen); //接收从客户端来的数据专用函数
     void wait_request_handler_proc_p1(lpconnection_t pConn, bool& isflood);
+    bool checkMsgRate(lpconnection_t pConn, const MsgMeta* pMeta); ///< 按命令的限速检查这个连接，超了返回false
+    void discard_request_handler(lpconnection_t pConn); ///< 收下命令表不接受的包的包体直接扔掉
     //包头收完整后的处理，我们称为包处理阶段1：写成函数，方便复用      
+    bool checkStreamCrc(lpconnection_t pConn); ///< 校验边收边算出来的CRC
     void wait_request_handler_proc_plast(lpconnection_t pConn, bool& isflood);
     //收到一个完整包后的处理，放到一个函数中，方便调用	
     void clearMsgSendQueue();                                             //处理发送消息队列  
+    void flushRecvBatch();                                                //把本轮epoll收到的完整包一次性交给线程池
 
     ssize_t sendproc(lpconnection_t c, char* buff, ssize_t size);       //将数据发送到客户端 
 
@@ -198,6 +299,7 @@ protected:
 
     int m_ifTimeOutKick; ///< 是否开启超时踢出功能
     int m_iWaitTime; ///< 等待时间
+    int m_iIntegrityAllowMask; ///< 客户端可以切换到哪些校验算法，第i位对应_PKG_INTEGRITY_xxx的值i
 
 private:
     struct ThreadItem
@@ -211,6 +313,8 @@ private:
 
     int m_worker_connections; ///< 最大连接数
     int m_ListenPortCount; ///< 监听端口数量
+    int m_iNumaEnable; ///< 是否按NUMA节点绑定worker、分发连接
+    int m_iWorkerIndex; ///< 当前是第几个worker进程
     int m_epollhandle; ///< epoll 句柄
 
     std::list<lpconnection_t> m_connectionList; ///< 连接池
@@ -226,9 +330,15 @@ private:
     
     std::vector<std::shared_ptr<listening_t>> m_ListenSocketList;  ///<监听套接字列表
     struct epoll_event m_events[MAX_EVENTS]; ///< epoll 事件列表
+    std::vector<CMsgBuf> m_recvBatch[_MSG_POOL_COUNT]; ///< 本轮epoll_wait中收完整的包，按线程池分开，循环结束时一次性入线程池，只有收包线程访问
+    uint64_t m_iInlinePkgCount; ///< 在收包线程上直接处理掉的包数量，只有收包线程访问
+    uint64_t m_iRejectPkgCount; ///< 命令不认识、包体长度不对或者超过限速，收包线程上直接扔掉的包数量，只有收包线程访问
+    int m_iStreamCrc; ///< 是否在收包线程上边收包体边算CRC，校验不过的包不进线程池
+    uint64_t m_iCrcDropCount; ///< 收包线程上CRC校验不过而丢弃的包数量，只有收包线程访问
 
-    std::list<char*> m_MsgSendQueue; ///< 发送消息队列
+    std::list<CMsgBuf> m_MsgSendQueue; ///< 发送消息队列，队列持有消息内存
     std::atomic<int> m_iSendMsgQueueCount; ///< 消息队列大小
+    CMPMCQueue<lpconnection_t> m_sendPurgeQueue; ///< 刚关闭、发送队列里还有包的连接，发送线程拿到锁后清掉
 
     std::vector<std::shared_ptr<ThreadItem>> m_threadVector; ///< 线程池
     std::mutex m_sendMessageQueueMutex; ///< 发送队列互斥量
@@ -245,8 +355,13 @@ private:
     int m_floodAkEnable; ///< Flood 攻击检测是否启用
     unsigned int m_floodTimeInterval; ///< Flood 攻击检测时间间隔
     int m_floodKickCount; ///< Flood 攻击踢出次数
+    int m_rejectKickCount; ///< 连着这么多个包被命令表扔掉就踢出，0表示不踢
+    int m_rateLimitEnable; ///< 是否按命令表里的限速扔包
 
     time_t m_lastprintTime; ///< 上次打印统计信息的时间
-    int m_iDiscardSendPkgCount; ///< 丢弃的发送数据包数量
+    time_t m_lastMemProfileTime; ///< 上次输出内存统计的时间，算分配速率用
+    uint64_t m_lastMemTagAlloc[MEM_TAG_COUNT]; ///< 上次输出时各子系统的累计分配次数
+    std::atomic<int> m_iDiscardSendPkgCount; ///< 丢弃的发送数据包数量
+    std::atomic<uint64_t> m_iPurgedSendPkgCount; ///< 连接关闭时从发送队列里直接清掉的包数量
 };
 
@@ -0,0 +1,216 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <type_traits>
+
+#include "CMemory.h"
+
+#define STRIPED_TABLE_INIT_SLOTS  16      //每个分片第一次插入时的槽数
+#define STRIPED_TABLE_MAX_BITS    12      //最多2^12个分片
+
+#define STRIPED_INSERT_OK         0
+#define STRIPED_INSERT_EXISTS     1       //已经有一样的了，没插入
+#define STRIPED_INSERT_FULL       2       //分片到了上限
+
+/**
+ * @class CStripedTable
+ * @brief 按哈希值分片加锁的开放寻址哈希表，很多线程同时查只抢各自分片的读锁
+ *
+ * Slot是直接放在槽数组里的定长条目，要有一个uint64_t hash成员，hash为0表示空槽（调用者保证有效条目的hash不为0）。
+ * hash的高位选分片、低位选槽，线性探测，装填超过3/4时这个分片单独扩容，别的分片照常读写。
+ * 不支持单个删除：过期之类要清掉的条目在插入时顺带整理，探测路上碰到stale()为true的槽就直接拿来放新条目，
+ * 分片要扩容或者到了上限时，先重建一遍把stale()为true的都去掉。
+ * 条目总数上限平均分到各个分片，每个分片满了只整理自己，不用去动别的分片的锁。
+ * 槽数组从内存池分配，记在MEM_TAG_STORE下。
+ */
+template<typename Slot>
+class CStripedTable
+{
+	static_assert(std::is_trivially_copyable<Slot>::value, "槽数组按字节清零、拷贝，Slot只能是简单结构");
+
+public:
+	CStripedTable() : m_pShards(nullptr), m_iShardBits(0), m_iShardMax(0), m_iCount(0) {}
+	CStripedTable(const CStripedTable&) = delete;
+	CStripedTable& operator=(const CStripedTable&) = delete;
+	~CStripedTable()
+	{
+		if (m_pShards == nullptr)
+			return;
+		for (size_t i = 0; i < shardCount(); i++)
+		{
+			if (m_pShards[i].slots != nullptr)
+				CMemory::GetInstance()->FreeMemory(m_pShards[i].slots);
+		}
+		delete[] m_pShards;
+	}
+
+	//分片数是2^iShardBits，iMaxCount是整张表最多放多少条，每个分片最多放iMaxCount/分片数（向上取整）条；槽数组用到时才分配
+	void Init(int iShardBits, uint32_t iMaxCount)
+	{
+		m_iShardBits = (iShardBits < 0) ? 0 : ((iShardBits > STRIPED_TABLE_MAX_BITS) ? STRIPED_TABLE_MAX_BITS : iShardBits);
+		m_iShardMax = (uint32_t)(((uint64_t)iMaxCount + shardCount() - 1) >> m_iShardBits);
+		m_pShards = new Shard[shardCount()];
+	}
+
+	uint32_t Count() const { return m_iCount.load(std::memory_order_relaxed); }
+
+	//找hash相等并且match(slot)为true的条目，找到了拷贝到out
+	template<typename Match>
+	bool Find(uint64_t hash, Match&& match, Slot& out) const
+	{
+		const Shard& shard = shardOf(hash);
+		std::shared_lock<std::shared_mutex> lock(shard.lock);
+		if (shard.slots == nullptr)
+			return false;
+		for (uint32_t i = (uint32_t)hash & shard.mask; shard.slots[i].hash != 0; i = (i + 1) & shard.mask)
+		{
+			if (shard.slots[i].hash == hash && match(shard.slots[i]))
+			{
+				out = shard.slots[i];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	//插入slot，已经有match()为true的就不插；stale()为true的条目可以被新条目顶掉，或者在整理分片时被扔掉
+	//返回STRIPED_INSERT_xxx
+	template<typename Match, typename Stale>
+	int Insert(const Slot& slot, Match&& match, Stale&& stale)
+	{
+		return insert(slot, match, stale, false);
+	}
+
+	//和Insert()一样，只是已经有match()为true的就用slot把它覆盖掉，返回STRIPED_INSERT_OK
+	template<typename Match, typename Stale>
+	int Replace(const Slot& slot, Match&& match, Stale&& stale)
+	{
+		return insert(slot, match, stale, true);
+	}
+
+	//遍历所有条目，比如释放条目指向的内存；不要和插入同时调用
+	template<typename Fn>
+	void ForEach(Fn&& fn)
+	{
+		for (size_t s = 0; m_pShards != nullptr && s < shardCount(); s++)
+		{
+			Shard& shard = m_pShards[s];
+			for (uint32_t i = 0; shard.slots != nullptr && i <= shard.mask; i++)
+			{
+				if (shard.slots[i].hash != 0)
+					fn(shard.slots[i]);
+			}
+		}
+	}
+
+private:
+	//每个分片独占缓存行，相邻分片的锁不会互相抢缓存行
+	struct alignas(64) Shard
+	{
+		mutable std::shared_mutex lock;
+		Slot*    slots = nullptr;
+		uint32_t mask = 0;         //槽数-1
+		uint32_t count = 0;
+	};
+
+	size_t shardCount() const { return (size_t)1 << m_iShardBits; }
+	Shard& shardOf(uint64_t hash) const { return m_pShards[m_iShardBits == 0 ? 0 : (hash >> (64 - m_iShardBits))]; }
+
+	//bReplace为true时覆盖match()为true的条目，否则不插
+	template<typename Match, typename Stale>
+	int insert(const Slot& slot, Match& match, Stale& stale, bool bReplace)
+	{
+		Shard& shard = shardOf(slot.hash);
+		std::unique_lock<std::shared_mutex> lock(shard.lock);
+		if (shard.slots != nullptr)
+		{
+			//整条探测链都要看完，确认没有一样的，才能用路上的过期槽；过期槽本来就占着位置，顶掉它不影响别的条目的探测链
+			Slot* pReuse = nullptr;
+			for (uint32_t i = (uint32_t)slot.hash & shard.mask; shard.slots[i].hash != 0; i = (i + 1) & shard.mask)
+			{
+				if (shard.slots[i].hash == slot.hash && match(shard.slots[i]))
+				{
+					if (bReplace == false)
+						return STRIPED_INSERT_EXISTS;
+					shard.slots[i] = slot;
+					return STRIPED_INSERT_OK;
+				}
+				if (pReuse == nullptr && stale(shard.slots[i]))
+					pReuse = &shard.slots[i];
+			}
+			if (pReuse != nullptr)
+			{
+				*pReuse = slot;  //条目数不变
+				return STRIPED_INSERT_OK;
+			}
+		}
+
+		if (shard.slots == nullptr || (shard.count + 1) * 4 > (shard.mask + 1) * 3 || shard.count >= m_iShardMax)
+		{
+			//先扔掉过期的，剩下的还是太满才扩容
+			if (rebuild(shard, shard.slots == nullptr ? STRIPED_TABLE_INIT_SLOTS : shard.mask + 1, stale) == false)
+				return STRIPED_INSERT_FULL;
+			if (shard.count >= m_iShardMax)
+				return STRIPED_INSERT_FULL;
+			if ((shard.count + 1) * 4 > (shard.mask + 1) * 3 && rebuild(shard, (shard.mask + 1) * 2, stale) == false)
+				return STRIPED_INSERT_FULL;
+		}
+
+		uint32_t i = (uint32_t)slot.hash & shard.mask;
+		while (shard.slots[i].hash != 0)
+			i = (i + 1) & shard.mask;
+		shard.slots[i] = slot;
+		shard.count++;
+		m_iCount.fetch_add(1, std::memory_order_relaxed);
+		return STRIPED_INSERT_OK;
+	}
+
+	//换成iSlots个槽的新数组，去掉stale()为true的条目；分配失败返回false，原来的数组不动
+	template<typename Stale>
+	bool rebuild(Shard& shard, uint32_t iSlots, Stale& stale)
+	{
+		Slot* pNew;
+		try
+		{
+			pNew = (Slot*)CMemory::GetInstance()->AllocMemory((int)(sizeof(Slot) * iSlots), true, MEM_TAG_STORE);
+		}
+		catch (const std::bad_alloc&)
+		{
+			return false;  //内存池分配失败是抛异常，这里当作分片满了，不让业务线程带着分片的写锁崩掉
+		}
+		uint32_t mask = iSlots - 1, count = 0, dropped = 0;
+		for (uint32_t j = 0; shard.slots != nullptr && j <= shard.mask; j++)
+		{
+			const Slot& s = shard.slots[j];
+			if (s.hash == 0)
+				continue;
+			if (stale(s))
+			{
+				dropped++;
+				continue;
+			}
+			uint32_t i = (uint32_t)s.hash & mask;
+			while (pNew[i].hash != 0)
+				i = (i + 1) & mask;
+			pNew[i] = s;
+			count++;
+		}
+		if (shard.slots != nullptr)
+			CMemory::GetInstance()->FreeMemory(shard.slots);
+		shard.slots = pNew;
+		shard.mask = mask;
+		shard.count = count;
+		m_iCount.fetch_sub(dropped, std::memory_order_relaxed);
+		return true;
+	}
+
+	Shard*                m_pShards;
+	int                   m_iShardBits;
+	uint32_t              m_iShardMax;   //每个分片最多放多少条
+	std::atomic<uint32_t> m_iCount;      //所有分片的条目总数，只用来统计
+};
@@ -7,52 +7,237 @@
 #include <atomic>
 #include <memory>
 #include <chrono>
+#include <coroutine>
+#include <deque>
+#include <map>
+#include <string>
+#include <functional>
+#include <unordered_map>
 #include<list>
 
+#include "CMPMCQueue.h"
+#include "CEventCount.h"
+#include "comm.h"
+#include "CMsgBuf.h"
+
+#define RECVMSGQUEUE_DEFAULT_SIZE  131072  //接收消息队列默认总容量（条目数，各优先级加起来），超过容量的消息直接丢弃
+#define RECVLANEQUEUE_MIN_SIZE     256     //连接亲和/工作窃取模式下每条线程私有队列的最小容量
+#define RESUMEQUEUE_SIZE           65536   //协程恢复队列容量，满了放到加锁的溢出队列里，不会丢
+
+//线程池的消息分派方式
+#define POOL_SCHED_SHARED          0       //所有线程共享一个接收队列，谁空闲谁处理
+#define POOL_SCHED_AFFINE          1       //按连接哈希到固定线程，同一连接的消息总在同一线程上按顺序处理
+#define POOL_SCHED_STEAL           2       //每条线程一个私有队列，收包线程挑一条线程投递，空闲线程从忙的线程那里窃取
+#define POOL_SCHED_FAIR            3       //每个连接一个小队列，线程按差额轮转(DRR)在连接之间公平取消息，一个客户端狂发也只占自己那份
+
+//公平队列模式的参数
+#define POOL_FAIR_QUANTUM          1024    //每轮给每个连接的额度(字节)，按包长扣减，额度不够就轮到下一个连接
+#define POOL_FAIR_FLOW_MAX         256     //每个连接最多排队的消息数，超过的丢弃
+
+//共享队列模式下各优先级的调度权重：每(高+普通+低)次取消息中，分别优先从对应优先级的队列取这么多次
+//优先的队列空了就按优先级从高到低去取别的队列，不会让线程空等；低优先级也有固定份额，不会被饿死
+#define POOL_PRIO_WEIGHT_HIGH      8
+#define POOL_PRIO_WEIGHT_NORMAL    4
+#define POOL_PRIO_WEIGHT_LOW       1
+
+//管理线程：处理协程定时器；共享队列模式下还负责线程数自动伸缩
+#define POOL_SAMPLE_INTERVAL_MS    10      //管理线程每隔多少毫秒醒来一次，采样正在干活的线程数、检查到期的协程定时器
+#define POOL_ADJUST_INTERVAL_MS    500     //每隔多少毫秒根据采样结果决定一次要不要伸缩
+#define POOL_GROW_TICKS            2       //连续这么多个周期都忙不过来才扩容
+#define POOL_SHRINK_TICKS          10      //连续这么多个周期都很闲才缩容，比扩容慢得多，避免来回抖动
+#define POOL_BUSY_PERCENT          90      //平均利用率达到这个百分比且队列有积压，算忙
+#define POOL_IDLE_PERCENT          30      //平均利用率低于这个百分比且排队时延很低，算闲
+
+//排队过久的消息直接丢弃（CoDel的思路，按排队时延而不是队列长度判断过载）
+//排队时延连续一个观察周期都高于目标值，说明积压已经消不掉了，算过载；过载时排队超过目标值的消息都丢弃，不过载时只丢超过最长排队时间的
+#define POOL_CODEL_TARGET_MS       0       //目标排队时延，0表示不按排队时延丢弃
+#define POOL_CODEL_INTERVAL_MS     200     //观察周期
+#define POOL_QUEUE_DEADLINE_MS     0       //不过载时消息最长排队时间，0表示不限
+
+//线程池处理一条消息的回调，要留着消息（比如交给挂起的协程）就把msg移走，没移走的回调返回后由句柄释放
+using MsgProcFunc = std::function<void(CMsgBuf& msg)>;
+//线程池丢弃一条消息前的回调（比如给客户端回个"服务器忙"），只能读不能接管，回调返回后释放
+using MsgRejectFunc = std::function<void(const CMsgBuf& msg)>;
+
+class CCoEvent;
+
 class CThreadPool
 {
 public:
-    // ���캯��
-    CThreadPool() : m_iRunningThreadNum(0), m_iRecvMsgQueueCount(0) 
+    // 构造函数，name只用于日志和统计输出，区分不同的线程池
+    explicit CThreadPool(const std::string& name = "default") : m_strName(name), m_shutdown(false), m_bRunning(false), m_iThreadNum(0), m_iSchedMode(POOL_SCHED_SHARED), m_iRunningThreadNum(0), m_iRecvMsgQueueCount(0), m_iDiscardRecvPkgCount(0),
+        m_iNextLane(0), m_iStealCount(0), m_iIdleCount(0),
+        m_iMinThreadNum(0), m_iMaxThreadNum(0), m_iDelayHighUs(0), m_iDelayLowUs(0), m_iRetireRequest(0),
+        m_iDelaySumUs(0), m_iDelayCount(0), m_iAvgDelayUs(0), m_iUtilization(0), m_iGrowCount(0), m_iShrinkCount(0), m_iHotTicks(0), m_iColdTicks(0),
+        m_iResumeOverflowCount(0), m_iNextResumeLane(0),
+        m_iCodelTargetUs(POOL_CODEL_TARGET_MS * 1000ULL), m_iCodelIntervalUs(POOL_CODEL_INTERVAL_MS * 1000ULL), m_iDeadlineUs(POOL_QUEUE_DEADLINE_MS * 1000ULL),
+        m_iFirstAboveUs(0), m_iStaleDropCount(0), m_iCancelledCount(0),
+        m_iFairQuantum(POOL_FAIR_QUANTUM), m_iFairFlowMax(POOL_FAIR_FLOW_MAX), m_iFairCapacity(RECVMSGQUEUE_DEFAULT_SIZE), m_iFairQueued(0)
     {
 
     };
 
-    // ��������
+    // 析构函数
     ~CThreadPool();
 
 public:
-    bool Create(int threadNum);                   // �����̳߳��е������߳�
-    void StopAll();                               // ʹ�̳߳��е������߳��˳�
+    void SetAutoResize(int minThreads, int maxThreads, int delayHighMs, int delayLowMs); // 在Create()之前调用，开启线程数自动伸缩
+    void SetMsgProc(MsgProcFunc fn) { m_msgProc = std::move(fn); } // 在Create()之前调用，设置处理消息的回调
+    void SetMsgReject(MsgRejectFunc fn) { m_msgReject = std::move(fn); } // 在Create()之前调用，设置丢弃消息前的回调
+    void SetQueueDelayLimit(int targetMs, int intervalMs, int deadlineMs); // 在Create()之前调用，设置按排队时延丢弃消息的参数
+    void SetFairQueue(int quantum, int flowMax);  // 在Create()之前调用，设置公平队列模式下每轮的额度(字节)和每个连接的队列长度
+    bool Create(int threadNum, int queueSize = RECVMSGQUEUE_DEFAULT_SIZE, int schedMode = POOL_SCHED_SHARED); // 创建线程池中的所有线程
+    void StopAll();                               // 使线程池中的所有线程退出
 
-    void inMsgRecvQueueAndSignal(char* buf);  // �յ�һ��������Ϣ������Ϣ���У��������̳߳��е��߳�����������Ϣ
-    void Call();                                  // ����һ���̳߳��е��߳�����������
-    int getRecvMsgQueueCount() const;             // ��ȡ������Ϣ���д�С
+    void inMsgRecvQueueAndSignal(CMsgBuf&& msg);  // 收到一个完整消息后，入消息队列，并触发线程池中的线程来处理该消息
+    void inMsgRecvQueueBatchAndSignal(CMsgBuf* msgs, int count); // 一批完整消息一次入队（msgs全部被接管，之后为空），只唤醒需要的线程数，只能由收包线程调用
+    void Call();                                  // 唤醒一个线程池中的线程来干活
+    void PostResume(std::coroutine_handle<> h);   // 把挂起的协程交回线程池继续执行，任何线程都可以调用
+    void PostResumeAfter(std::coroutine_handle<> h, int ms); // ms毫秒后把协程交回线程池
+    void AddEventWaiter(std::coroutine_handle<> h, CCoEvent* pEvent); // 登记挂在CCoEvent上的协程，线程池退出时还没等到的直接销毁
+    void RemoveEventWaiter(std::coroutine_handle<> h); // 协程等到了或者不用挂起了，注销
+    int getRecvMsgQueueCount() const;             // 获取接收消息队列大小
+    size_t getRecvMsgQueueCount(int prio) const;  // 获取共享队列模式下某个优先级的队列大小（近似值）
+    int getDiscardRecvPkgCount() const;           // 获取因队列满而丢弃的消息数量
+    uint64_t getStaleDropCount() const { return m_iStaleDropCount; } // 因排队过久而丢弃的消息数量
+    uint64_t getCancelledCount() const { return m_iCancelledCount; } // 因连接已关闭而跳过的消息数量
+    bool isOverloaded() const;                    // 是否处于过载状态（排队时延持续高于目标值）
+    bool isConnAffine() const { return m_iSchedMode == POOL_SCHED_AFFINE; } // 同一连接的消息是否保证串行处理
+    int getFairFlowCount();                       // 公平队列模式下有消息在排队的连接数
+    bool isRunning() const { return m_bRunning; } // 是否已经Create()并且还没StopAll()
+    const std::string& getName() const { return m_strName; }
+    static CThreadPool* Current() { return t_pCurrent; } // 当前线程所属的线程池，不是线程池的线程返回nullptr
+    uint64_t getStealCount() const { return m_iStealCount; }  // 工作窃取模式下成功窃取的消息数量
+    uint64_t getIdleCount() const { return m_iIdleCount; }    // 线程因无活可干而睡眠的次数
+    int getThreadNum() const { return m_iThreadNum; }         // 当前线程数
+    int getAvgQueueDelayUs() const { return m_iAvgDelayUs; }  // 上个伸缩周期消息平均排队时延(微秒)
+    int getUtilization() const { return m_iUtilization; }     // 上个伸缩周期线程平均利用率(百分比)
+    uint64_t getGrowCount() const { return m_iGrowCount; }    // 扩容次数
+    uint64_t getShrinkCount() const { return m_iShrinkCount; }// 缩容次数
+    int getCoTimerCount();                        // 在定时器上挂起的协程数量
 
 private:
-    static void ThreadFunc(void* threadData);      //���̵߳��̻߳ص�����
-    void clearMsgRecvQueue();                     // ����������Ϣ����
+    static void ThreadFunc(void* threadData);      //新线程的线程回调函数
+    static void ManageThreadFunc(void* threadData);//管理线程：协程定时器到期处理、线程数伸缩
+    void clearMsgRecvQueue();                     // 清理接收消息队列
 
 private:
     struct ThreadItem
     {
-        std::thread _Handle;                      // �̶߳���
-        bool ifRunning;                            // ����߳��Ƿ���������
+        std::thread _Handle;                      // 线程对象
+        bool ifRunning;                            // 标记线程是否正式启动
         CThreadPool* _pThis;
-        ThreadItem(CThreadPool* pthis) : ifRunning(false),_pThis(pthis) {}
+        int iIndex;                               // 本线程在线程容器中的下标
+        CMPMCQueue<char*> laneQueue;              // 连接亲和/工作窃取模式下本线程私有的接收队列
+        CEventCount laneEv;                       // 连接亲和模式下本线程在这上面睡眠
+        std::atomic<bool> ifRetired;              // 因缩容而退出，等管理线程回收
+        unsigned int iSchedTick;                  // 共享队列模式下本线程取消息的次数，按权重轮转优先级用
+        ThreadItem(CThreadPool* pthis, int index) : ifRunning(false),_pThis(pthis),iIndex(index),ifRetired(false),iSchedTick(0) {}
+    };
+
+    //公平队列模式下一个连接的消息队列，只在m_fairMutex保护下访问
+    struct FairFlow
+    {
+        void* pKey;                               // 连接对象的地址
+        std::deque<char*> msgs;                   // 这个连接排队的消息
+        int iDeficit;                             // 本轮还剩的额度(字节)
     };
 
+    bool hasLanes() const { return m_iSchedMode == POOL_SCHED_AFFINE || m_iSchedMode == POOL_SCHED_STEAL; } // 是否每条线程都有私有队列
+    ThreadItem* getLane(char* buf);               // 根据分派方式挑选接收这条消息的线程
+    bool popJob(ThreadItem* pThread, char*& buf); // 按分派方式取一条消息，取不到返回false，不睡眠
+    bool popSharedJob(ThreadItem* pThread, char*& buf); // 共享队列模式下按优先级权重取一条消息
+    int pushFair(char** bufs, int count);         // 公平队列模式下入队，返回入队的条数，放不下的由调用者丢弃（放不下的会被挪到bufs的后面）
+    bool popFairJob(char*& buf);                  // 公平队列模式下按差额轮转取一条消息
+    void clearFairQueue();                        // 清理公平队列
+    static int msgPriority(char* buf);            // 消息头里记录的优先级，越界的按最低处理
+    bool popResume(std::coroutine_handle<>& h);   // 取一个就绪的协程，取不到返回false
+    bool hasResume() const;                       // 粗略判断有没有就绪的协程
+    void fireCoTimers();                          // 把到期的协程交回线程池
+    void destroyPendingCoroutines();              // 线程池退出时销毁还挂起着的协程
+    CEventCount& getWaitEvent(ThreadItem* pThread); // 本线程没活干时在哪个事件上睡眠
+    void CallBatch(int count);                    // 来了count条消息，按需唤醒共享事件上睡眠的线程
+    void pushBatch(char** bufs, int count);       // 批量入队的实现，bufs里是从句柄交出来的裸指针
+    void discardRecvMsg(char** bufs, int count);  // 队列放不下的消息接回句柄，丢弃并计数
+    void rejectRecvMsg(const CMsgBuf& msg);       // 丢弃一条消息前调丢弃回调，内存随句柄释放
+    bool isStale(uint64_t sojournUs, uint64_t now); // 按排队时延判断这条消息是不是该丢弃
+
+    bool isAutoResize() const { return m_iMaxThreadNum > 0 && !hasLanes(); } // 私有队列模式下线程下标参与分派，线程数不能变
+    ThreadItem* startThread();                    // 新建一条线程并放进线程容器
+    bool tryRetire();                             // 有缩容请求时领取一个，领到的线程退出
+    void adjustThreadNum(uint64_t runningSum, int samples);    // 根据一个周期的统计决定扩容还是缩容
+    void reapRetiredThreads();                    // 回收已经退出的线程
+
 private:
-    static bool m_shutdown;                       // �߳��˳���־��false���˳���true�˳�
-    int m_iThreadNum;                             // Ҫ�������߳�����
-
-    std::atomic<int> m_iRunningThreadNum;         // ��ǰ���е��߳���
-    std::chrono::time_point<std::chrono::steady_clock> m_iLastEmgTime; // �ϴν����¼���ʱ��
-    std::vector<ThreadItem*> m_threadVector;  // �̳߳�����
-    std::list<char*> m_MsgRecvQueue;      // ��Ϣ���ն���
-    std::atomic<int> m_iRecvMsgQueueCount;                   // ������Ϣ���д�С
-    static std::mutex m_mutex;                                 // �߳�ͬ��������
-    static std::condition_variable m_cond;                      // �߳�ͬ����������
-};
+    std::string m_strName;                        // 线程池名字
+    MsgProcFunc m_msgProc;                        // 处理消息的回调
+    MsgRejectFunc m_msgReject;                    // 丢弃消息前的回调，可以为空
+    static thread_local CThreadPool* t_pCurrent;  // 当前线程所属的线程池，协程挂起后要回到原来的线程池
+    std::atomic<bool> m_shutdown;                 // 线程退出标志，false不退出，true退出
+    std::atomic<bool> m_bRunning;                 // Create()成功后为true，StopAll()后为false
+    std::atomic<int> m_iThreadNum;                // 当前线程数量，自动伸缩时会变
+    int m_iSchedMode;                             // 消息分派方式，POOL_SCHED_xxx
+
+    std::atomic<int> m_iRunningThreadNum;         // 当前正在干活的线程数
+    std::chrono::time_point<std::chrono::steady_clock> m_iLastEmgTime; // 上次报告线程不够用的时间
+    std::vector<ThreadItem*> m_threadVector;  // 线程容器
+    CMPMCQueue<char*> m_MsgRecvQueue[_MSG_PRIO_CLASSES]; // 消息接收队列（有界无锁环形队列），每个优先级一个
+    std::atomic<int> m_iRecvMsgQueueCount;                   // 接收消息队列大小
+    std::atomic<int> m_iDiscardRecvPkgCount;      // 因队列满而丢弃的消息数量
+    CEventCount m_evRecv;                         // 空闲线程在这上面睡眠，有消息入队时唤醒
+
+    std::atomic<unsigned int> m_iNextLane;        // 工作窃取模式下轮流挑选投递线程用的游标
+    std::atomic<uint64_t> m_iStealCount;          // 工作窃取模式下成功窃取的消息数量
+    std::atomic<uint64_t> m_iIdleCount;           // 线程睡眠次数
 
+    std::vector<std::pair<ThreadItem*, char*>> m_batchScratch; // 连接亲和模式下批量入队时按线程分组用，只有收包线程访问
+    std::vector<char*> m_prioScratch[_MSG_PRIO_CLASSES]; // 共享队列模式下批量入队时按优先级分组用，只有收包线程访问
+    std::vector<char*> m_releaseScratch;          // 批量入队时从句柄交出来的裸指针，只有收包线程访问
+
+    //线程数自动伸缩；Create()之后线程容器只有管理线程会增删，StopAll()先等管理线程退出再动容器
+    int m_iMinThreadNum;                          // 线程数下限
+    int m_iMaxThreadNum;                          // 线程数上限，0表示不自动伸缩
+    int m_iDelayHighUs;                           // 平均排队时延超过这个值就算忙(微秒)
+    int m_iDelayLowUs;                            // 平均排队时延低于这个值才可能算闲(微秒)
+    std::thread m_manageThread;                   // 管理线程
+    std::atomic<int> m_iRetireRequest;            // 待退出的线程数，空闲线程领取后退出
+    std::atomic<uint64_t> m_iDelaySumUs;          // 本周期出队消息的排队时延之和
+    std::atomic<uint64_t> m_iDelayCount;          // 本周期出队消息数
+    std::atomic<int> m_iAvgDelayUs;               // 上个周期平均排队时延，供外部查看
+    std::atomic<int> m_iUtilization;              // 上个周期平均利用率，供外部查看
+    std::atomic<uint64_t> m_iGrowCount;           // 扩容次数
+    std::atomic<uint64_t> m_iShrinkCount;         // 缩容次数
+    int m_iHotTicks;                              // 连续忙的周期数，只有管理线程访问
+    int m_iColdTicks;                             // 连续闲的周期数，只有管理线程访问
+
+    //协程执行器：就绪的协程放恢复队列，线程取活时优先恢复协程；定时挂起的协程由管理线程到期后放回恢复队列
+    CMPMCQueue<void*> m_resumeQueue;              // 就绪的协程句柄地址
+    std::mutex m_resumeOverflowMutex;             // 保护溢出队列
+    std::deque<void*> m_resumeOverflow;           // 恢复队列满了放这里
+    std::atomic<int> m_iResumeOverflowCount;      // 溢出队列长度，不为0时才去加锁
+    std::atomic<unsigned int> m_iNextResumeLane;  // 连接亲和模式下轮流唤醒哪条线程来恢复协程
+    std::mutex m_coTimerMutex;                    // 保护定时器
+    std::multimap<uint64_t, void*> m_coTimers;    // 到期时刻(微秒) -> 协程句柄地址
+    std::mutex m_coWaiterMutex;                   // 保护m_coWaiters
+    std::unordered_map<void*, CCoEvent*> m_coWaiters; // 挂在CCoEvent上的协程句柄地址 -> 它等的事件
+
+    //按排队时延丢弃
+    uint64_t m_iCodelTargetUs;                    // 目标排队时延(微秒)，0表示不按排队时延丢弃
+    uint64_t m_iCodelIntervalUs;                  // 观察周期(微秒)
+    uint64_t m_iDeadlineUs;                       // 不过载时最长排队时间(微秒)，0表示不限
+    std::atomic<uint64_t> m_iFirstAboveUs;        // 排队时延从这个时刻起一直高于目标值，0表示当前低于目标值
+    std::atomic<uint64_t> m_iStaleDropCount;      // 因排队过久而丢弃的消息数量
+    std::atomic<uint64_t> m_iCancelledCount;      // 因连接已关闭而跳过的消息数量
+
+    //公平队列：高优先级消息仍走无锁的高优先级队列，其他消息按连接分开排队；连接之间的轮转顺序是全局的，用一把锁保护
+    int m_iFairQuantum;                           // 每轮给每个连接的额度(字节)
+    int m_iFairFlowMax;                           // 每个连接最多排队的消息数
+    int m_iFairCapacity;                          // 所有连接排队消息数的上限
+    std::mutex m_fairMutex;                       // 保护下面几个成员
+    std::unordered_map<void*, FairFlow*> m_fairFlows; // 连接对象地址 -> 有消息在排队的连接
+    std::deque<FairFlow*> m_fairActive;           // 轮转顺序，队头的连接正在被服务
+    std::vector<FairFlow*> m_fairFreeFlows;       // 用完的FairFlow留着复用，避免连接来来去去时反复分配
+    std::vector<char*> m_fairRejectScratch;       // 入队时放不下的消息先放这里
+    std::atomic<int> m_iFairQueued;               // 所有连接排队的消息数，取消息前不加锁先看一眼
+};
 
@@ -0,0 +1,82 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string_view>
+
+#include "CStripedTable.h"
+
+#define USER_STORE_SHARDS          64        //分片数默认值，按2的幂向上取
+#define USER_STORE_MAX_USERS       1000000   //账号数上限默认值
+#define USER_STORE_MAX_SESSIONS    1000000   //会话数上限默认值
+#define USER_STORE_SESSION_TIMEOUT 3600      //会话有效期默认值，秒
+#define USER_NAME_MAX_LEN          255       //用户名、密码最长多少字节，协议里的限制比这个小
+#define SESSION_TOKEN_LEN          16        //会话令牌字节数
+
+/**
+ * @class CUserStore
+ * @brief 内存里的账号表和会话表，注册、登录的处理函数在多个业务线程上同时用
+ *
+ * 账号、会话都按用户名的哈希各放一张CStripedTable，查找只加所在分片的读锁，不同用户的注册登录基本不会抢同一把锁。
+ * 账号只加不删，记录单独分配、按用户名实际长度分配；会话直接放在槽里，每个账号只有一个，重新登录就顶掉原来的，
+ * 过期的在插入时顺带清掉，会话数不会超过账号数。
+ * 只在当前worker进程的内存里，进程退出就没了，WorkerProcesses大于1时各个worker的账号互不相通。
+ * 口令只存加盐的XXH3摘要，防不了拿到内存后的离线暴力破解，账号要落盘时得换成专门的口令哈希算法。
+ */
+class CUserStore
+{
+public:
+	CUserStore();
+	~CUserStore();
+
+	//fork()之前调用，iShards按2的幂向上取
+	void Init(int iShards, uint32_t iMaxUsers, uint32_t iMaxSessions, int iSessionTimeout);
+	//重新取用户名哈希的随机前缀，每个worker进程fork()之后、还没有账号时调用，各个worker的前缀不一样
+	void Rekey();
+
+	//注册，成功时iUserId是新账号的id；返回_RESULT_xxx
+	int Register(std::string_view username, std::string_view password, int32_t iType, uint32_t& iUserId);
+	//用密码登录，成功时换一个新会话，原来的令牌作废，token是会话令牌(SESSION_TOKEN_LEN字节)；返回_RESULT_xxx
+	int Login(std::string_view username, std::string_view password, uint32_t& iUserId, char* token);
+	//凭会话令牌登录，令牌要是这个用户的并且没过期；返回_RESULT_xxx
+	int Resume(std::string_view username, std::string_view token, uint32_t& iUserId);
+
+	uint32_t UserCount() const { return m_users.Count(); }
+	uint32_t SessionCount() const { return m_sessions.Count(); }
+
+private:
+	//账号记录，按用户名实际长度分配
+	struct UserRec
+	{
+		uint64_t iPwdDigest;   //XXH3(盐 + 密码)
+		uint64_t iSalt;
+		uint32_t iUserId;
+		int32_t  iType;
+		uint8_t  iNameLen;
+		char     name[1];      //实际有iNameLen字节，没有结尾的0
+	};
+	struct UserSlot
+	{
+		uint64_t hash;         //用户名的哈希
+		UserRec* pRec;
+	};
+	//会话直接放在槽里，每个账号一个
+	struct SessionSlot
+	{
+		uint64_t hash;         //用户名的哈希，和账号表里的一样
+		uint64_t iTokenLo;     //令牌前8字节
+		uint64_t iTokenHi;     //令牌后8字节
+		uint32_t iUserId;
+		uint32_t iExpireTime;  //time()到这个值就过期
+	};
+
+	uint64_t nameHash(std::string_view username) const;
+	static uint64_t pwdDigest(uint64_t iSalt, std::string_view password);
+	bool findUser(std::string_view username, UserSlot& slot) const;
+
+	CStripedTable<UserSlot>    m_users;
+	CStripedTable<SessionSlot> m_sessions;
+	uint64_t                   m_iHashKey;          //用户名哈希的随机前缀，客户端没法事先算出一批落在同一个槽的用户名
+	int                        m_iSessionTimeout;
+	std::atomic<uint32_t>      m_iNextUserId;
+};
@@ -0,0 +1,16 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @class CXXHash
+ * @brief XXH3 64位哈希（种子为0，默认密钥），和官方xxHash库的XXH3_64bits()结果一致
+ *
+ * 不是CRC，没有纠错能力上的数学保证，但检查传输出错足够用，而且没有专门指令时也比查表CRC快得多。
+ * 只实现了一次算完整段数据的版本，包最大也就几十KB，用不着分段计算。
+ */
+class CXXHash
+{
+public:
+	static uint64_t XXH3_64(const void* data, size_t len);
+};
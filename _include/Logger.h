@@ -276,7 +276,10 @@ private:
 
     // 格式化字符串
     std::string format(const char* fmt, va_list args) {
-        int size = std::vsnprintf(nullptr, 0, fmt, args) + 1;
+        va_list argsCopy;
+        va_copy(argsCopy, args);  // 第一次vsnprintf会把args用掉，算长度要用一份拷贝
+        int size = std::vsnprintf(nullptr, 0, fmt, argsCopy) + 1;
+        va_end(argsCopy);
         std::unique_ptr<char[]> buffer(new char[size]);
         std::vsnprintf(buffer.get(), size, fmt, args);
         return std::string(buffer.get());
@@ -41,6 +41,9 @@ public:
 	// 解除指定信号并设置其处理程序
 	void unmask_and_set_handler(int signo, SignalHandlerFunction handler);
 
+	// 只设置处理程序，信号仍然屏蔽着，由要接收它的线程自己用pthread_sigmask()解除
+	void set_handler(int signo, SignalHandlerFunction handler);
+
 	static void defaultSignalHandler(int signo, siginfo_t* siginfo, void* ucontext);
 
 	static void reapChildProcess(int signo, siginfo_t* siginfo, void* ucontext);
@@ -22,10 +22,11 @@ public:
     /**
      * @brief 构造函数，初始化 WorkerProcess 对象
      *
+     * @param workerIndex 第几个工作进程，从0开始，按NUMA节点绑定和分发连接时用
      * @param processName 进程名称，默认为 "workerserverl"
      */
-    WorkerProcess(std::string processName = "workerserverl")
-        :processName_(processName), signalHandler_(std::make_unique<MSignal>())
+    WorkerProcess(int workerIndex = 0, std::string processName = "workerserverl")
+        :workerIndex_(workerIndex), processName_(processName), signalHandler_(std::make_unique<MSignal>())
     {
     }
 
@@ -42,8 +43,10 @@ public:
     }
     
 private:
+    int workerIndex_;  ///< 第几个工作进程
     std::string processName_;  ///< 进程名称
     std::unique_ptr<MSignal> signalHandler_;  ///< 信号处理器对象
+    static volatile sig_atomic_t memProfileRequested_;  ///< 收到SIGUSR1，事件循环里输出内存统计
 
     void init_process();
 
@@ -8,10 +8,31 @@
 #define _PKG_HD_RECVING      1  //接收包头中，包头不完整，继续接收中
 #define _PKG_BD_INIT         2  //包头刚好收完，准备接收包体
 #define _PKG_BD_RECVING      3  //接收包体中，包体不完整，继续接收中，处理完后直接回到_PKG_HD_INIT状态
+#define _PKG_BD_DISCARD      4  //命令表不接受这个包，包体收下来直接扔掉，收完回到_PKG_HD_INIT状态
 
 #define _DATA_BUFSIZE_       20  //因为要先收包头，所以我定义一个固定的小数组专门用来收包头，这个数字大小一定要 >sizeof(COMM_PKG_HEADER)
                                 //这个值所以定义为20，大于后续COMM_PKG_HEADER的大小
 
+//消息优先级，线程池按优先级分别排队、按权重调度，每个命令的优先级和命令处理函数登记在一起
+#define _MSG_PRIO_HIGH       0  //延迟敏感的控制类消息，比如心跳包，不能被大量业务消息堵在后面
+#define _MSG_PRIO_NORMAL     1  //一般业务消息
+#define _MSG_PRIO_LOW        2  //处理开销大的批量业务消息
+#define _MSG_PRIO_CLASSES    3  //优先级个数
+
+//消息交给哪个线程池处理，每个命令的去向和命令处理函数登记在一起
+#define _MSG_POOL_DEFAULT    0  //默认线程池，处理快的命令
+#define _MSG_POOL_HEAVY      1  //处理开销大的命令，这类命令再多也不会把其他命令堵住；这个线程池没开时并入默认线程池
+#define _MSG_POOL_COUNT      2  //线程池个数
+
+#define _MSG_RATE_SLOTS      4  //最多这么多个命令可以设按连接限速，每个连接给每个限速命令留一个计数槽
+
+//包头crc32字段用哪种算法算，每个连接一种：连上时按监听端口的配置，之后客户端可以用命令切换
+#define _PKG_INTEGRITY_CRC32   0  //IEEE CRC-32，以前一直用的，默认
+#define _PKG_INTEGRITY_CRC32C  1  //CRC-32C（Castagnoli），x86有SSE4.2专门指令，检错能力也比IEEE的好
+#define _PKG_INTEGRITY_XXH3    2  //XXH3 64位哈希取低32位，没有专门指令的CPU上最快
+#define _PKG_INTEGRITY_NONE    3  //不校验，crc32字段填0，只给可信链路（本机、内网）用
+#define _PKG_INTEGRITY_COUNT   4
+
 //结构定义
 #pragma pack (1) //对齐方式,1字节对齐【结构之间成员不会有任何字节对齐：紧密的排列】
 
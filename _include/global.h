@@ -21,7 +21,9 @@ extern char*         gp_envmem;            //指向自己分配的env环境变
 extern int           g_daemonized;         //守护进程标记，标记是否启用了守护进程模式，0：未启用，1：已启用
 
 extern CLogicSocket  g_socket;             //socket全局对象
-extern CThreadPool   g_threadpool;         //线程池全局对象
+extern CThreadPool   g_threadpool;         //线程池全局对象，处理快的命令
+extern CThreadPool   g_heavythreadpool;    //处理开销大的命令的线程池
+extern CThreadPool*  g_msgpools[_MSG_POOL_COUNT]; //按_MSG_POOL_xxx下标找线程池
 
 extern pid_t         ngx_pid;              //当前进程的pid
 extern pid_t         ngx_parent;           //父进程的pid
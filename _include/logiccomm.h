@@ -5,25 +5,16 @@
 #define _CMD_PING				   	    _CMD_START + 0   //心跳包命令
 #define _CMD_REGISTER 		            _CMD_START + 5   //注册命令
 #define _CMD_LOGIN 		                _CMD_START + 6   //登录命令
+#define _CMD_BUSY 		                _CMD_START + 7   //服务器忙，请求排队太久或者队列满被丢弃时回给客户端，只有包头
+#define _CMD_INTEGRITY 		            _CMD_START + 8   //切换本连接包头crc32字段的校验算法，包体MsgIntegrity
 
 
+//包体的结构在proto/logic.msg里定义，编译时生成_include/logic.msg.h
 
-//结构定义
-#pragma pack (1) //对齐方式,1字节对齐【结构之间成员不会有任何字节对齐：紧密的排列】
-
-typedef struct _STRUCT_REGISTER
-{
-	int           iType;          //类型
-	char          username[56];   //用户名 
-	char          password[40];   //密码
-
-}STRUCT_REGISTER, * LPSTRUCT_REGISTER;
-
-typedef struct _STRUCT_LOGIN
-{
-	char          username[56];   //用户名 
-	char          password[40];   //密码
-
-}STRUCT_LOGIN, * LPSTRUCT_LOGIN;
-
-#pragma pack() //取消指定对齐，恢复缺省对齐
\ No newline at end of file
+//注册、登录回包里的结果
+#define _RESULT_OK                      0    //成功
+#define _RESULT_INVALID                 1    //用户名为空之类的请求不合法
+#define _RESULT_USER_EXISTS             2    //注册时用户名已经有了
+#define _RESULT_LOGIN_FAILED            3    //登录时没有这个用户或者密码不对，两种情况不区分，免得被用来试探用户名
+#define _RESULT_BAD_TOKEN               4    //会话令牌不对或者已经过期，要重新用密码登录
+#define _RESULT_FULL                    5    //账号或会话数量到了上限
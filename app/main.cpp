@@ -28,7 +28,9 @@ int     g_daemonized = 0;         //守护进程标记，标记是否启用了
 
 //socket相关
 CLogicSocket g_socket;            //socket全局对象
-CThreadPool  g_threadpool;        //线程池全局对象
+CThreadPool  g_threadpool("default");        //线程池全局对象，处理快的命令
+CThreadPool  g_heavythreadpool("heavy");    //处理开销大的命令的线程池
+CThreadPool* g_msgpools[_MSG_POOL_COUNT] = { &g_threadpool, &g_heavythreadpool }; //按_MSG_POOL_xxx下标找线程池
 
 //和进程相关的全局量
 pid_t   severl_pid;               //当前进程的pid
@@ -1,7 +1,7 @@
 .PHONY: all clean
 
 # C++标准建议使用变量定义
-CPP_STD = -std=c++17
+CPP_STD = -std=c++20
 
 # 修改CC定义
 ifeq ($(DEBUG),true)
@@ -4,8 +4,9 @@ export BUILD_ROOT = $(shell pwd)
 #定义头文件的路径变量
 export INCLUDE_PATH = $(BUILD_ROOT)/_include
 
-#定义我们要编译的目录
-BUILD_DIR = $(BUILD_ROOT)/signal/ \
+#定义我们要编译的目录，tools要最先编：它按proto/下的消息定义生成其他目录要include的头文件
+BUILD_DIR = $(BUILD_ROOT)/tools/  \
+			$(BUILD_ROOT)/signal/ \
 			$(BUILD_ROOT)/proc/   \
 			$(BUILD_ROOT)/net/    \
 			$(BUILD_ROOT)/misc/   \
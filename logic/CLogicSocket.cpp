@@ -9,6 +9,8 @@
 #include <chrono>
 #include <algorithm>
 #include <functional>
+#include <array>
+#include <iterator>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -19,30 +21,127 @@
 #include "global.h"
 #include "CMemory.h"
 #include "CCRC32.h"
+#include "CReqArena.h"
+#include "logic.msg.h"
 
-//成员指针函数
+//成员指针函数，要临时内存就在函数里定义一个CReqArenaBuf局部变量，处理函数返回时整体回收
 using handler = bool (CLogicSocket::*)(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength);
+//协程版本的成员指针函数，处理过程中需要等待（定时、其他服务、存储）时用，挂起期间不占线程
+//协程要临时内存就在函数里定义一个CReqArenaBuf局部变量，它在协程帧里，和协程帧一起分配、一起释放，挂起期间也一直有效
+using coHandler = CCoTask (CLogicSocket::*)(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength);
 
-//数组定义 成员函数指针 用来处理各种业务
-static const handler statusHandler[] =
+//可以在收包线程上直接处理的版本，只用于只有包头的包，必须足够便宜、不阻塞、不分配内存
+using inlineHandler = void (CLogicSocket::*)(lpconnection_t pConn, LPCOMM_PKG_HEADER pPkgHeader);
+
+//命令处理函数，普通函数和协程函数二选一，表里直接写成员函数地址就行
+//另外可以再给一个收包线程上直接处理的版本，标记这个命令是inline安全的，只有包头的包就不进线程池了
+struct MsgHandler
+{
+    handler       fn;
+    coHandler     cofn;
+    inlineHandler inlinefn;
+    constexpr MsgHandler() : fn(nullptr), cofn(nullptr), inlinefn(nullptr) {}
+    constexpr MsgHandler(handler f) : fn(f), cofn(nullptr), inlinefn(nullptr) {}
+    constexpr MsgHandler(coHandler f) : fn(nullptr), cofn(f), inlinefn(nullptr) {}
+    constexpr MsgHandler(handler f, inlineHandler i) : fn(f), cofn(nullptr), inlinefn(i) {}
+};
+
+//命令表的一行：命令码、处理函数和这个命令的元数据写在一起，新增命令只加一行，顺序随意
+//包体长度、限速由收包线程在收到包头时检查，处理函数里不用再检查包体长度
+struct CmdDef
+{
+    unsigned short code;        //_CMD_xxx
+    MsgHandler     handler;
+    unsigned short minBodyLen;  //包体长度范围，用下面的CMD_BODY_xxx写
+    unsigned short maxBodyLen;
+    unsigned char  priority;    //_MSG_PRIO_xxx
+    unsigned char  pool;        //_MSG_POOL_xxx
+    unsigned short rateLimit;   //每个连接每秒最多这么多个包，0不限；Sock_CmdRateLimitEnable开了才生效
+};
+#define CMD_BODY_NONE          0, 0                  //只有包头
+#define CMD_BODY_FIXED(T)      sizeof(T), sizeof(T)  //包体就是一个T
+#define CMD_BODY_RANGE(lo, hi) (lo), (hi)            //变长包体
+#define CMD_BODY_MSG(M)        M::kMinSize, M::kMaxSize //包体是proto/logic.msg里定义的消息M
+
+static constexpr CmdDef s_cmdDefs[] =
 {
-    //前5个元素，保留给一些基本的通讯功能
-    &CLogicSocket::_HandlePing,                             //序号0，心跳包实现
-    NULL,                                                   //序号1，从0开始
-    NULL,                                                   //序号2，从0开始
-    NULL,                                                   //序号3，从0开始
-    NULL,                                                   //序号4，从0开始
-
-    //开始具体的业务逻辑
-    &CLogicSocket::_HandleRegister,                         //序号5，实现具体的注册功能
-    &CLogicSocket::_HandleLogIn,                            //序号6，实现具体的登录功能
+    //命令码          处理函数                                                             包体                            优先级             线程池             限速
+    { _CMD_PING,      { &CLogicSocket::_HandlePing, &CLogicSocket::_HandlePingInline },  CMD_BODY_NONE,                   _MSG_PRIO_HIGH,   _MSG_POOL_DEFAULT, 0  }, //心跳包，处理得慢客户端会被当成超时踢掉；只有包头的心跳包直接在收包线程上处理
+    { _CMD_REGISTER,  &CLogicSocket::_HandleRegister,                                    CMD_BODY_MSG(MsgRegister),       _MSG_PRIO_LOW,    _MSG_POOL_HEAVY,   10 }, //注册，开销大
+    { _CMD_LOGIN,     &CLogicSocket::_HandleLogIn,                                       CMD_BODY_MSG(MsgLogin),          _MSG_PRIO_NORMAL, _MSG_POOL_DEFAULT, 20 }, //登录
+    { _CMD_INTEGRITY, &CLogicSocket::_HandleIntegrity,                                   CMD_BODY_MSG(MsgIntegrity),      _MSG_PRIO_HIGH,   _MSG_POOL_DEFAULT, 5  }, //切换校验算法，客户端在等回包
     //......其他待扩展，待实现功能如购买功能，实现加血功能等等
 };
-#define AUTH_TOTAL_COMMANDS sizeof(statusHandler)/sizeof(handler) //整个命令有多少个，编译时即可知道
+
+//编译期检查命令表，出错直接编译不过
+static constexpr bool checkCmdDefs()
+{
+    size_t rateSlots = 0;
+    for (size_t i = 0; i < std::size(s_cmdDefs); i++)
+    {
+        const CmdDef& d = s_cmdDefs[i];
+        if (d.handler.fn == nullptr && d.handler.cofn == nullptr)
+            return false;                                      //没有处理函数
+        if (d.minBodyLen > d.maxBodyLen || d.maxBodyLen > _PKG_MAX_LENGTH - 1000 - sizeof(COMM_PKG_HEADER))
+            return false;                                      //包体长度范围不对
+        if (d.handler.inlinefn != nullptr && d.minBodyLen != 0)
+            return false;                                      //只有包头的包才能在收包线程上处理
+        if (d.priority >= _MSG_PRIO_CLASSES || d.pool >= _MSG_POOL_COUNT)
+            return false;
+        for (size_t j = 0; j < i; j++)
+        {
+            if (s_cmdDefs[j].code == d.code)
+                return false;                                  //命令码重复
+        }
+        if (d.rateLimit != 0)
+            rateSlots++;
+    }
+    return rateSlots <= _MSG_RATE_SLOTS;                       //连接上的限速槽不够
+}
+static_assert(checkCmdDefs(), "s_cmdDefs命令表有错：缺处理函数、包体长度范围不对、命令码重复或者限速命令超过_MSG_RATE_SLOTS个");
+
+static constexpr unsigned short maxCmdCode()
+{
+    unsigned short code = 0;
+    for (const CmdDef& d : s_cmdDefs)
+        code = std::max(code, d.code);
+    return code;
+}
+#define AUTH_TOTAL_COMMANDS (maxCmdCode() + 1) //整个命令有多少个，编译时即可知道
+#define BUSY_REPLY_MAX_SENDCOUNT 64 //连接发送队列里待发的包超过这个数，请求被丢弃时就不再回"服务器忙"
+
+//按命令码直接下标的分派表，编译期从s_cmdDefs生成，没登记的命令码处理函数为空
+struct CmdEntry
+{
+    MsgHandler handler;
+    MsgMeta    meta;
+    bool       valid;
+};
+static constexpr std::array<CmdEntry, AUTH_TOTAL_COMMANDS> buildCmdTable()
+{
+    std::array<CmdEntry, AUTH_TOTAL_COMMANDS> table{};
+    unsigned char rateSlot = 0;
+    for (const CmdDef& d : s_cmdDefs)
+    {
+        CmdEntry& e = table[d.code];
+        e.handler = d.handler;
+        e.meta.minBodyLen = d.minBodyLen;
+        e.meta.maxBodyLen = d.maxBodyLen;
+        e.meta.rateLimit = d.rateLimit;
+        e.meta.rateSlot = (d.rateLimit != 0) ? rateSlot++ : 0;
+        e.meta.priority = d.priority;
+        e.meta.pool = d.pool;
+        e.meta.inlineSafe = (d.handler.inlinefn != nullptr);
+        e.valid = true;
+    }
+    return table;
+}
+static constexpr std::array<CmdEntry, AUTH_TOTAL_COMMANDS> statusHandler = buildCmdTable();
 
 //构造函数
 CLogicSocket::CLogicSocket()
 {
+    m_iRegisterFailDelayMs = 0;
 }
 
 //析构函数
@@ -55,131 +154,151 @@ CLogicSocket::~CLogicSocket()
 bool CLogicSocket::Initialize()
 {
     //做一些和本类相关的初始化工作
+    m_userStore.Init(globalconfig->GetIntDefault("UserStore_Shards", USER_STORE_SHARDS),
+                     (uint32_t)globalconfig->GetIntDefault("UserStore_MaxUsers", USER_STORE_MAX_USERS),
+                     (uint32_t)globalconfig->GetIntDefault("UserStore_MaxSessions", USER_STORE_MAX_SESSIONS),
+                     globalconfig->GetIntDefault("UserStore_SessionTimeout", USER_STORE_SESSION_TIMEOUT));
+    m_iRegisterFailDelayMs = globalconfig->GetIntDefault("RegisterFailDelayMs", 0);
     //....未来可能要扩展        
     bool bParentInit = CSocket::Initialize();  //调用父类的同名函数
     return bParentInit;
 }
 
-void CLogicSocket::SendNoBodyPkgToClient(LPSTRUC_MSG_HEADER pMsgHeader, unsigned short iMsgCode)
+//子进程初始化【fork()之后执行】
+bool CLogicSocket::Initialize_subproc()
 {
-    CMemory* p_memory = CMemory::GetInstance();
+    //哈希前缀在fork()之前定的话所有worker都一样，每个worker还没收账号时各自重新取一个
+    m_userStore.Rekey();
+    return CSocket::Initialize_subproc();
+}
 
-    char* p_sendbuf = (char*)p_memory->AllocMemory(m_iLenMsgHeader + m_iLenPkgHeader, false);
-    char* p_tmpbuf = p_sendbuf;
+//收到包头时由收包线程调用，直接按命令码下标取，不认识的命令返回nullptr，包体收下来直接扔掉
+const MsgMeta* CLogicSocket::getMsgMeta(unsigned short iMsgCode)
+{
+    if (iMsgCode >= AUTH_TOTAL_COMMANDS || statusHandler[iMsgCode].valid == false)
+    {
+        return nullptr;
+    }
+    return &statusHandler[iMsgCode].meta;
+}
 
-    memcpy(p_tmpbuf, pMsgHeader, m_iLenMsgHeader);
-    p_tmpbuf += m_iLenMsgHeader;
+//在收包线程上直接处理只有包头的包，包头还在dataHeadInfo里
+void CLogicSocket::procInlinePkg(lpconnection_t pConn, LPCOMM_PKG_HEADER pPkgHeader)
+{
+    if (pPkgHeader->crc32 != 0) //只有包头的crc值应该为0
+    {
+        return; //crc错误，直接丢弃
+    }
+    unsigned short imsgCode = ntohs(pPkgHeader->msgCode);
+    (this->*statusHandler[imsgCode].handler.inlinefn)(pConn, pPkgHeader);
+}
+
+//同一连接的业务逻辑互斥
+//只有默认线程池在跑、并且是连接亲和模式时，同一连接的消息只会在一条线程上按顺序处理，不存在并发，不用加锁
+//另外的线程池开着时，同一连接的不同命令可能同时在两个线程池里处理，必须加锁
+void CLogicSocket::lockConnLogic(std::unique_lock<std::mutex>& lock)
+{
+    if (g_threadpool.isConnAffine() == false || g_heavythreadpool.isRunning())
+    {
+        lock.lock();
+    }
+}
 
-    LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)p_tmpbuf;	  //指向要发送出去的包的包头	
-    pPkgHeader->msgCode = htons(iMsgCode);
-    pPkgHeader->pkgLen = htons(m_iLenPkgHeader);
-    pPkgHeader->crc32 = 0;
-    msgSend(p_sendbuf);
+void CLogicSocket::SendNoBodyPkgToClient(LPSTRUC_MSG_HEADER pMsgHeader, unsigned short iMsgCode)
+{
+    msgSend(CPkgBuilder(pMsgHeader, iMsgCode, 0)); //只有包头，crc32为0
     return;
 }
 
-bool CLogicSocket::_HandleRegister(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength)
+//注册做成协程：注册失败时可以按配置晚一点回包，等的时候不占业务线程
+CCoTask CLogicSocket::_HandleRegister(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength)
 {
-    //(1)首先判断包的合法性
-    if (pPkgBody == NULL) //客户端发送过来的结构要求跟服务端一致【消息码+包头+包体】，如果没有包体，认为是恶意包，直接丢弃    
+    //(1)包的合法性：包体长度不在MsgRegister最短最长之间的包收包线程按命令表已经扔掉了，到不了这里；
+    //字段的边界由Parse()检查，字符串长度不对、超长的都解析不过，解析过了的访问器不会越界
+    //协程接管了消息内存，挂起再恢复后pMsgHeader、pPkgBody还有效
+    MsgRegister::Reader req;
+    if (req.Parse(pPkgBody, iBodyLength) == false)
     {
-        return false;
+        globallogger->clog(LogLevel::ERROR, "CLogicSocket::_HandleRegister()中包体解析失败，iBodyLength=%d!", iBodyLength);
+        co_return;
     }
 
-    int iRecvLen = sizeof(STRUCT_REGISTER);
-    if (iRecvLen != iBodyLength) //发送过来的结构大小不对，认为是恶意包，直接丢弃
+    MsgRegisterAck::Writer ack;
     {
-        return false;
+        //(2)对于同一个用户，可能同时发送来多个请求，造成多个线程同时为该 用户服务，比如以网游为例，用户要在商店A买物品，要在商店B买物品，如果用户的钱 只够买A或者B，而不够同时买A和B，
+        //那如果用户发送购买命令过来，有一个A请求，有一个B请求，如果是两个线程来执行同一个用户的这两个不同的购买命令，可能造成这个用户的钱同时 A商品购买成功， B
+        //所以，对于同一个用户的命令，我们一般都要互斥,所以需要增加互斥代码的变量ngx_connection_s结构中
+        //线程池工作在连接亲和模式时，同一用户的命令本来就在同一线程上串行执行，这个互斥就省掉了
+        //锁不能带过co_await，恢复时多半已经换了一条线程，所以只在这个块里持有
+        std::unique_lock<std::mutex> lock(pConn->logicPorcMutex, std::defer_lock);
+        lockConnLogic(lock);
+
+        //(3)取得了整个发送过来的数据：req.type()、req.username()直接从包体里读，数值的网络序转换在访问器里做了，
+        //字符串是指向包体的std::string_view，没有结尾的0，要当C字符串用得自己拷贝
+
+        //(4)这里可以开始进行 业务逻辑的处理：账号记进m_userStore，它自己按分片加锁，不同用户的注册互不影响
+        //当前用户的状态是否适合收到这个数据包等等，比如如果用户没登陆，就不适合购买商品等等
+        //处理过程中要用的临时缓冲、临时对象可以从一个CReqArenaBuf局部变量分配，比如 CReqArenaBuf<REQ_ARENA_INLINE_SIZE> arena; char* pTmp = arena.NewArray<char>(n); 不用释放，函数返回时整体回收
+        ack.result = m_userStore.Register(req.username(), req.password(), req.type(), ack.userId);
     }
 
-    //(2)对于同一个用户，可能同时发送来多个请求，造成多个线程同时为该 用户服务，比如以网游为例，用户要在商店A买物品，要在商店B买物品，如果用户的钱 只够买A或者B，而不够同时买A和B，
-    //那如果用户发送购买命令过来，有一个A请求，有一个B请求，如果是两个线程来执行同一个用户的这两个不同的购买命令，可能造成这个用户的钱同时 A商品购买成功， B
-    //所以，对于同一个用户的命令，我们一般都要互斥,所以需要增加互斥代码的变量ngx_connection_s结构中
-    std::lock_guard<std::mutex> lock(pConn->logicPorcMutex);
-
-    //(3)取得了整个发送过来的数据
-    LPSTRUCT_REGISTER p_RecvInfo = (LPSTRUCT_REGISTER)pPkgBody;
-    p_RecvInfo->iType = ntohl(p_RecvInfo->iType);          //所有数值型,short,int,long,uint64_t,int64_t这种大家都不要忘记传输之前需要主机序转网络序，收到后要网络序转主机序
-    p_RecvInfo->username[sizeof(p_RecvInfo->username) - 1] = 0;//这是非常关键的操作，防止客户端发送过来畸形包，导致服务器直接使用这些数据出现错误 
-    p_RecvInfo->password[sizeof(p_RecvInfo->password) - 1] = 0;//这是非常关键的操作，防止客户端发送过来畸形包，导致服务器直接使用这些数据出现错误 
-
-    //(4)这里可以开始进行 业务逻辑的处理，比如通过接收到的数据，进行数据库的查询和更新等等
-    //当前用户的状态是否适合收到这个数据包等等，比如如果用户没登陆，就不适合购买商品等等
-    //具体怎么写，你们自己来，这里就是简单打印一些信息
-    //。。。。。。。。。。。
-
-    //(5)给客户端发送数据时，一般也是返回一个结构，这个结构内容具体由客户端/服务器协商，这里我们就以给客户端也返回同样的 STRUCT_REGISTER 结构来举例    
-    //LPSTRUCT_REGISTER pFromPkgHeader =  (LPSTRUCT_REGISTER)(((char *)pMsgHeader)+m_iLenMsgHeader);	//指向收到的包的包头，其后是收到的包的包体
-    LPCOMM_PKG_HEADER pPkgHeader;
-    CMemory* p_memory = CMemory::GetInstance();
-    CCRC32* p_crc32 = CCRC32::GetInstance();
-    int iSendLen = sizeof(STRUCT_REGISTER);
-    //a)分配要发送出去的包的内存
-
-    //iSendLen = 65000; //unsigned最大也就是这个值
-    char* p_sendbuf = (char*)p_memory->AllocMemory(m_iLenMsgHeader + m_iLenPkgHeader + iSendLen, false);//准备发送的格式，这里是 消息头+包头+包体
-    //b)填充消息头
-    memcpy(p_sendbuf, pMsgHeader, m_iLenMsgHeader);                   //消息头直接拷贝过来
-    //c)填充包头
-    pPkgHeader = (LPCOMM_PKG_HEADER)(p_sendbuf + m_iLenMsgHeader);    //指向包头
-    pPkgHeader->msgCode = _CMD_REGISTER;	                        //消息代码，统一在ngx_logiccomm.h中定义
-    pPkgHeader->msgCode = htons(pPkgHeader->msgCode);	            //htons主机序转网络序 
-    pPkgHeader->pkgLen = htons(m_iLenPkgHeader + iSendLen);        //整个包的尺寸【包头+包体尺寸】 
-    //d)填充包体
-    LPSTRUCT_REGISTER p_sendInfo = (LPSTRUCT_REGISTER)(p_sendbuf + m_iLenMsgHeader + m_iLenPkgHeader);	//跳过消息头，跳过包头，就是包体了
-    //。。。。。。这里根据需要，填充要发回给客户端的内容,int类型要使用htonl()转换，short类型要使用htons()转换
-
-    //e)包体内容全部确定好后，计算包体的crc32值
-    pPkgHeader->crc32 = p_crc32->Get_CRC((unsigned char*)p_sendInfo, iSendLen);
-    pPkgHeader->crc32 = htonl(pPkgHeader->crc32);
-
-    //f)发送数据包
-    msgSend(p_sendbuf);
-    return true;
+    //注册失败多半是用户名已经有了，晚一点回包，拿注册接口成批试探哪些用户名存在就慢了；挂起期间不占线程，别的请求照常处理
+    if (ack.result != _RESULT_OK && m_iRegisterFailDelayMs > 0)
+    {
+        co_await CCoSleep(m_iRegisterFailDelayMs);
+        if (pMsgHeader->iCurrsequence != pConn->iCurrsequence)
+        {
+            co_return; //等的时候连接断了，连接对象甚至可能已经给了别人
+        }
+    }
+
+    //(5)给客户端发送数据时，一般也是返回一个消息，这个消息内容具体由客户端/服务器协商，注册回的是MsgRegisterAck
+    //按包体大小从内存池分配要发送出去的包，消息头里的连接、序号、校验算法都取自收到的请求，包体直接写进发送内存
+    CPkgBuilder reply(pMsgHeader, _CMD_REGISTER, ack.Size());
+    ack.Write(reply.Body());
+
+    //发送数据包：包长、命令码、按收到请求时连接的校验算法算的crc32在msgSend()里填
+    msgSend(std::move(reply));
 }
 
 bool CLogicSocket::_HandleLogIn(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength)
 {
-    if (pPkgBody == NULL)
+    std::unique_lock<std::mutex> lock(pConn->logicPorcMutex, std::defer_lock);
+    lockConnLogic(lock);
+
+    MsgLogin::Reader req;
+    if (req.Parse(pPkgBody, iBodyLength) == false)
     {
+        globallogger->clog(LogLevel::ERROR, "CLogicSocket::_HandleLogIn()中包体解析失败，iBodyLength=%d!", iBodyLength);
         return false;
     }
-    int iRecvLen = sizeof(STRUCT_LOGIN);
-    if (iRecvLen != iBodyLength)
+
+    //带了令牌就凭令牌登录，回包里还是这个令牌；否则校验密码，成功时新建会话
+    MsgLoginAck::Writer ack;
+    char token[SESSION_TOKEN_LEN];
+    if (req.hasToken())
     {
-        return false;
+        ack.result = m_userStore.Resume(req.username(), req.token(), ack.userId);
+        if (ack.result == _RESULT_OK)
+            ack.token = req.token();
     }
-    std::lock_guard<std::mutex> lock(pConn->logicPorcMutex);
-
-    LPSTRUCT_LOGIN p_RecvInfo = (LPSTRUCT_LOGIN)pPkgBody;
-    p_RecvInfo->username[sizeof(p_RecvInfo->username) - 1] = 0;
-    p_RecvInfo->password[sizeof(p_RecvInfo->password) - 1] = 0;
-
-    LPCOMM_PKG_HEADER pPkgHeader;
-    CMemory* p_memory = CMemory::GetInstance();
-    CCRC32* p_crc32 = CCRC32::GetInstance();
-
-    int iSendLen = sizeof(STRUCT_LOGIN);
-    char* p_sendbuf = (char*)p_memory->AllocMemory(m_iLenMsgHeader + m_iLenPkgHeader + iSendLen, false);
-    memcpy(p_sendbuf, pMsgHeader, m_iLenMsgHeader);
-    pPkgHeader = (LPCOMM_PKG_HEADER)(p_sendbuf + m_iLenMsgHeader);
-    pPkgHeader->msgCode = _CMD_LOGIN;
-    pPkgHeader->msgCode = htons(pPkgHeader->msgCode);
-    pPkgHeader->pkgLen = htons(m_iLenPkgHeader + iSendLen);
-    LPSTRUCT_LOGIN p_sendInfo = (LPSTRUCT_LOGIN)(p_sendbuf + m_iLenMsgHeader + m_iLenPkgHeader);
-    pPkgHeader->crc32 = p_crc32->Get_CRC((unsigned char*)p_sendInfo, iSendLen);
-    pPkgHeader->crc32 = htonl(pPkgHeader->crc32);
-    msgSend(p_sendbuf);
+    else
+    {
+        ack.result = m_userStore.Login(req.username(), req.password(), ack.userId, token);
+        if (ack.result == _RESULT_OK)
+            ack.token = std::string_view(token, sizeof(token));
+    }
+    CPkgBuilder reply(pMsgHeader, _CMD_LOGIN, ack.Size());
+    ack.Write(reply.Body());
+    msgSend(std::move(reply));
     return true;
 }
 
 bool CLogicSocket::_HandlePing(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength)
 {
-    //心跳包要求没有包体；
-    if (iBodyLength != 0)  //有包体认为是 非法包
-        return false;
-
-    std::lock_guard<std::mutex> lock(pConn->logicPorcMutex); //凡是和本用户有关的访问都考虑用互斥，以免该用户同时发送过来两个命令达到各种目的
+    //心跳包要求没有包体，有包体的非法包收包线程按命令表已经扔掉了
+    std::unique_lock<std::mutex> lock(pConn->logicPorcMutex, std::defer_lock); //凡是和本用户有关的访问都考虑用互斥，以免该用户同时发送过来两个命令达到各种目的
+    lockConnLogic(lock);
     pConn->lastPingTime = time(NULL);   //更新该变量
 
     //服务器也发送 一个只有包头的数据包给客户端，作为返回的数据
@@ -188,6 +307,64 @@ bool CLogicSocket::_HandlePing(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHead
     return true;
 }
 
+//切换本连接的校验算法：配置里不允许的算法不切换，回包里告诉客户端实际在用哪种
+//切换后收到包头的包才按新算法校验，已经在收、在排队的包还按原来的
+bool CLogicSocket::_HandleIntegrity(lpconnection_t pConn, LPSTRUC_MSG_HEADER pMsgHeader, char* pPkgBody, unsigned short iBodyLength)
+{
+    std::unique_lock<std::mutex> lock(pConn->logicPorcMutex, std::defer_lock);
+    lockConnLogic(lock);
+
+    MsgIntegrity::Reader req;
+    if (req.Parse(pPkgBody, iBodyLength) == false)
+    {
+        return false;
+    }
+    int iMode = req.mode();
+    if (iMode >= 0 && iMode < _PKG_INTEGRITY_COUNT && (m_iIntegrityAllowMask & (1 << iMode)) != 0)
+    {
+        pConn->iIntegrity = (unsigned char)iMode;
+    }
+    iMode = pConn->iIntegrity;
+
+    MsgIntegrity::Writer ack;
+    ack.mode = iMode;
+    CPkgBuilder reply(pMsgHeader, _CMD_INTEGRITY, ack.Size());
+    reply.SetIntegrity(iMode); //回包已经按新算法
+    ack.Write(reply.Body());
+    msgSend(std::move(reply));
+    return true;
+}
+
+//心跳包在收包线程上的处理：不进线程池，回包直接写socket
+//lastPingTime是原子的，这里不去抢业务逻辑锁，免得收包线程被业务线程卡住
+void CLogicSocket::_HandlePingInline(lpconnection_t pConn, LPCOMM_PKG_HEADER pPkgHeader)
+{
+    pConn->lastPingTime = time(NULL);   //更新该变量
+
+    COMM_PKG_HEADER pkgHeader;
+    pkgHeader.pkgLen = htons((unsigned short)m_iLenPkgHeader);
+    pkgHeader.msgCode = htons(_CMD_PING);
+    pkgHeader.crc32 = 0;                //只有包头的包crc为0
+    sendPkgInline(pConn, (char*)&pkgHeader, (unsigned short)m_iLenPkgHeader);
+}
+
+//请求排队太久或者队列满被线程池丢弃，回一个只有包头的"服务器忙"，客户端可以稍后重试，不用干等到超时
+//过载时同一连接的请求往往成批被丢弃，这个连接发送队列里已经有不少待发的包时就不再回了，否则一堆"服务器忙"会把它顶到发送队列上限被踢掉
+//队列满时是在收包线程上调用的，回包不能等发送队列的锁
+void CLogicSocket::procRejectedMsg(const CMsgBuf& msg)
+{
+    LPSTRUC_MSG_HEADER pMsgHeader = msg.Header();
+    if (pMsgHeader->iCurrsequence != pMsgHeader->pConn->iCurrsequence)
+    {
+        return; //连接已经断了，没必要回
+    }
+    if (pMsgHeader->pConn->iSendCount > BUSY_REPLY_MAX_SENDCOUNT)
+    {
+        return;
+    }
+    msgSend(CPkgBuilder(pMsgHeader, _CMD_BUSY, 0)); //只有包头，crc32为0
+}
+
 void CLogicSocket::procPingTimeOutChecking(LPSTRUC_MSG_HEADER tmpmsg, time_t cur_time)
 {
     CMemory* p_memory = CMemory::GetInstance();
@@ -217,18 +394,28 @@ void CLogicSocket::procPingTimeOutChecking(LPSTRUC_MSG_HEADER tmpmsg, time_t cur
 }
 
 //将收到的消息放入消息队列（线程池中的某个线程会处理）
-//pMsgBuf：消息头 + 包头 + 包体 ：自解释；
-void CLogicSocket::threadRecvProcFunc(char* pMsgBuf)
+//msg：消息头 + 包头 + 包体 ：自解释；交给协程处理函数时移走，其他情况返回后由线程池释放
+void CLogicSocket::threadRecvProcFunc(CMsgBuf& msg)
 {
-    LPSTRUC_MSG_HEADER pMsgHeader = (LPSTRUC_MSG_HEADER)pMsgBuf;                  //消息头
+    char* pMsgBuf = msg.Data();
+    LPSTRUC_MSG_HEADER pMsgHeader = msg.Header();                                 //消息头
     LPCOMM_PKG_HEADER  pPkgHeader = (LPCOMM_PKG_HEADER)(pMsgBuf + m_iLenMsgHeader); //包头
     void* pPkgBody;                                                              //指向包体的指针
     unsigned short pkglen = ntohs(pPkgHeader->pkgLen);                            //客户端指定的包长度【包头+包体】
+    lpconnection_t p_Conn = pMsgHeader->pConn;        //消息头中藏着连接池中连接的指针
+
+    //我们要做一些判断
+    //(1)如果从收到客户端发送来的包，到服务器释放一个线程池中的线程处理该包的过程中，客户端断开了，那显然，这种收到的包我们就不必处理了
+    //   线程池取出消息时已经比较过一次，这里再比较一次，放在CRC校验前面，断开的连接不浪费时间算CRC
+    if (p_Conn->iCurrsequence != pMsgHeader->iCurrsequence)   //连接池中连接的序号字段标记，与包头中的序号字段标记必须同时为新，同时为旧，否则认为客户端和服务器连接断了，这种包直接丢弃不理
+    {
+        return; //丢弃不处理了【客户端断开了】
+    }
 
     if (m_iLenPkgHeader == pkglen)
     {
         //没有包体，只有包头
-        if (pPkgHeader->crc32 != 0) //只有包头的crc值应该为0
+        if (pMsgHeader->iCrcChecked == 0 && pPkgHeader->crc32 != 0) //只有包头的crc值应该为0
         {
             return; //crc错误，直接丢弃
         }
@@ -237,28 +424,23 @@ void CLogicSocket::threadRecvProcFunc(char* pMsgBuf)
     else
     {
         //有包体，走到这里
-        pPkgHeader->crc32 = ntohl(pPkgHeader->crc32);		          //针对4字节的数据，网络序转主机序
         pPkgBody = (void*)(pMsgBuf + m_iLenMsgHeader + m_iLenPkgHeader); //跳过消息头 以及 包头 ，指向包体
 
-        //计算crc值判断包的完整性        
-        int calccrc = CCRC32::GetInstance()->Get_CRC((unsigned char*)pPkgBody, pkglen - m_iLenPkgHeader); //计算纯包体的crc值
-        if (calccrc != pPkgHeader->crc32) //服务器端根据包体计算crc值，和客户端传递过来的包头中的crc32信息比较
+        //计算crc值判断包的完整性，收包线程已经边收边校验过的不用再算；按收到包头时连接用的算法算，连接设成不校验的直接过
+        if (pMsgHeader->iCrcChecked == 0 && pMsgHeader->iIntegrity != _PKG_INTEGRITY_NONE)
         {
-            globallogger->clog(LogLevel::ERROR, "CLogicSocket::threadRecvProcFunc()中CRC错误[服务器:%d/客户端:%d]，丢弃数据包!", calccrc, pPkgHeader->crc32);    //正式代码中可以干掉这个信息
-            return; //crc错误，直接丢弃
+            pPkgHeader->crc32 = ntohl(pPkgHeader->crc32);		          //针对4字节的数据，网络序转主机序
+            int calccrc = CCRC32::GetInstance()->Get_Checksum(pMsgHeader->iIntegrity, (unsigned char*)pPkgBody, pkglen - m_iLenPkgHeader); //计算纯包体的校验值
+            if (calccrc != pPkgHeader->crc32) //服务器端根据包体计算crc值，和客户端传递过来的包头中的crc32信息比较
+            {
+                globallogger->clog(LogLevel::ERROR, "CLogicSocket::threadRecvProcFunc()中CRC错误[服务器:%d/客户端:%d]，丢弃数据包!", calccrc, pPkgHeader->crc32);    //正式代码中可以干掉这个信息
+                return; //crc错误，直接丢弃
+            }
         }
     }
 
     //包crc校验OK才能走到这里    	
     unsigned short imsgCode = ntohs(pPkgHeader->msgCode); //消息代码拿出来
-    lpconnection_t p_Conn = pMsgHeader->pConn;        //消息头中藏着连接池中连接的指针
-
-    //我们要做一些判断
-    //(1)如果从收到客户端发送来的包，到服务器释放一个线程池中的线程处理该包的过程中，客户端断开了，那显然，这种收到的包我们就不必处理了    
-    if (p_Conn->iCurrsequence != pMsgHeader->iCurrsequence)   //连接池中连接的序号字段标记，与包头中的序号字段标记必须同时为新，同时为旧，否则认为客户端和服务器连接断了，这种包直接丢弃不理
-    {
-        return; //丢弃不处理了【客户端断开了】
-    }
 
     //(2)判断消息码是正确的，防止客户端恶意侵害我们服务器，发送一个不在我们服务器处理范围内的消息码
     if (imsgCode >= AUTH_TOTAL_COMMANDS) //无符号数不可能<0
@@ -269,7 +451,8 @@ void CLogicSocket::threadRecvProcFunc(char* pMsgBuf)
 
     //走到这里，包没过期，命令码也没问题
     //(3)判断有对应的处理函数
-    if (statusHandler[imsgCode] == NULL) //这种用imsgCode的方式可以使查找要执行的成员函数效率特别高
+    const MsgHandler& msgHandler = statusHandler[imsgCode].handler; //这种用imsgCode的方式可以使查找要执行的成员函数效率特别高
+    if (msgHandler.fn == nullptr && msgHandler.cofn == nullptr)
     {
         globallogger->clog(LogLevel::ERROR, "CLogicSocket::threadRecvProcFunc()中imsgCode=%d消息码找不到对应的处理函数!", imsgCode); //这种有恶意倾向或者错误倾向的包，希望打印出来看看是谁干的
         return;  //没有相关的处理函数
@@ -277,6 +460,11 @@ void CLogicSocket::threadRecvProcFunc(char* pMsgBuf)
 
     //一切正常，可以处理收到的数据了
     //(4)调用消息码对应的成员函数来处理
-    (this->*statusHandler[imsgCode])(p_Conn, pMsgHeader, (char*)pPkgBody, pkglen - m_iLenPkgHeader);
-    return;
+    if (msgHandler.cofn != nullptr)
+    {
+        //协程处理函数：消息内存交给协程，协程中途挂起时包体还要用，跑完才释放
+        (this->*msgHandler.cofn)(p_Conn, pMsgHeader, (char*)pPkgBody, pkglen - m_iLenPkgHeader).Start(std::move(msg));
+        return;
+    }
+    (this->*msgHandler.fn)(p_Conn, pMsgHeader, (char*)pPkgBody, pkglen - m_iLenPkgHeader);
 }
\ No newline at end of file
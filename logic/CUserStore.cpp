@@ -0,0 +1,158 @@
+#include "CUserStore.h"
+#include <string.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/random.h>
+
+#include "CMemory.h"
+#include "CXXHash.h"
+#include "logiccomm.h"
+
+//盐、令牌、哈希前缀都用内核的随机数，getrandom()只在系统刚启动熵还不够时才会等
+static void randomBytes(void* buf, size_t len)
+{
+	char* p = (char*)buf;
+	while (len > 0)
+	{
+		ssize_t n = getrandom(p, len, 0);
+		if (n <= 0)
+			continue; //被信号打断
+		p += n;
+		len -= (size_t)n;
+	}
+}
+
+//先把8字节前缀和内容拼在栈上再算，内容不超过USER_NAME_MAX_LEN
+static uint64_t prefixedHash(uint64_t iPrefix, std::string_view data)
+{
+	char buf[sizeof(uint64_t) + USER_NAME_MAX_LEN];
+	memcpy(buf, &iPrefix, sizeof(iPrefix));
+	memcpy(buf + sizeof(iPrefix), data.data(), data.size());
+	return CXXHash::XXH3_64(buf, sizeof(iPrefix) + data.size());
+}
+
+CUserStore::CUserStore()
+{
+	m_iHashKey = 0;
+	m_iSessionTimeout = USER_STORE_SESSION_TIMEOUT;
+	m_iNextUserId = 1;
+}
+
+CUserStore::~CUserStore()
+{
+	m_users.ForEach([](UserSlot& slot) { CMemory::GetInstance()->FreeMemory(slot.pRec); });
+}
+
+void CUserStore::Init(int iShards, uint32_t iMaxUsers, uint32_t iMaxSessions, int iSessionTimeout)
+{
+	int iBits = 0;
+	while ((1 << iBits) < iShards && iBits < STRIPED_TABLE_MAX_BITS)
+		iBits++;
+	m_users.Init(iBits, iMaxUsers);
+	m_sessions.Init(iBits, iMaxSessions);
+	m_iSessionTimeout = (iSessionTimeout > 0) ? iSessionTimeout : USER_STORE_SESSION_TIMEOUT;
+	Rekey();
+}
+
+//已有的账号是按旧前缀放的槽，换了就找不到了，只能在表还空的时候换
+void CUserStore::Rekey()
+{
+	randomBytes(&m_iHashKey, sizeof(m_iHashKey));
+}
+
+//0留给空槽
+uint64_t CUserStore::nameHash(std::string_view username) const
+{
+	uint64_t h = prefixedHash(m_iHashKey, username);
+	return (h != 0) ? h : 1;
+}
+
+uint64_t CUserStore::pwdDigest(uint64_t iSalt, std::string_view password)
+{
+	return prefixedHash(iSalt, password);
+}
+
+bool CUserStore::findUser(std::string_view username, UserSlot& slot) const
+{
+	return m_users.Find(nameHash(username), [&](const UserSlot& s) {
+		return s.pRec->iNameLen == username.size() && memcmp(s.pRec->name, username.data(), username.size()) == 0;
+	}, slot);
+}
+
+int CUserStore::Register(std::string_view username, std::string_view password, int32_t iType, uint32_t& iUserId)
+{
+	iUserId = 0;
+	if (username.empty() || username.size() > USER_NAME_MAX_LEN || password.size() > USER_NAME_MAX_LEN)
+		return _RESULT_INVALID;
+
+	//先在锁外把记录准备好，写锁里只做插入
+	UserRec* pRec = (UserRec*)CMemory::GetInstance()->AllocMemory((int)(offsetof(UserRec, name) + username.size()), false, MEM_TAG_STORE);
+	randomBytes(&pRec->iSalt, sizeof(pRec->iSalt));
+	pRec->iPwdDigest = pwdDigest(pRec->iSalt, password);
+	pRec->iUserId = m_iNextUserId.fetch_add(1, std::memory_order_relaxed); //记录插入后就不再改，重名、满了的注册会空掉一个id
+	pRec->iType = iType;
+	pRec->iNameLen = (uint8_t)username.size();
+	memcpy(pRec->name, username.data(), username.size());
+
+	UserSlot slot = { nameHash(username), pRec };
+	int iRet = m_users.Insert(slot, [&](const UserSlot& s) {
+		return s.pRec->iNameLen == username.size() && memcmp(s.pRec->name, username.data(), username.size()) == 0;
+	}, [](const UserSlot&) { return false; });
+	if (iRet != STRIPED_INSERT_OK)
+	{
+		CMemory::GetInstance()->FreeMemory(pRec);
+		return (iRet == STRIPED_INSERT_EXISTS) ? _RESULT_USER_EXISTS : _RESULT_FULL;
+	}
+	iUserId = pRec->iUserId;
+	return _RESULT_OK;
+}
+
+int CUserStore::Login(std::string_view username, std::string_view password, uint32_t& iUserId, char* token)
+{
+	iUserId = 0;
+	UserSlot user;
+	if (username.size() > USER_NAME_MAX_LEN || password.size() > USER_NAME_MAX_LEN || findUser(username, user) == false)
+		return _RESULT_LOGIN_FAILED;
+	if (pwdDigest(user.pRec->iSalt, password) != user.pRec->iPwdDigest)
+		return _RESULT_LOGIN_FAILED;
+
+	uint32_t iNow = (uint32_t)time(NULL);
+	SessionSlot session;
+	randomBytes(token, SESSION_TOKEN_LEN);
+	session.hash = user.hash;
+	memcpy(&session.iTokenLo, token, sizeof(uint64_t));
+	memcpy(&session.iTokenHi, token + sizeof(uint64_t), sizeof(uint64_t));
+	session.iUserId = user.pRec->iUserId;
+	session.iExpireTime = iNow + (uint32_t)m_iSessionTimeout;
+
+	//同一个账号反复登录只占一个槽，不然一个账号就能把会话表刷满
+	uint32_t iId = session.iUserId;
+	int iRet = m_sessions.Replace(session, [iId](const SessionSlot& s) { return s.iUserId == iId; },
+		[iNow](const SessionSlot& s) { return s.iExpireTime <= iNow; });
+	if (iRet != STRIPED_INSERT_OK)
+		return _RESULT_FULL;
+	iUserId = session.iUserId;
+	return _RESULT_OK;
+}
+
+int CUserStore::Resume(std::string_view username, std::string_view token, uint32_t& iUserId)
+{
+	iUserId = 0;
+	UserSlot user;
+	if (token.size() != SESSION_TOKEN_LEN || username.size() > USER_NAME_MAX_LEN || findUser(username, user) == false)
+		return _RESULT_BAD_TOKEN;
+
+	uint64_t iLo, iHi;
+	memcpy(&iLo, token.data(), sizeof(iLo));
+	memcpy(&iHi, token.data() + sizeof(iLo), sizeof(iHi));
+	uint32_t iNow = (uint32_t)time(NULL);
+	uint32_t iId = user.pRec->iUserId;
+	SessionSlot session;
+	if (m_sessions.Find(user.hash, [iId](const SessionSlot& s) { return s.iUserId == iId; }, session) == false)
+		return _RESULT_BAD_TOKEN;
+	//两半都比完再判断，比较时间不随令牌前几个字节对不对而变
+	if (((session.iTokenLo ^ iLo) | (session.iTokenHi ^ iHi)) != 0 || session.iExpireTime <= iNow)
+		return _RESULT_BAD_TOKEN;
+	iUserId = session.iUserId;
+	return _RESULT_OK;
+}
@@ -1,15 +1,33 @@
 #include "CCRC32.h"
+#include "CXXHash.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL 1
+#endif
 
 //类静态变量初始化
 CCRC32* CCRC32::m_instance = NULL;
 
 //构造函数
+//启动时按cpuid选最快的算法
 CCRC32::CCRC32()
 {
 	Init_CRC32_Table();
+	m_iImpl = CRC32_IMPL_TABLE;
+	m_pfnUpdate = updateTable;
+	if (SetImpl(CRC32_IMPL_PCLMUL) == false)
+		SetImpl(CRC32_IMPL_SLICE16);
+
+	initCrc32cTable();
+#ifdef CRC32_HAVE_PCLMUL
+	m_bHw32c = __builtin_cpu_supports("sse4.2");
+#else
+	m_bHw32c = false;
+#endif
 }
 
 //析构函数
@@ -48,6 +66,292 @@ void CCRC32::Init_CRC32_Table()
 		}
 		crc32_table[i] = Reflect(crc32_table[i], 32);
 	}
+
+	//切片表：多跟一个0字节，就是把上一张表的值再按字节查一次表
+	for (int i = 0; i <= 0xFF; i++)
+	{
+		m_sliceTable[0][i] = crc32_table[i];
+	}
+	for (int k = 1; k < 16; k++)
+	{
+		for (int i = 0; i <= 0xFF; i++)
+		{
+			unsigned int prev = m_sliceTable[k - 1][i];
+			m_sliceTable[k][i] = (prev >> 8) ^ crc32_table[prev & 0xFF];
+		}
+	}
+}
+
+//CRC-32C的表，多项式0x1EDC6F41按位反转后是0x82F63B78
+void CCRC32::initCrc32cTable()
+{
+	for (int i = 0; i <= 0xFF; i++)
+	{
+		unsigned int c = i;
+		for (int j = 0; j < 8; j++)
+		{
+			c = (c >> 1) ^ ((c & 1) ? 0x82F63B78 : 0);
+		}
+		m_slice32c[0][i] = c;
+	}
+	for (int k = 1; k < 8; k++)
+	{
+		for (int i = 0; i <= 0xFF; i++)
+		{
+			unsigned int prev = m_slice32c[k - 1][i];
+			m_slice32c[k][i] = (prev >> 8) ^ m_slice32c[0][prev & 0xFF];
+		}
+	}
+}
+
+const char* CCRC32::GetImplName(int impl)
+{
+	static const char* s_names[CRC32_IMPL_COUNT] = { "table", "slice8", "slice16", "pclmul" };
+	return (impl >= 0 && impl < CRC32_IMPL_COUNT) ? s_names[impl] : "?";
+}
+
+bool CCRC32::IsImplSupported(int impl)
+{
+	if (impl == CRC32_IMPL_TABLE)
+		return true;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	//切片法按小端一次读4个字节
+	if (impl == CRC32_IMPL_SLICE8 || impl == CRC32_IMPL_SLICE16)
+		return true;
+#endif
+#ifdef CRC32_HAVE_PCLMUL
+	if (impl == CRC32_IMPL_PCLMUL)
+		return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+	return false;
+}
+
+bool CCRC32::SetImpl(int impl)
+{
+	if (!IsImplSupported(impl))
+		return false;
+	static const UpdateFunc s_funcs[CRC32_IMPL_COUNT] = { updateTable, updateSlice8, updateSlice16, updatePclmul };
+	m_iImpl = impl;
+	m_pfnUpdate = s_funcs[impl];
+	return true;
+}
+
+unsigned int CCRC32::updateTable(const CCRC32* pThis, unsigned int crc, const unsigned char* buffer, size_t len)
+{
+	const unsigned int* table = pThis->crc32_table;
+	while (len--)
+		crc = (crc >> 8) ^ table[(crc & 0xFF) ^ *buffer++];
+	return crc;
+}
+
+static inline uint32_t load32(const unsigned char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));  //不要求对齐，编译成一条普通的读
+	return v;
+}
+
+unsigned int CCRC32::updateSlice8(const CCRC32* pThis, unsigned int crc, const unsigned char* buffer, size_t len)
+{
+	const unsigned int (*t)[256] = pThis->m_sliceTable;
+	while (len >= 8)
+	{
+		uint32_t one = load32(buffer) ^ crc;
+		uint32_t two = load32(buffer + 4);
+		crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24]
+			^ t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+		buffer += 8;
+		len -= 8;
+	}
+	return updateTable(pThis, crc, buffer, len);
+}
+
+unsigned int CCRC32::updateSlice16(const CCRC32* pThis, unsigned int crc, const unsigned char* buffer, size_t len)
+{
+	const unsigned int (*t)[256] = pThis->m_sliceTable;
+	while (len >= 16)
+	{
+		uint32_t w0 = load32(buffer) ^ crc;
+		uint32_t w1 = load32(buffer + 4);
+		uint32_t w2 = load32(buffer + 8);
+		uint32_t w3 = load32(buffer + 12);
+		crc = t[15][w0 & 0xFF] ^ t[14][(w0 >> 8) & 0xFF] ^ t[13][(w0 >> 16) & 0xFF] ^ t[12][w0 >> 24]
+			^ t[11][w1 & 0xFF] ^ t[10][(w1 >> 8) & 0xFF] ^ t[9][(w1 >> 16) & 0xFF] ^ t[8][w1 >> 24]
+			^ t[7][w2 & 0xFF] ^ t[6][(w2 >> 8) & 0xFF] ^ t[5][(w2 >> 16) & 0xFF] ^ t[4][w2 >> 24]
+			^ t[3][w3 & 0xFF] ^ t[2][(w3 >> 8) & 0xFF] ^ t[1][(w3 >> 16) & 0xFF] ^ t[0][w3 >> 24];
+		buffer += 16;
+		len -= 16;
+	}
+	return updateSlice8(pThis, crc, buffer, len);
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+//Intel《Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction》的折叠法，常数是IEEE多项式按位反转后的值
+//4路并行每次折叠64字节，再合成128位、逐16字节折叠，最后用Barrett约简成32位；len至少64且是16的倍数
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32Fold(uint32_t crc, const unsigned char* buf, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+	__m128i x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+	__m128i x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+	__m128i x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+	__m128i x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64)
+	{
+		__m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		__m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		__m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		__m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	//4路合成1路
+	__m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16)
+	{
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)buf)), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	//128位折成64位
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	//Barrett约简成32位
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+#ifdef CRC32_HAVE_PCLMUL
+//SSE4.2的crc32指令就是按CRC-32C算的，一次8字节
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHw(uint32_t crc, const unsigned char* buf, size_t len)
+{
+#ifdef __x86_64__
+	uint64_t c = crc;
+	while (len >= 8)
+	{
+		uint64_t v;
+		memcpy(&v, buf, sizeof(v));
+		c = _mm_crc32_u64(c, v);
+		buf += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)c;
+#endif
+	while (len >= 4)
+	{
+		crc = _mm_crc32_u32(crc, load32(buf));
+		buf += 4;
+		len -= 4;
+	}
+	while (len--)
+		crc = _mm_crc32_u8(crc, *buf++);
+	return crc;
+}
+#endif
+
+unsigned int CCRC32::Update32C(unsigned int crc, const unsigned char* buffer, size_t len) const
+{
+#ifdef CRC32_HAVE_PCLMUL
+	if (m_bHw32c)
+		return crc32cHw(crc, buffer, len);
+#endif
+	const unsigned int (*t)[256] = m_slice32c;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (len >= 8)
+	{
+		uint32_t one = load32(buffer) ^ crc;
+		uint32_t two = load32(buffer + 4);
+		crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24]
+			^ t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+		buffer += 8;
+		len -= 8;
+	}
+#endif
+	while (len--)
+		crc = (crc >> 8) ^ t[0][(crc & 0xFF) ^ *buffer++];
+	return crc;
+}
+
+int CCRC32::Get_CRC32C(unsigned char* buffer, unsigned int dwSize)
+{
+	return Final(Update32C(Begin(), buffer, dwSize));
+}
+
+int CCRC32::Get_Checksum(int mode, unsigned char* buffer, unsigned int dwSize)
+{
+	switch (mode)
+	{
+	case _PKG_INTEGRITY_CRC32C:
+		return Get_CRC32C(buffer, dwSize);
+	case _PKG_INTEGRITY_XXH3:
+		return (int)(uint32_t)CXXHash::XXH3_64(buffer, dwSize);
+	case _PKG_INTEGRITY_NONE:
+		return 0;
+	default:
+		return Get_CRC(buffer, dwSize);
+	}
+}
+
+const char* CCRC32::GetIntegrityName(int mode)
+{
+	static const char* s_names[_PKG_INTEGRITY_COUNT] = { "crc32", "crc32c", "xxh3", "none" };
+	return (mode >= 0 && mode < _PKG_INTEGRITY_COUNT) ? s_names[mode] : "?";
+}
+
+//64字节以上的部分按16字节整数倍折叠，剩下不到16字节的尾巴用切片表
+unsigned int CCRC32::updatePclmul(const CCRC32* pThis, unsigned int crc, const unsigned char* buffer, size_t len)
+{
+#ifdef CRC32_HAVE_PCLMUL
+	if (len >= 64)
+	{
+		size_t chunk = len & ~(size_t)15;
+		crc = crc32Fold(crc, buffer, chunk);
+		buffer += chunk;
+		len -= chunk;
+	}
+#endif
+	return updateSlice16(pThis, crc, buffer, len);
 }
 
 //在crc32_table寻找表内数据的CRC值
@@ -56,14 +360,6 @@ int CCRC32::Get_CRC(unsigned char* buffer, unsigned int dwSize)
 	// Be sure to use unsigned variables,
 	// because negative values introduce high bits
 	// where zero bits are required.
-	unsigned int  crc(0xffffffff);
-	int len;
-
-	len = dwSize;
-	// Perform the algorithm on each character
-	// in the string, using the lookup table values.
-	while (len--)
-		crc = (crc >> 8) ^ crc32_table[(crc & 0xFF) ^ *buffer++];
-	// Exclusive OR the result with the beginning value.
-	return crc ^ 0xffffffff;
+	// Perform the algorithm using the implementation picked at startup.
+	return Final(Update(Begin(), buffer, dwSize));
 }
\ No newline at end of file
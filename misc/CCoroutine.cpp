@@ -0,0 +1,91 @@
+#include "CCoroutine.h"
+#include "CMemory.h"
+#include "global.h"
+
+std::atomic<int> CCoTask::s_iLiveCount(0);
+
+//协程挂起后回到原来所在的线程池；不是在线程池的线程上挂起的，交给默认线程池
+static CThreadPool* resumePool()
+{
+	CThreadPool* pPool = CThreadPool::Current();
+	return pPool != nullptr ? pPool : &g_threadpool;
+}
+
+CCoTask::promise_type::promise_type()
+{
+	++s_iLiveCount;
+}
+
+//正常跑完或者线程池退出时销毁挂起的协程，都会走到这里，接管的消息内存随ownedMsg一起释放
+CCoTask::promise_type::~promise_type()
+{
+	--s_iLiveCount;
+}
+
+void* CCoTask::promise_type::operator new(size_t size)
+{
+	return CMemory::GetInstance()->AllocMemory((int)size, false, MEM_TAG_CORO);
+}
+
+void CCoTask::promise_type::operator delete(void* ptr)
+{
+	CMemory::GetInstance()->FreeMemory(ptr);
+}
+
+void CCoTask::promise_type::unhandled_exception()
+{
+	//业务协程抛出的异常到这里就结束了，不能让它把线程池的线程带走
+	globallogger->flog(LogLevel::ERROR, "CCoTask中业务协程抛出了未处理的异常，协程结束.");
+}
+
+CCoTask::~CCoTask()
+{
+	if (m_handle)
+	{
+		m_handle.destroy();
+	}
+}
+
+void CCoTask::Start(CMsgBuf&& msg)
+{
+	std::coroutine_handle<promise_type> h = m_handle;
+	m_handle = nullptr;  //交出去以后协程自己管理生存期
+	h.promise().ownedMsg = std::move(msg);
+	h.resume();          //在当前线程上一直跑到第一次挂起或者结束
+}
+
+void CCoSleep::await_suspend(std::coroutine_handle<> h)
+{
+	resumePool()->PostResumeAfter(h, iMs);
+}
+
+void CCoYield::await_suspend(std::coroutine_handle<> h)
+{
+	resumePool()->PostResume(h);
+}
+
+void CCoEvent::Set()
+{
+	void* prev = m_state.exchange(setMark(), std::memory_order_acq_rel);
+	if (prev != nullptr && prev != setMark())
+	{
+		//已经有协程在等，交回线程池继续执行
+		std::coroutine_handle<> h = std::coroutine_handle<>::from_address(prev);
+		m_pPool->RemoveEventWaiter(h);
+		m_pPool->PostResume(h);
+	}
+}
+
+//登记等待者；如果在登记之前已经Set()了，就不挂起
+//先在线程池登记再挂到事件上：挂上之后Set()随时可能把协程交回线程池，那时线程池里必须已经有这条记录可以注销
+bool CCoEvent::Awaiter::await_suspend(std::coroutine_handle<> h) noexcept
+{
+	void* expected = nullptr;
+	CThreadPool* pPool = resumePool();
+	pEvent->m_pPool = pPool;  //在登记等待者之前记下来，Set()看到等待者时一定也能看到它
+	pPool->AddEventWaiter(h, pEvent);
+	if (pEvent->m_state.compare_exchange_strong(expected, h.address(), std::memory_order_acq_rel))
+		return true;
+	pPool->RemoveEventWaiter(h);  //已经Set()了，不挂起
+	return false;
+}
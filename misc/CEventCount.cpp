@@ -0,0 +1,50 @@
+#include "CEventCount.h"
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+//futex系统调用没有glibc封装，直接用syscall
+static long futex(std::atomic<uint32_t>* uaddr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, reinterpret_cast<uint32_t*>(uaddr), op, val, nullptr, nullptr, 0);
+}
+
+//登记为等待者
+//seq_cst保证：要么生产者的Notify()能看到我们这个等待者，要么我们随后的条件检查能看到生产者放进去的数据
+uint32_t CEventCount::PrepareWait()
+{
+	m_waiters.fetch_add(1, std::memory_order_seq_cst);
+	return m_epoch.load(std::memory_order_seq_cst);
+}
+
+void CEventCount::CancelWait()
+{
+	m_waiters.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+//纪元和key相同才睡，Notify()先改纪元再唤醒，所以不会丢失唤醒
+void CEventCount::Wait(uint32_t key)
+{
+	while (m_epoch.load(std::memory_order_acquire) == key)
+	{
+		futex(&m_epoch, FUTEX_WAIT_PRIVATE, key); //被信号打断或者虚假唤醒，循环再判断一次
+	}
+	m_waiters.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+void CEventCount::Notify(int count)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst); //和PrepareWait()配对，保证看到最新的等待者数量
+	if (m_waiters.load(std::memory_order_relaxed) == 0)
+		return; //没人睡，不用进内核
+
+	m_epoch.fetch_add(1, std::memory_order_seq_cst);
+	futex(&m_epoch, FUTEX_WAKE_PRIVATE, (uint32_t)count);
+}
+
+void CEventCount::NotifyAll()
+{
+	m_epoch.fetch_add(1, std::memory_order_seq_cst);
+	futex(&m_epoch, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
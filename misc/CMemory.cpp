@@ -2,16 +2,427 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <new>
 
 // 类静态成员赋值
 CMemory *CMemory::m_instance = NULL;
 
+//块头，紧挨着返回给调用者的地址前面
+struct MemBlockHeader
+{
+	uint32_t iClass;   //档位，MEM_CLASS_LARGE表示超大内存
+	uint32_t iTag;     //低8位是MEM_TAG_xxx，高24位是统计时的权重，0表示这块没有计入统计
+	uint64_t iSize;    //超大内存的字节数（含块头）
+};
+static_assert(sizeof(MemBlockHeader) == MEM_BLOCK_HEADER, "块头大小必须是MEM_BLOCK_HEADER");
+
+//线程缓存：每档一个单链表，只有本线程访问，不加锁
+//统计计数只有本线程写，用relaxed的load+store代替原子加，不会有多线程抢同一个缓存行的开销；统计线程读到的值可能稍旧
+struct CMemory::ThreadCache
+{
+	FreeBlock*            head[MEM_CLASS_COUNT];
+	int                   count[MEM_CLASS_COUNT];
+	std::atomic<uint64_t> iAllocCount[MEM_CLASS_COUNT + 1];
+	std::atomic<uint64_t> iFreeCount[MEM_CLASS_COUNT + 1];
+	int                   iSampleCountdown;  //采样方式下再分配这么多次统计一次
+
+	ThreadCache()
+	{
+		iSampleCountdown = 0;
+		for (int i = 0; i < MEM_CLASS_COUNT; ++i)
+		{
+			head[i] = NULL;
+			count[i] = 0;
+		}
+		for (int i = 0; i <= MEM_CLASS_COUNT; ++i)
+		{
+			iAllocCount[i].store(0, std::memory_order_relaxed);
+			iFreeCount[i].store(0, std::memory_order_relaxed);
+		}
+		CMemory::GetInstance()->registerCache(this);
+	}
+	~ThreadCache()
+	{
+		CMemory::GetInstance()->unregisterCache(this);
+	}
+	static void inc(std::atomic<uint64_t>& counter)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+};
+
+CMemory::CMemory()
+{
+	for (int i = 0; i < MEM_CLASS_COUNT; ++i)
+	{
+		m_depot[i].head = NULL;
+		m_depot[i].count = 0;
+	}
+	for (int i = 0; i <= MEM_CLASS_COUNT; ++i)
+	{
+		m_iCarved[i] = 0;
+		m_iRetiredAlloc[i] = 0;
+		m_iRetiredFree[i] = 0;
+	}
+	m_iBacking = MEM_BACKING_HEAP;
+	m_bLockMem = false;
+	m_pRegionCur = NULL;
+	m_pRegionEnd = NULL;
+	m_iHugeBytes = 0;
+	m_iThpBytes = 0;
+	m_iLockedBytes = 0;
+	m_iProfileMode = MEM_PROFILE_OFF;
+	m_iSampleEvery = 1;
+	for (int i = 0; i < MEM_TAG_COUNT; ++i)
+	{
+		TagCounter& counter = m_tags[i];
+		counter.iAllocCount = 0;
+		counter.iAllocBytes = 0;
+		counter.iFreeCount = 0;
+		counter.iLiveBytes = 0;
+		counter.iPeakBytes = 0;
+		for (int j = 0; j <= MEM_CLASS_COUNT; ++j)
+		{
+			counter.iHist[j] = 0;
+		}
+	}
+}
+
+void CMemory::SetBacking(int backing, size_t preallocBytes, bool lockMem)
+{
+	std::lock_guard<std::mutex> lock(m_slabMutex);
+	m_iBacking = backing;
+	m_bLockMem = lockMem;
+	if (backing != MEM_BACKING_HEAP && preallocBytes > 0)
+	{
+		mapRegion((preallocBytes + MEM_HUGE_PAGE_BYTES - 1) & ~(size_t)(MEM_HUGE_PAGE_BYTES - 1));
+	}
+}
+
+void CMemory::GetBackingInfo(size_t& hugeBytes, size_t& thpBytes, size_t& lockedBytes)
+{
+	std::lock_guard<std::mutex> lock(m_slabMutex);
+	hugeBytes = m_iHugeBytes;
+	thpBytes = m_iThpBytes;
+	lockedBytes = m_iLockedBytes;
+}
+
+//映射bytes字节（2MB的整数倍）作为新的当前区域，映射完就把每一页都碰过，之后从这里切块不会再缺页
+//显式大页要系统预留了大页(vm.nr_hugepages)才映射得出来，映射不出来就用2MB对齐的普通映射，让内核尽量用透明大页
+bool CMemory::mapRegion(size_t bytes)
+{
+	char* pRegion = NULL;
+	if (m_iBacking == MEM_BACKING_HUGETLB)
+	{
+		void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			pRegion = (char*)p;
+			m_iHugeBytes += bytes;
+		}
+	}
+	if (pRegion == NULL)
+	{
+		//多映射2MB，把起点对齐到2MB，前后多出来的还给系统
+		size_t mapBytes = bytes + MEM_HUGE_PAGE_BYTES;
+		void* p = mmap(NULL, mapBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return false;
+		char* pRaw = (char*)p;
+		pRegion = (char*)(((uintptr_t)pRaw + MEM_HUGE_PAGE_BYTES - 1) & ~(uintptr_t)(MEM_HUGE_PAGE_BYTES - 1));
+		if (pRegion > pRaw)
+			munmap(pRaw, pRegion - pRaw);
+		size_t tail = (pRaw + mapBytes) - (pRegion + bytes);
+		if (tail > 0)
+			munmap(pRegion + bytes, tail);
+		madvise(pRegion, bytes, MADV_HUGEPAGE);  //内核没开透明大页时不起作用，不影响使用
+		for (size_t off = 0; off < bytes; off += 4096)
+		{
+			pRegion[off] = 0;  //先建议再碰，缺页时内核才会直接给大页
+		}
+		m_iThpBytes += bytes;
+	}
+	if (m_bLockMem && mlock(pRegion, bytes) == 0)
+	{
+		m_iLockedBytes += bytes;  //锁不住（超过RLIMIT_MEMLOCK）也照常用，由调用者看统计决定要不要报警
+	}
+	m_pRegionCur = pRegion;
+	m_pRegionEnd = pRegion + bytes;
+	return true;
+}
+
+//大页模式下从当前区域切，区域不够就再映射一段；普通模式直接向系统要
+char* CMemory::allocSlab(size_t bytes)
+{
+	if (m_iBacking != MEM_BACKING_HEAP)
+	{
+		if ((size_t)(m_pRegionEnd - m_pRegionCur) < bytes)
+		{
+			carveTail(); //当前区域剩下的不够这一块，先切成小块放进仓库再换区域，不然这段就一直没人用
+			if (mapRegion((bytes + MEM_HUGE_PAGE_BYTES - 1) & ~(size_t)(MEM_HUGE_PAGE_BYTES - 1)) == false)
+				return (char*)::operator new(bytes); //映射不出来就退回普通堆内存
+		}
+		char* pSlab = m_pRegionCur;
+		m_pRegionCur += bytes;
+		return pSlab;
+	}
+	return (char*)::operator new(bytes); //不判断是否成功，失败就让它抛异常崩溃，以便及时发现错误
+}
+
+//当前区域剩下的部分从大到小按档切成块放进全局仓库，连最小一档都不够的不要了
+//区域按2MB映射、slab都是MEM_SLAB_BYTES的整数倍，一般切不出东西，只有slab大小和区域对不齐时才会有剩的
+void CMemory::carveTail()
+{
+	char* p = m_pRegionCur;
+	for (int cls = MEM_CLASS_COUNT - 1; cls >= 0; --cls)
+	{
+		size_t blockSize = classSize(cls);
+		int n = (int)((size_t)(m_pRegionEnd - p) / blockSize);
+		if (n == 0)
+			continue;
+		for (int i = 0; i < n - 1; ++i)
+		{
+			((FreeBlock*)(p + i * blockSize))->next = (FreeBlock*)(p + (i + 1) * blockSize);
+		}
+		FreeBlock* first = (FreeBlock*)p;
+		FreeBlock* last = (FreeBlock*)(p + (n - 1) * blockSize);
+		p += n * blockSize;
+		m_iCarved[cls] += n;
+
+		Depot& depot = m_depot[cls];
+		std::lock_guard<std::mutex> lock(depot.mutex);
+		last->next = depot.head;
+		depot.head = first;
+		depot.count += n;
+	}
+	m_pRegionCur = m_pRegionEnd;
+}
+
+int CMemory::sizeClass(size_t size)
+{
+	if (size <= ((size_t)1 << MEM_MIN_CLASS_SHIFT))
+		return 0;
+	int shift = 64 - __builtin_clzll((unsigned long long)(size - 1)); //向上取整到2的幂
+	int cls = shift - MEM_MIN_CLASS_SHIFT;
+	return cls < MEM_CLASS_COUNT ? cls : MEM_CLASS_LARGE;
+}
+
+int CMemory::batchCount(int cls)
+{
+	int n = (int)(MEM_BATCH_BYTES / classSize(cls));
+	if (n < 2)
+		return 2;
+	return n > MEM_BATCH_MAX ? MEM_BATCH_MAX : n;
+}
+
+CMemory::ThreadCache* CMemory::getThreadCache()
+{
+	static thread_local ThreadCache t_cache;  //线程退出时析构，缓存的块还给全局仓库
+	return &t_cache;
+}
+
+void CMemory::registerCache(ThreadCache* pCache)
+{
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+	m_caches.push_back(pCache);
+}
+
+void CMemory::unregisterCache(ThreadCache* pCache)
+{
+	for (int cls = 0; cls < MEM_CLASS_COUNT; ++cls)
+	{
+		flush(pCache, cls, 0);
+	}
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+	for (int i = 0; i <= MEM_CLASS_COUNT; ++i)
+	{
+		m_iRetiredAlloc[i] += pCache->iAllocCount[i].load(std::memory_order_relaxed);
+		m_iRetiredFree[i] += pCache->iFreeCount[i].load(std::memory_order_relaxed);
+	}
+	for (auto iter = m_caches.begin(); iter != m_caches.end(); ++iter)
+	{
+		if (*iter == pCache)
+		{
+			m_caches.erase(iter);
+			break;
+		}
+	}
+}
+
+//从全局仓库取一批放进线程缓存，仓库不够就先切一批新的
+void CMemory::refill(ThreadCache* pCache, int cls)
+{
+	int want = batchCount(cls);
+	Depot& depot = m_depot[cls];
+	for (;;)
+	{
+		{
+			std::lock_guard<std::mutex> lock(depot.mutex);
+			if (depot.count > 0)
+			{
+				//从链表头摘下一串，一次挂到线程缓存上
+				FreeBlock* first = depot.head;
+				FreeBlock* last = first;
+				int n = 1;
+				while (n < want && last->next != NULL)
+				{
+					last = last->next;
+					++n;
+				}
+				depot.head = last->next;
+				depot.count -= n;
+				last->next = pCache->head[cls];
+				pCache->head[cls] = first;
+				pCache->count[cls] += n;
+				return;
+			}
+		}
+		carve(cls);
+	}
+}
+
+//线程缓存只留keep块，其余整串还给全局仓库，只加一次锁
+void CMemory::flush(ThreadCache* pCache, int cls, int keep)
+{
+	int n = pCache->count[cls] - keep;
+	if (n <= 0)
+		return;
+	FreeBlock* first = pCache->head[cls];
+	FreeBlock* last = first;
+	for (int i = 1; i < n; ++i)
+	{
+		last = last->next;
+	}
+	pCache->head[cls] = last->next;
+	pCache->count[cls] = keep;
+
+	Depot& depot = m_depot[cls];
+	std::lock_guard<std::mutex> lock(depot.mutex);
+	last->next = depot.head;
+	depot.head = first;
+	depot.count += n;
+}
+
+//向系统要一大块，切成这一档的块放进全局仓库
+void CMemory::carve(int cls)
+{
+	size_t blockSize = classSize(cls);
+	size_t slabBytes = MEM_SLAB_BYTES;
+	if (slabBytes < blockSize * batchCount(cls))
+		slabBytes = blockSize * batchCount(cls);
+	char* pSlab;
+	{
+		std::lock_guard<std::mutex> lock(m_slabMutex);
+		pSlab = allocSlab(slabBytes);
+		m_slabs.push_back(pSlab);
+	}
+
+	int n = (int)(slabBytes / blockSize);
+	for (int i = 0; i < n - 1; ++i)
+	{
+		((FreeBlock*)(pSlab + i * blockSize))->next = (FreeBlock*)(pSlab + (i + 1) * blockSize);
+	}
+	FreeBlock* first = (FreeBlock*)pSlab;
+	FreeBlock* last = (FreeBlock*)(pSlab + (n - 1) * blockSize);
+	m_iCarved[cls] += n;
+
+	Depot& depot = m_depot[cls];
+	std::lock_guard<std::mutex> lock(depot.mutex);
+	last->next = depot.head;
+	depot.head = first;
+	depot.count += n;
+}
+
+void CMemory::SetProfiling(int mode, int sampleEvery)
+{
+	if (sampleEvery < 1)
+		sampleEvery = 1;
+	if (sampleEvery > MEM_PROFILE_SAMPLE_MAX)
+		sampleEvery = MEM_PROFILE_SAMPLE_MAX;
+	m_iSampleEvery.store(sampleEvery, std::memory_order_relaxed);
+	m_iProfileMode.store(mode, std::memory_order_relaxed);
+}
+
+const char* CMemory::GetTagName(int tag)
+{
+	static const char* s_names[MEM_TAG_COUNT] = { "other", "recv", "send", "timer", "conn", "coro", "arena", "store" };
+	return (tag >= 0 && tag < MEM_TAG_COUNT) ? s_names[tag] : "?";
+}
+
+//采样方式下每条线程自己倒数，数到0统计一次，权重就是采样间隔，这样各项统计值乘上权重就是估计的总数
+uint32_t CMemory::sampleWeight(ThreadCache* pCache, int mode)
+{
+	if (mode == MEM_PROFILE_FULL)
+		return 1;
+	if (--pCache->iSampleCountdown > 0)
+		return 0;
+	int every = m_iSampleEvery.load(std::memory_order_relaxed);
+	pCache->iSampleCountdown = every;
+	return (uint32_t)every;
+}
+
+void CMemory::recordAlloc(int tag, int cls, size_t bytes, uint32_t weight)
+{
+	TagCounter& counter = m_tags[tag];
+	int64_t add = (int64_t)(bytes * weight);
+	counter.iAllocCount.fetch_add(weight, std::memory_order_relaxed);
+	counter.iAllocBytes.fetch_add((uint64_t)add, std::memory_order_relaxed);
+	counter.iHist[cls].fetch_add(weight, std::memory_order_relaxed);
+	int64_t live = counter.iLiveBytes.fetch_add(add, std::memory_order_relaxed) + add;
+	int64_t peak = counter.iPeakBytes.load(std::memory_order_relaxed);
+	while (live > peak && !counter.iPeakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+	{
+	}
+}
+
+void CMemory::recordFree(int tag, size_t bytes, uint32_t weight)
+{
+	TagCounter& counter = m_tags[tag];
+	counter.iFreeCount.fetch_add(weight, std::memory_order_relaxed);
+	counter.iLiveBytes.fetch_sub((int64_t)(bytes * weight), std::memory_order_relaxed);
+}
+
 // 分配内存
 // memCount：分配的字节大小
 // ifmemset：是否要把分配的内存初始化为0
-void *CMemory::AllocMemory(int memCount, bool ifmemset)
+// tag：MEM_TAG_xxx，打开内存统计时按它分开统计
+void *CMemory::AllocMemory(int memCount, bool ifmemset, int tag)
 {
-	void *tmpData = (void *)new char[memCount]; // 我不会判断new是否成功，如果new失败，程序根本不应该继续运行，就让它崩溃以便我们及时发现错误
+	size_t size = (size_t)memCount + MEM_BLOCK_HEADER;
+	int cls = sizeClass(size);
+	ThreadCache* pCache = getThreadCache();
+	ThreadCache::inc(pCache->iAllocCount[cls]);
+	int mode = m_iProfileMode.load(std::memory_order_relaxed);
+	uint32_t weight = (mode == MEM_PROFILE_OFF) ? 0 : sampleWeight(pCache, mode);
+
+	MemBlockHeader* pHeader;
+	if (cls == MEM_CLASS_LARGE)
+	{
+		pHeader = (MemBlockHeader*)::operator new(size); //超大内存很少见，直接向系统要
+		pHeader->iSize = size;
+		++m_iCarved[MEM_CLASS_LARGE];
+	}
+	else
+	{
+		if (pCache->head[cls] == NULL)
+		{
+			refill(pCache, cls);
+		}
+		FreeBlock* pBlock = pCache->head[cls];
+		pCache->head[cls] = pBlock->next;
+		--pCache->count[cls];
+		pHeader = (MemBlockHeader*)pBlock;
+		pHeader->iSize = classSize(cls);
+	}
+	pHeader->iClass = (uint32_t)cls;
+	pHeader->iTag = (uint32_t)tag | (weight << 8);
+	if (weight != 0)
+	{
+		recordAlloc(tag, cls, (size_t)pHeader->iSize, weight);
+	}
+
+	void *tmpData = (char*)pHeader + MEM_BLOCK_HEADER;
 	if (ifmemset)								// 要把内存清0
 	{
 		memset(tmpData, 0, memCount);
@@ -20,8 +431,93 @@ void *CMemory::AllocMemory(int memCount, bool ifmemset)
 }
 
 // 内存释放函数
+// 还到当前线程的缓存里，缓存超过两批就还一批给全局仓库，分配线程下次从仓库整批取回去
 void CMemory::FreeMemory(void *point)
 {
-	// delete [] point;  //这么删除编译会给警告：warning: deleting 'void*' is undefined [-Wdelete-incomplete]
-	delete[] ((char *)point); // new的时候是char *，这里弄回char *来删除
-}
\ No newline at end of file
+	if (point == NULL)
+		return;
+	MemBlockHeader* pHeader = (MemBlockHeader*)((char*)point - MEM_BLOCK_HEADER);
+	int cls = (int)pHeader->iClass;
+	ThreadCache* pCache = getThreadCache();
+	ThreadCache::inc(pCache->iFreeCount[cls]);
+	if ((pHeader->iTag >> 8) != 0)
+	{
+		//分配时计入了统计的才减，统计打开前分配的不管，在用字节数不会减成负的
+		recordFree((int)(pHeader->iTag & 0xFF), (size_t)pHeader->iSize, pHeader->iTag >> 8);
+	}
+
+	if (cls == MEM_CLASS_LARGE)
+	{
+		--m_iCarved[MEM_CLASS_LARGE];
+		::operator delete(pHeader);
+		return;
+	}
+
+	FreeBlock* pBlock = (FreeBlock*)pHeader;
+	pBlock->next = pCache->head[cls];
+	pCache->head[cls] = pBlock;
+	int batch = batchCount(cls);
+	if (++pCache->count[cls] > batch * 2)
+	{
+		flush(pCache, cls, batch);
+	}
+}
+
+size_t CMemory::GetCapacity(void* point)
+{
+	MemBlockHeader* pHeader = (MemBlockHeader*)((char*)point - MEM_BLOCK_HEADER);
+	return (size_t)pHeader->iSize - MEM_BLOCK_HEADER;
+}
+
+int CMemory::GetClass(void* point)
+{
+	MemBlockHeader* pHeader = (MemBlockHeader*)((char*)point - MEM_BLOCK_HEADER);
+	return (int)pHeader->iClass;
+}
+
+void CMemory::GetStats(MemClassStats* pStats)
+{
+	for (int i = 0; i <= MEM_CLASS_COUNT; ++i)
+	{
+		pStats[i].iBlockSize = (i < MEM_CLASS_COUNT) ? classSize(i) : 0;
+		pStats[i].iCarved = m_iCarved[i];
+		pStats[i].iDepotFree = 0;
+		if (i < MEM_CLASS_COUNT)
+		{
+			std::lock_guard<std::mutex> lock(m_depot[i].mutex);
+			pStats[i].iDepotFree = m_depot[i].count;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+	for (int i = 0; i <= MEM_CLASS_COUNT; ++i)
+	{
+		pStats[i].iAllocCount = m_iRetiredAlloc[i];
+		pStats[i].iFreeCount = m_iRetiredFree[i];
+	}
+	for (ThreadCache* pCache : m_caches)
+	{
+		for (int i = 0; i <= MEM_CLASS_COUNT; ++i)
+		{
+			pStats[i].iAllocCount += pCache->iAllocCount[i].load(std::memory_order_relaxed);
+			pStats[i].iFreeCount += pCache->iFreeCount[i].load(std::memory_order_relaxed);
+		}
+	}
+}
+
+void CMemory::GetTagStats(MemTagStats* pStats)
+{
+	for (int i = 0; i < MEM_TAG_COUNT; ++i)
+	{
+		TagCounter& counter = m_tags[i];
+		pStats[i].iAllocCount = counter.iAllocCount.load(std::memory_order_relaxed);
+		pStats[i].iAllocBytes = counter.iAllocBytes.load(std::memory_order_relaxed);
+		pStats[i].iFreeCount = counter.iFreeCount.load(std::memory_order_relaxed);
+		pStats[i].iLiveBytes = counter.iLiveBytes.load(std::memory_order_relaxed);
+		pStats[i].iPeakBytes = counter.iPeakBytes.load(std::memory_order_relaxed);
+		for (int j = 0; j <= MEM_CLASS_COUNT; ++j)
+		{
+			pStats[i].iHist[j] = counter.iHist[j].load(std::memory_order_relaxed);
+		}
+	}
+}
@@ -0,0 +1,130 @@
+#include "CNuma.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+//解析内核的cpulist格式，比如"0-3,8-11"
+static void parseCpuList(const char* str, std::vector<int>& cpus)
+{
+	const char* p = str;
+	while (*p != '\0' && *p != '\n')
+	{
+		char* end;
+		long first = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		long last = first;
+		p = end;
+		if (*p == '-')
+		{
+			last = strtol(p + 1, &end, 10);
+			p = end;
+		}
+		for (long c = first; c <= last; c++)
+			cpus.push_back((int)c);
+		if (*p == ',')
+			p++;
+	}
+}
+
+const std::vector<int>& CNuma::OnlineNodes()
+{
+	static std::vector<int> s_nodes;  //拓扑运行期间不变，读一次就行
+	if (!s_nodes.empty())
+		return s_nodes;
+
+	//节点编号可以不连续（比如"0,2"），按online里列出的来，不能从0往上数到第一个不存在的就停
+	std::vector<int> nodes;
+	FILE* fp = fopen("/sys/devices/system/node/online", "r");
+	if (fp != NULL)
+	{
+		char line[1024];
+		if (fgets(line, sizeof(line), fp) != NULL)
+			parseCpuList(line, nodes);  //和cpulist一样的格式
+		fclose(fp);
+	}
+	for (int node : nodes)
+	{
+		if (node >= 0 && node < NUMA_MAX_NODES)
+			s_nodes.push_back(node);
+	}
+	if (s_nodes.empty())
+		s_nodes.push_back(0);  //没有NUMA支持的内核没有这个文件
+	return s_nodes;
+}
+
+bool CNuma::NodeCpus(int node, std::vector<int>& cpus)
+{
+	cpus.clear();
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL)
+		return false;
+	char line[4096];
+	std::vector<int> all;
+	if (fgets(line, sizeof(line), fp) != NULL)
+		parseCpuList(line, all);
+	fclose(fp);
+
+	//容器、taskset等限制过CPU的，只用允许用的那些
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool hasMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+	for (int c : all)
+	{
+		if (!hasMask || (c < CPU_SETSIZE && CPU_ISSET(c, &allowed)))
+			cpus.push_back(c);
+	}
+	return !cpus.empty();
+}
+
+bool CNuma::BindToNode(int node)
+{
+	std::vector<int> cpus;
+	if (!NodeCpus(node, cpus))
+		return false;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int c : cpus)
+	{
+		if (c < CPU_SETSIZE)
+			CPU_SET(c, &set);
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		return false;
+
+	//用MPOL_PREFERRED而不是MPOL_BIND：本节点内存不够时可以用别的节点的，不至于直接分配失败
+	unsigned long nodemask = 1UL << node;
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8) == -1)
+		return false;
+	return true;
+}
+
+void CNuma::CpuToWorker(int workerCount, std::vector<int>& cpuWorker)
+{
+	cpuWorker.clear();
+	const std::vector<int>& nodes = OnlineNodes();
+	int count = (int)nodes.size();
+	std::vector<int> cpus;
+	for (int n = 0; n < count; n++)
+	{
+		std::vector<int> workers;
+		for (int w = n; w < workerCount; w += count)  //和WorkerNode()的分法一致
+			workers.push_back(w);
+		if (!NodeCpus(nodes[n], cpus))
+			continue;
+		for (size_t i = 0; i < cpus.size(); i++)
+		{
+			int c = cpus[i];
+			if (c >= (int)cpuWorker.size())
+				cpuWorker.resize(c + 1, -1);
+			cpuWorker[c] = workers.empty() ? -1 : workers[i % workers.size()];
+		}
+	}
+}
@@ -0,0 +1,54 @@
+#include "CReqArena.h"
+#include "CMemory.h"
+#include <limits.h>
+
+std::atomic<uint64_t> CReqArena::s_iChunkAllocCount(0);
+
+//块从内存池要，块头后面紧跟着可用的内存，保持16字节对齐
+//要不到返回nullptr，不抛异常：业务线程上没有接异常的地方
+void* CReqArena::allocSlow(size_t size, size_t align)
+{
+	size_t iHead = (sizeof(Chunk) + 15) & ~(size_t)15;
+	//内存池按int算长度，块头+对齐余量+size超过INT_MAX的要求按内存不够处理，不能截断成一个小块
+	if (size > (size_t)INT_MAX - iHead - align)
+		return nullptr;
+	size_t iChunkSize = REQ_ARENA_CHUNK_SIZE - MEM_BLOCK_HEADER - iHead;
+	if (size + align > iChunkSize)
+		iChunkSize = size + align;  //一次要的比一块还大，单独给它要一块
+
+	Chunk* pChunk;
+	try
+	{
+		pChunk = (Chunk*)CMemory::GetInstance()->AllocMemory((int)(iHead + iChunkSize), false, MEM_TAG_ARENA);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return nullptr;  //当前这块还留着，之后小一点的分配照样能用
+	}
+	pChunk->next = m_pChunks;
+	pChunk->iSize = iChunkSize;
+	m_pChunks = pChunk;
+	s_iChunkAllocCount.fetch_add(1, std::memory_order_relaxed);
+
+	m_pCur = (char*)pChunk + iHead;
+	m_pEnd = m_pCur + iChunkSize;
+	return Alloc(size, align);
+}
+
+void CReqArena::freeChunks()
+{
+	CMemory* p_memory = CMemory::GetInstance();
+	while (m_pChunks != nullptr)
+	{
+		Chunk* pNext = m_pChunks->next;
+		p_memory->FreeMemory(m_pChunks);
+		m_pChunks = pNext;
+	}
+}
+
+void CReqArena::Reset()
+{
+	freeChunks();
+	m_pCur = m_pInline;
+	m_pEnd = m_pInline + m_iInlineSize;
+}
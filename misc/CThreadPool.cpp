@@ -1,85 +1,442 @@
 #include "CThreadPool.h"
 #include "CMemory.h"
+#include "CCoroutine.h"
 #include"global.h"
 #include<unistd.h>
+#include<algorithm>
+#include<arpa/inet.h>
 
-// 徲̬Ա
-std::mutex CThreadPool::m_mutex;                // 徲̬
-std::condition_variable CThreadPool::m_cond;     // 徲̬
-bool CThreadPool::m_shutdown= false;                       // ߳˳־false˳true˳
+// 定义静态成员变量
+thread_local CThreadPool* CThreadPool::t_pCurrent = nullptr;
 
+//单调时钟的微秒数，只用来算时间差
+static uint64_t nowUs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 CThreadPool::~CThreadPool()
 {
     StopAll();
 }
 
-bool CThreadPool::Create(int threadNum)
+void CThreadPool::SetAutoResize(int minThreads, int maxThreads, int delayHighMs, int delayLowMs)
+{
+    if (minThreads < 1)
+        minThreads = 1;
+    if (maxThreads > 0 && maxThreads < minThreads)
+        maxThreads = minThreads;
+    m_iMinThreadNum = minThreads;
+    m_iMaxThreadNum = maxThreads;
+    m_iDelayHighUs = delayHighMs * 1000;
+    m_iDelayLowUs = delayLowMs * 1000;
+}
+
+void CThreadPool::SetQueueDelayLimit(int targetMs, int intervalMs, int deadlineMs)
 {
+    if (intervalMs < 1)
+        intervalMs = 1;
+    m_iCodelTargetUs = targetMs > 0 ? targetMs * 1000ULL : 0;
+    m_iCodelIntervalUs = intervalMs * 1000ULL;
+    m_iDeadlineUs = deadlineMs > 0 ? deadlineMs * 1000ULL : 0;
+}
+
+void CThreadPool::SetFairQueue(int quantum, int flowMax)
+{
+    m_iFairQuantum = quantum > 0 ? quantum : POOL_FAIR_QUANTUM;
+    m_iFairFlowMax = flowMax > 0 ? flowMax : POOL_FAIR_FLOW_MAX;
+}
+
+bool CThreadPool::Create(int threadNum, int queueSize, int schedMode)
+{
+    if (!m_msgProc || threadNum <= 0)
+    {
+        globallogger->flog(LogLevel::ERROR, "CThreadPool[%s]::Create()失败，没有设置处理消息的回调或者线程数量为%d.", m_strName.c_str(), threadNum);
+        return false;
+    }
+    m_iSchedMode = schedMode;
+    if (m_iMaxThreadNum > 0)
+    {
+        if (hasLanes())
+        {
+            globallogger->flog(LogLevel::NOTICE, "CThreadPool[%s]::Create()中连接亲和/工作窃取模式不支持线程数自动伸缩，按固定%d个线程运行.", m_strName.c_str(), threadNum);
+        }
+        else
+        {
+            //初始线程数限定在上下限之间
+            if (threadNum < m_iMinThreadNum)
+                threadNum = m_iMinThreadNum;
+            if (threadNum > m_iMaxThreadNum)
+                threadNum = m_iMaxThreadNum;
+        }
+    }
     m_iThreadNum = threadNum;
+    if (queueSize <= 0)
+        queueSize = RECVMSGQUEUE_DEFAULT_SIZE;
 
-    // ̲߳
+    //环形队列要在线程启动前分配好
+    int laneSize = 0;
+    if (hasLanes()) {
+        //每条线程一个私有队列，总容量大致和共享队列相同
+        laneSize = queueSize / (threadNum > 0 ? threadNum : 1);
+        if (laneSize < RECVLANEQUEUE_MIN_SIZE)
+            laneSize = RECVLANEQUEUE_MIN_SIZE;
+    }
+    else {
+        //总容量按调度权重8:4:1分给各个优先级，每份向下取整为2的幂，几个队列加起来不超过queueSize；
+        //每个优先级单独一个队列，低优先级的消息再多也挤不掉高优先级消息的位置
+        //公平队列模式下只用得到高优先级队列，其余容量给各连接的子队列，其他队列也分配好，省得到处区分
+        static const int weights[_MSG_PRIO_CLASSES] = { POOL_PRIO_WEIGHT_HIGH, POOL_PRIO_WEIGHT_NORMAL, POOL_PRIO_WEIGHT_LOW };
+        int highSize = 0;
+        for (int i = 0; i < _MSG_PRIO_CLASSES; ++i)
+        {
+            int share = (int)((long long)queueSize * weights[i] / (POOL_PRIO_WEIGHT_HIGH + POOL_PRIO_WEIGHT_NORMAL + POOL_PRIO_WEIGHT_LOW));
+            int size = RECVLANEQUEUE_MIN_SIZE;
+            while (size * 2 <= share)
+                size *= 2;
+            m_MsgRecvQueue[i].Init(size);
+            if (i == _MSG_PRIO_HIGH)
+                highSize = size;
+        }
+        m_iFairCapacity = (queueSize > highSize) ? queueSize - highSize : RECVLANEQUEUE_MIN_SIZE;
+    }
+    m_resumeQueue.Init(RESUMEQUEUE_SIZE);
+
+    // 创建线程并启动
     for (int i = 0; i < m_iThreadNum; ++i) {
-        auto pNew = new ThreadItem(this);
+        auto pNew = new ThreadItem(this, i);
+        if (laneSize > 0)
+            pNew->laneQueue.Init(laneSize);
         m_threadVector.push_back(pNew);
-        m_threadVector[i]->_Handle = std::thread(&CThreadPool::ThreadFunc,pNew);
+    }
+    //所有线程对象都放进容器之后再启动线程，工作窃取模式下线程一启动就可能遍历其他线程的队列
+    for (auto& threadItem : m_threadVector) {
+        threadItem->_Handle = std::thread(&CThreadPool::ThreadFunc, threadItem);
     }
 
-    // ȴ߳
+    // 等待所有线程启动完毕
 lblfor:
     for (auto iter = m_threadVector.begin(); iter != m_threadVector.end(); iter++)
     {
-        if ((*iter)->ifRunning == false) //֤߳ȫԱ֤̳߳е߳
+        if ((*iter)->ifRunning == false) //这个条件保证所有线程完全启动起来，以保证整个线程池中的线程正常工作
         {
-            //˵ûȫ߳
-            usleep(100 * 1000);  //λ΢,Ϊ1=1000΢ 100 *1000 = 100
+            //说明有没有启动完全的线程
+            usleep(100 * 1000);  //单位是微秒,又因为1毫秒=1000微秒，所以 100 *1000 = 100毫秒
             goto lblfor;
         }
     }
+
+    m_manageThread = std::thread(&CThreadPool::ManageThreadFunc, this);
+    m_bRunning = true;
     return true;
 }
 
 void CThreadPool::StopAll() {
-    if (m_shutdown) {
-        return;
+    if (m_shutdown || !m_bRunning) {
+        return;  //已经停过，或者根本没有Create()过
     }
 
     m_shutdown = true;
+    m_bRunning = false;
 
-    // ߳
-    m_cond.notify_all();
+    //先等管理线程退出，之后线程容器就不会再变了
+    if (m_manageThread.joinable()) {
+        m_manageThread.join();
+    }
 
-    // ȴ߳̽
+    // 唤醒所有线程
+    m_evRecv.NotifyAll();
+    for (auto& threadItem : m_threadVector) {
+        threadItem->laneEv.NotifyAll();
+    }
+
+    // 等待线程结束
     for (auto& threadItem : m_threadVector) {
         if (threadItem->_Handle.joinable()) {
             threadItem->_Handle.join();
         }
     }
 
-    clearMsgRecvQueue();  // Ϣ
+    clearMsgRecvQueue();  // 清理消息队列
+    destroyPendingCoroutines();
+    for (auto& threadItem : m_threadVector) {
+        delete threadItem;
+    }
     m_threadVector.clear();
-    globallogger->clog(LogLevel::NOTICE, "CThreadPool::StopAll()ɹأ̳߳߳ȫ!" );
+    globallogger->clog(LogLevel::NOTICE, "CThreadPool[%s]::StopAll()成功返回，线程池中线程全部正常结束!", m_strName.c_str());
+}
+
+//挑选接收这条消息的线程
+//连接亲和模式：用连接对象的地址做哈希，连接对象在整个连接生存期内地址不变，所以同一连接的所有消息都会落到同一条线程上
+//工作窃取模式：轮流取两条线程，投给队列短的那条，不需要精确，反正空闲线程还会来窃取
+CThreadPool::ThreadItem* CThreadPool::getLane(char* buf)
+{
+    size_t n = m_threadVector.size();
+    if (m_iSchedMode == POOL_SCHED_STEAL)
+    {
+        unsigned int cur = m_iNextLane.fetch_add(2, std::memory_order_relaxed);
+        ThreadItem* pA = m_threadVector[cur % n];
+        ThreadItem* pB = m_threadVector[(cur + 1) % n];
+        return (pB->laneQueue.SizeApprox() < pA->laneQueue.SizeApprox()) ? pB : pA;
+    }
+
+    LPSTRUC_MSG_HEADER pMsgHeader = (LPSTRUC_MSG_HEADER)buf;
+    uint64_t h = (uint64_t)(uintptr_t)pMsgHeader->pConn;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;  //混合一下，连接对象地址的低位大多相同
+    h ^= h >> 33;
+    return m_threadVector[h % n];
 }
 
-void CThreadPool::inMsgRecvQueueAndSignal(char* buf) {
+//无锁队列里放的是裸指针，入队时从句柄交出所有权，线程取出时再接回句柄
+void CThreadPool::inMsgRecvQueueAndSignal(CMsgBuf&& msg) {
+    char* buf = msg.Release();
+    ((LPSTRUC_MSG_HEADER)buf)->iEnqueueTime = nowUs();
+    if (hasLanes())
     {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        m_MsgRecvQueue.push_back(buf);
+        ThreadItem* pLane = getLane(buf);
+        if (pLane->laneQueue.Push(buf) == false)
+        {
+            //这条线程的私有队列满了，只能丢弃
+            //连接亲和模式下不能挪给别的线程，否则就破坏了同一连接的处理顺序；工作窃取模式下队列满说明大家都忙不过来了
+            discardRecvMsg(&buf, 1);
+            return;
+        }
         ++m_iRecvMsgQueueCount;
+        if (m_iSchedMode == POOL_SCHED_AFFINE)
+            pLane->laneEv.Notify(1); //只唤醒负责这个连接的线程
+        else
+            Call();                  //工作窃取模式下唤醒任意一个空闲线程，它会把活偷过去
+        return;
     }
 
-    // һ߳
+    if (m_iSchedMode == POOL_SCHED_FAIR && msgPriority(buf) != _MSG_PRIO_HIGH)
+    {
+        if (pushFair(&buf, 1) == 0)
+        {
+            discardRecvMsg(&buf, 1);
+            return;
+        }
+        ++m_iRecvMsgQueueCount;
+        Call();
+        return;
+    }
+
+    if (m_MsgRecvQueue[msgPriority(buf)].Push(buf) == false)
+    {
+        //队列满了，说明线程池已经处理不过来，这条消息只能丢弃
+        discardRecvMsg(&buf, 1);
+        return;
+    }
+    ++m_iRecvMsgQueueCount;
+
+    // 激发一个线程来干活
     Call();
 }
 
 
+void CThreadPool::inMsgRecvQueueBatchAndSignal(CMsgBuf* msgs, int count)
+{
+    if (count <= 0)
+        return;
+    m_releaseScratch.clear();
+    for (int i = 0; i < count; ++i)
+    {
+        m_releaseScratch.push_back(msgs[i].Release());
+    }
+    pushBatch(m_releaseScratch.data(), count);
+}
+
+//一批消息一次入队
+//共享队列只做一次批量预留；连接亲和模式按线程分组，每组一次批量预留、只唤醒一次；工作窃取模式整批投给一条线程，再唤醒空闲线程来窃取
+void CThreadPool::pushBatch(char** bufs, int count)
+{
+
+    //同一批消息是同一时刻入队的，取一次时间就够了
+    uint64_t now = nowUs();
+    for (int i = 0; i < count; ++i)
+    {
+        ((LPSTRUC_MSG_HEADER)bufs[i])->iEnqueueTime = now;
+    }
+
+    if (m_iSchedMode == POOL_SCHED_SHARED)
+    {
+        //按优先级分组，每组一次批量预留
+        for (int i = 0; i < count; ++i)
+        {
+            m_prioScratch[msgPriority(bufs[i])].push_back(bufs[i]);
+        }
+        int pushed = 0;
+        for (int prio = 0; prio < _MSG_PRIO_CLASSES; ++prio)
+        {
+            std::vector<char*>& group = m_prioScratch[prio];
+            if (group.empty())
+                continue;
+            int n = (int)m_MsgRecvQueue[prio].PushBulk(group.data(), group.size());
+            discardRecvMsg(group.data() + n, (int)group.size() - n);
+            pushed += n;
+            group.clear();
+        }
+        m_iRecvMsgQueueCount += pushed;
+        CallBatch(pushed);
+        return;
+    }
+
+    if (m_iSchedMode == POOL_SCHED_FAIR)
+    {
+        //高优先级消息走无锁队列，其他的一次加锁按连接分别入队
+        std::vector<char*>& high = m_prioScratch[_MSG_PRIO_HIGH];
+        std::vector<char*>& fair = m_prioScratch[_MSG_PRIO_NORMAL];
+        for (int i = 0; i < count; ++i)
+        {
+            if (msgPriority(bufs[i]) == _MSG_PRIO_HIGH)
+                high.push_back(bufs[i]);
+            else
+                fair.push_back(bufs[i]);
+        }
+        int pushed = 0;
+        if (!high.empty())
+        {
+            int n = (int)m_MsgRecvQueue[_MSG_PRIO_HIGH].PushBulk(high.data(), high.size());
+            discardRecvMsg(high.data() + n, (int)high.size() - n);
+            pushed += n;
+            high.clear();
+        }
+        if (!fair.empty())
+        {
+            int n = pushFair(fair.data(), (int)fair.size());
+            discardRecvMsg(fair.data() + n, (int)fair.size() - n);
+            pushed += n;
+            fair.clear();
+        }
+        m_iRecvMsgQueueCount += pushed;
+        CallBatch(pushed);
+        return;
+    }
+
+    if (m_iSchedMode == POOL_SCHED_STEAL)
+    {
+        int pushed = 0;
+        ThreadItem* pLane = getLane(bufs[0]);
+        for (size_t tries = 0; tries < m_threadVector.size() && pushed < count; ++tries)
+        {
+            //挑中的线程放不下了，剩下的顺着往后面的线程放
+            pushed += (int)pLane->laneQueue.PushBulk(bufs + pushed, count - pushed);
+            pLane = m_threadVector[(pLane->iIndex + 1) % m_threadVector.size()];
+        }
+        m_iRecvMsgQueueCount += pushed;
+        discardRecvMsg(bufs + pushed, count - pushed);
+        CallBatch(pushed);
+        return;
+    }
+
+    //连接亲和模式：按线程稳定排序，同一连接的消息先后顺序不变
+    m_batchScratch.clear();
+    for (int i = 0; i < count; ++i)
+    {
+        m_batchScratch.emplace_back(getLane(bufs[i]), bufs[i]);
+    }
+    std::stable_sort(m_batchScratch.begin(), m_batchScratch.end(),
+        [](const std::pair<ThreadItem*, char*>& a, const std::pair<ThreadItem*, char*>& b) { return a.first->iIndex < b.first->iIndex; });
+
+    //排序后把消息指针按顺序写回bufs，同一线程的消息在bufs里就是连续的一段
+    for (int i = 0; i < count; ++i)
+    {
+        bufs[i] = m_batchScratch[i].second;
+    }
+    int begin = 0;
+    while (begin < count)
+    {
+        ThreadItem* pLane = m_batchScratch[begin].first;
+        int end = begin + 1;
+        while (end < count && m_batchScratch[end].first == pLane)
+            ++end;
+
+        int pushed = (int)pLane->laneQueue.PushBulk(bufs + begin, end - begin);
+        m_iRecvMsgQueueCount += pushed;
+        discardRecvMsg(bufs + begin + pushed, end - begin - pushed);
+        if (pushed > 0)
+            pLane->laneEv.Notify(1); //这条线程会把自己队列里的消息一口气处理完，唤醒一次就够
+        begin = end;
+    }
+}
+
+//来了count条消息，只唤醒真正需要的线程数
+//已经醒着但还没在干活的线程（刚处理完一条消息、马上要回来取下一条）不用唤醒就会来取
+void CThreadPool::CallBatch(int count)
+{
+    if (count <= 0)
+        return;
+
+    int waiters = m_evRecv.GetWaiters();
+    int awakeIdle = m_iThreadNum - m_iRunningThreadNum - waiters;
+    int need = count - (awakeIdle > 0 ? awakeIdle : 0);
+    if (need <= 0)
+        return;  //醒着的线程够用，一次唤醒都不需要
+
+    if (waiters == 0)
+    {
+        // 所有线程都忙，可能需要扩充线程池
+        globallogger->flog(LogLevel::ERROR, "CThreadPool[%s]::CallBatch()发现线程池中当前空闲线程数量为0，要考虑扩容线程池了!", m_strName.c_str());
+        return;
+    }
+    m_evRecv.Notify(need < waiters ? need : waiters);
+}
+
+void CThreadPool::discardRecvMsg(char** bufs, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        //队列满了，说明线程池已经处理不过来，这条消息只能丢弃
+        ++m_iDiscardRecvPkgCount;
+        CMsgBuf msg = CMsgBuf::Adopt(bufs[i]);
+        rejectRecvMsg(msg);
+    }
+}
+
+void CThreadPool::rejectRecvMsg(const CMsgBuf& msg)
+{
+    if (m_msgReject)
+        m_msgReject(msg);
+}
+
+//按排队时延判断这条消息是不是该丢弃，线程取到消息后、处理之前调用
+//排队时延从超过目标值那一刻起记下时刻，一回到目标值以下就清零；连续超过一个观察周期，说明队列里一直有消不掉的积压，算过载
+//过载时排队超过目标值的都丢弃，积压很快消掉，新来的消息排队时延回到目标值以下就退出过载；不过载时只丢排队超过最长排队时间的
+//亲和/窃取模式下每条线程一个队列，这里按整个线程池统计，不区分是哪条线程的队列
+bool CThreadPool::isStale(uint64_t sojournUs, uint64_t now)
+{
+    if (m_iCodelTargetUs > 0)
+    {
+        uint64_t firstAbove = m_iFirstAboveUs.load(std::memory_order_relaxed);
+        if (sojournUs < m_iCodelTargetUs)
+        {
+            //正常情况下这里只读不写，不会让所有线程抢这个缓存行
+            if (firstAbove != 0)
+                m_iFirstAboveUs.store(0, std::memory_order_relaxed);
+            return false;
+        }
+        if (firstAbove == 0)
+            m_iFirstAboveUs.compare_exchange_strong(firstAbove, now, std::memory_order_relaxed);
+        else if (now > firstAbove + m_iCodelIntervalUs)
+            return true;
+    }
+    return m_iDeadlineUs > 0 && sojournUs >= m_iDeadlineUs;
+}
+
+bool CThreadPool::isOverloaded() const
+{
+    uint64_t firstAbove = m_iFirstAboveUs.load(std::memory_order_relaxed);
+    return firstAbove != 0 && nowUs() > firstAbove + m_iCodelIntervalUs;
+}
+
 void CThreadPool::Call() {
     if (m_iRunningThreadNum < m_iThreadNum) {
-        m_cond.notify_one();  // һ߳
+        m_evRecv.Notify(1);  // 唤醒一个睡眠的线程，没有线程在睡眠时不会进入内核
     }
     else {
-        // ̶߳æҪ̳߳
-        globallogger->flog(LogLevel::ERROR, "CThreadPool::Call()̳߳еǰ߳Ϊ0̳߳!" );
+        // 所有线程都忙，可能需要扩充线程池
+        globallogger->flog(LogLevel::ERROR, "CThreadPool[%s]::Call()发现线程池中当前空闲线程数量为0，要考虑扩容线程池了!", m_strName.c_str());
     }
 }
 
@@ -88,56 +445,560 @@ int CThreadPool::getRecvMsgQueueCount() const
     return m_iRecvMsgQueueCount;
 }
 
+size_t CThreadPool::getRecvMsgQueueCount(int prio) const
+{
+    if (hasLanes() || prio < 0 || prio >= _MSG_PRIO_CLASSES)
+        return 0;
+    return m_MsgRecvQueue[prio].SizeApprox();
+}
+
+int CThreadPool::getDiscardRecvPkgCount() const
+{
+    return m_iDiscardRecvPkgCount;
+}
+
+int CThreadPool::msgPriority(char* buf)
+{
+    int prio = ((LPSTRUC_MSG_HEADER)buf)->iPriority;
+    return (prio < _MSG_PRIO_CLASSES) ? prio : _MSG_PRIO_LOW;
+}
+
+//加权轮转：本线程每取(高+普通+低)条消息，按权重先看对应优先级的队列
+//先看的队列空了就从高到低挨个看，只要有消息就不空手而归
+bool CThreadPool::popSharedJob(ThreadItem* pThread, char*& buf)
+{
+    unsigned int slot = pThread->iSchedTick++ % (POOL_PRIO_WEIGHT_HIGH + POOL_PRIO_WEIGHT_NORMAL + POOL_PRIO_WEIGHT_LOW);
+    int first = _MSG_PRIO_LOW;
+    if (slot < POOL_PRIO_WEIGHT_HIGH)
+        first = _MSG_PRIO_HIGH;
+    else if (slot < POOL_PRIO_WEIGHT_HIGH + POOL_PRIO_WEIGHT_NORMAL)
+        first = _MSG_PRIO_NORMAL;
+
+    if (m_MsgRecvQueue[first].Pop(buf))
+        return true;
+    for (int prio = 0; prio < _MSG_PRIO_CLASSES; ++prio)
+    {
+        if (prio != first && m_MsgRecvQueue[prio].Pop(buf))
+            return true;
+    }
+    return false;
+}
+
+//公平队列模式下入队，每条消息挂到自己连接的队列上，连接第一次有消息排队时排到轮转顺序的末尾
+//某个连接排队的消息太多，或者总数超过容量，放不下的挪到bufs的后面交给调用者丢弃，同一连接的消息相对顺序不变
+int CThreadPool::pushFair(char** bufs, int count)
+{
+    int pushed = 0;
+    std::lock_guard<std::mutex> lock(m_fairMutex);
+    m_fairRejectScratch.clear();
+    for (int i = 0; i < count; ++i)
+    {
+        char* buf = bufs[i];
+        if (m_iFairQueued >= m_iFairCapacity)
+        {
+            m_fairRejectScratch.push_back(buf);
+            continue;
+        }
+        void* pKey = ((LPSTRUC_MSG_HEADER)buf)->pConn;
+        FairFlow*& pFlow = m_fairFlows[pKey];
+        if (pFlow == nullptr)
+        {
+            if (m_fairFreeFlows.empty()) {
+                pFlow = new FairFlow();
+            }
+            else {
+                pFlow = m_fairFreeFlows.back();
+                m_fairFreeFlows.pop_back();
+            }
+            pFlow->pKey = pKey;
+            pFlow->iDeficit = m_iFairQuantum; //新来的连接直接有一轮的额度，轮到它就能取
+            m_fairActive.push_back(pFlow);
+        }
+        else if ((int)pFlow->msgs.size() >= m_iFairFlowMax)
+        {
+            m_fairRejectScratch.push_back(buf);
+            continue;
+        }
+        pFlow->msgs.push_back(buf);
+        ++m_iFairQueued;
+        bufs[pushed++] = buf;  //pushed不会超过i，原地往前挪不会覆盖还没看的消息
+    }
+    std::copy(m_fairRejectScratch.begin(), m_fairRejectScratch.end(), bufs + pushed);
+    return pushed;
+}
+
+//差额轮转(DRR)：队头的连接额度够付队头消息的包长就取走它并扣减额度；不够就补一轮额度、排到末尾，看下一个连接
+//连接的队列空了就退出轮转并清掉剩余额度，一个连接再怎么狂发，每轮也只能拿走自己那份额度的消息
+bool CThreadPool::popFairJob(char*& buf)
+{
+    if (m_iFairQueued == 0)
+        return false;  //不加锁粗看一眼，空闲线程在这里反复检查时不去抢锁
+
+    std::lock_guard<std::mutex> lock(m_fairMutex);
+    while (!m_fairActive.empty())
+    {
+        FairFlow* pFlow = m_fairActive.front();
+        char* front = pFlow->msgs.front();
+        int cost = ntohs(((LPCOMM_PKG_HEADER)(front + sizeof(STRUC_MSG_HEADER)))->pkgLen);
+        if (cost > pFlow->iDeficit)
+        {
+            pFlow->iDeficit += m_iFairQuantum;
+            m_fairActive.pop_front();
+            m_fairActive.push_back(pFlow);
+            continue;
+        }
+
+        pFlow->iDeficit -= cost;
+        pFlow->msgs.pop_front();
+        --m_iFairQueued;
+        buf = front;
+        if (pFlow->msgs.empty())
+        {
+            m_fairActive.pop_front();
+            m_fairFlows.erase(pFlow->pKey);
+            m_fairFreeFlows.push_back(pFlow);
+        }
+        return true;
+    }
+    return false;
+}
+
+int CThreadPool::getFairFlowCount()
+{
+    std::lock_guard<std::mutex> lock(m_fairMutex);
+    return (int)m_fairActive.size();
+}
+
+void CThreadPool::clearFairQueue()
+{
+    std::lock_guard<std::mutex> lock(m_fairMutex);
+    for (FairFlow* pFlow : m_fairActive)
+    {
+        for (char* msg : pFlow->msgs)
+        {
+            CMsgBuf::Adopt(msg);  //接回句柄马上析构，内存随之释放
+            --m_iRecvMsgQueueCount;
+        }
+        delete pFlow;
+    }
+    for (FairFlow* pFlow : m_fairFreeFlows)
+    {
+        delete pFlow;
+    }
+    m_fairActive.clear();
+    m_fairFlows.clear();
+    m_fairFreeFlows.clear();
+    m_iFairQueued = 0;
+}
+
+//按分派方式取一条消息，取不到直接返回false
+bool CThreadPool::popJob(ThreadItem* pThread, char*& buf)
+{
+    if (m_iSchedMode == POOL_SCHED_SHARED)
+        return popSharedJob(pThread, buf);
+    if (m_iSchedMode == POOL_SCHED_FAIR)
+    {
+        //心跳之类的高优先级消息不参与轮转，先取
+        if (m_MsgRecvQueue[_MSG_PRIO_HIGH].Pop(buf))
+            return true;
+        return popFairJob(buf);
+    }
+
+    //先处理自己队列里的
+    if (pThread->laneQueue.Pop(buf))
+        return true;
+    if (m_iSchedMode == POOL_SCHED_AFFINE)
+        return false;
+
+    //自己没活了，从下一条线程开始挨个去偷
+    size_t n = m_threadVector.size();
+    for (size_t i = 1; i < n; ++i)
+    {
+        ThreadItem* pVictim = m_threadVector[(pThread->iIndex + i) % n];
+        if (pVictim->laneQueue.Pop(buf))
+        {
+            ++m_iStealCount;
+            return true;
+        }
+    }
+    return false;
+}
+
+//连接亲和模式下每条线程睡在自己的事件上，只有投给它的消息才唤醒它
+//其他模式下空闲线程都睡在线程池的事件上，谁被唤醒都能处理
+CEventCount& CThreadPool::getWaitEvent(ThreadItem* pThread)
+{
+    return (m_iSchedMode == POOL_SCHED_AFFINE) ? pThread->laneEv : m_evRecv;
+}
+
 void CThreadPool::ThreadFunc(void* threadData)
 {
-    //Ǿ̬Աǲthisָģ
+    //这里是静态成员函数，是不存在this指针的；
     ThreadItem* pThread = static_cast<ThreadItem*>(threadData);
     CThreadPool* pThreadPoolObj = pThread->_pThis;
+    CEventCount& recvEv = pThreadPoolObj->getWaitEvent(pThread);
 
+    t_pCurrent = pThreadPoolObj;
+    pThread->ifRunning = true; //线程已经跑起来了，Create()可以返回了
+
+    char* jobbuf = nullptr;
+    std::coroutine_handle<> coHandle;
     while (true) {
-        std::unique_lock<std::mutex> lock(CThreadPool::m_mutex);
+        // 就绪的协程优先恢复，它们的请求已经处理了一半，早点跑完早点释放内存
+        if (pThreadPoolObj->popResume(coHandle))
+        {
+            ++pThreadPoolObj->m_iRunningThreadNum;
+            coHandle.resume();
+            --pThreadPoolObj->m_iRunningThreadNum;
+            continue;
+        }
+
+        // 先不睡眠直接取一次，队列里有消息时全程无锁
+        if (pThreadPoolObj->popJob(pThread, jobbuf) == false)
+        {
+            // 线程池关闭，退出
+            if (pThreadPoolObj->m_shutdown) {
+                break;
+            }
+            // 没活干，正好有缩容请求就退出
+            if (pThreadPoolObj->tryRetire()) {
+                pThread->ifRetired = true;
+                break;
+            }
 
-        // ̳߳عرգ˳
-        if (m_shutdown) {
-            break;
+            // 登记为等待者之后再检查一次队列，避免在检查和睡眠之间漏掉新入队的消息
+            uint32_t key = recvEv.PrepareWait();
+            if (pThreadPoolObj->hasResume()) {
+                recvEv.CancelWait();
+                continue;
+            }
+            if (pThreadPoolObj->popJob(pThread, jobbuf) == false)
+            {
+                if (pThreadPoolObj->m_shutdown) {
+                    recvEv.CancelWait();
+                    break;
+                }
+                ++pThreadPoolObj->m_iIdleCount;
+                recvEv.Wait(key);
+                continue;
+            }
+            recvEv.CancelWait();
         }
 
-        // ȴϢ̳߳عرź
-        while (pThreadPoolObj->m_MsgRecvQueue.empty() && !m_shutdown) {
-            if (pThread->ifRunning == false)
-                pThread->ifRunning = true;
-            CThreadPool::m_cond.wait(lock);
+        --pThreadPoolObj->m_iRecvMsgQueueCount;
+        CMsgBuf msg = CMsgBuf::Adopt(jobbuf);  // 从这里起消息内存由句柄管，哪条路走完都会释放
+
+        // 连接关闭时序号会变，排队期间连接断了的消息直接扔掉，不做CRC校验也不进业务逻辑，大量断线时不在死连接上浪费线程
+        LPSTRUC_MSG_HEADER pMsgHeader = msg.Header();
+        if (pMsgHeader->iCurrsequence != pMsgHeader->pConn->iCurrsequence) {
+            ++pThreadPoolObj->m_iCancelledCount;
+            continue;
         }
 
-        // ̳߳عرˣ˳
-        if (m_shutdown ) {
-            lock.unlock();
-            break;
+        ++pThreadPoolObj->m_iRunningThreadNum;    //原子+1，记录正在干活的线程数量增加1，这比互斥量要快很多
+
+        // 统计排队时延，管理线程据此决定要不要扩容
+        uint64_t enqueueTime = pMsgHeader->iEnqueueTime;
+        uint64_t now = nowUs();
+        pThreadPoolObj->m_iDelaySumUs.fetch_add(now > enqueueTime ? now - enqueueTime : 0, std::memory_order_relaxed);
+        pThreadPoolObj->m_iDelayCount.fetch_add(1, std::memory_order_relaxed);
+
+        // 高优先级的命令（心跳、切换校验算法）不丢：丢了心跳会被当成超时踢掉，也不拿它们的时延去判断过载
+        if (msgPriority(msg.Data()) != _MSG_PRIO_HIGH
+            && pThreadPoolObj->isStale(now > enqueueTime ? now - enqueueTime : 0, now)) {
+            // 排队太久，客户端多半已经不等了，处理了也是白费，直接丢弃，把线程留给后面的消息
+            ++pThreadPoolObj->m_iStaleDropCount;
+            pThreadPoolObj->rejectRecvMsg(msg);
+        }
+        // 处理接收到的消息，交给挂起的协程的消息会被移走，由协程跑完时释放
+        else {
+            pThreadPoolObj->m_msgProc(msg);
         }
+        --pThreadPoolObj->m_iRunningThreadNum;
+    }
+}
 
-        ++pThreadPoolObj->m_iRunningThreadNum;    //ԭ+1¼ڸɻ߳1ȻҪܶ
+//把协程交回线程池：放进恢复队列，再唤醒一条线程
+//连接亲和模式下线程睡在各自的事件上，轮流挑一条唤醒，其他模式唤醒睡在共享事件上的任意一条
+void CThreadPool::PostResume(std::coroutine_handle<> h)
+{
+    if (m_resumeQueue.Push(h.address()) == false)
+    {
+        //协程不能丢，放进溢出队列
+        std::lock_guard<std::mutex> lock(m_resumeOverflowMutex);
+        m_resumeOverflow.push_back(h.address());
+        ++m_iResumeOverflowCount;
+    }
 
+    if (m_iSchedMode == POOL_SCHED_AFFINE)
+    {
+        unsigned int cur = m_iNextResumeLane.fetch_add(1, std::memory_order_relaxed);
+        m_threadVector[cur % m_threadVector.size()]->laneEv.Notify(1);
+    }
+    else
+    {
+        m_evRecv.Notify(1);
+    }
+}
 
-        // Ϣ
-        char* jobbuf = pThreadPoolObj->m_MsgRecvQueue.front();
-        pThreadPoolObj->m_MsgRecvQueue.pop_front();
-        --pThreadPoolObj->m_iRecvMsgQueueCount;
-        if(jobbuf == nullptr)
-            std::cout <<" xiaoxi : " << jobbuf << std::endl;
-        lock.unlock();
+void CThreadPool::PostResumeAfter(std::coroutine_handle<> h, int ms)
+{
+    uint64_t expire = nowUs() + (uint64_t)ms * 1000;
+    std::lock_guard<std::mutex> lock(m_coTimerMutex);
+    m_coTimers.emplace(expire, h.address());
+}
 
-        // յϢ
-        g_socket.threadRecvProcFunc(jobbuf); // Ϣĺ
+int CThreadPool::getCoTimerCount()
+{
+    std::lock_guard<std::mutex> lock(m_coTimerMutex);
+    return (int)m_coTimers.size();
+}
 
-        delete[] jobbuf;  // ͷϢڴ
-        --pThreadPoolObj->m_iRunningThreadNum;
+bool CThreadPool::popResume(std::coroutine_handle<>& h)
+{
+    void* addr;
+    if (m_resumeQueue.Pop(addr) == false)
+    {
+        if (m_iResumeOverflowCount == 0)
+            return false;
+        std::lock_guard<std::mutex> lock(m_resumeOverflowMutex);
+        if (m_resumeOverflow.empty())
+            return false;
+        addr = m_resumeOverflow.front();
+        m_resumeOverflow.pop_front();
+        --m_iResumeOverflowCount;
+    }
+    h = std::coroutine_handle<>::from_address(addr);
+    return true;
+}
+
+bool CThreadPool::hasResume() const
+{
+    return !m_resumeQueue.Empty() || m_iResumeOverflowCount > 0;
+}
+
+//把到期的协程交回线程池，由管理线程调用
+void CThreadPool::fireCoTimers()
+{
+    std::vector<void*> expired;
+    {
+        uint64_t now = nowUs();
+        std::lock_guard<std::mutex> lock(m_coTimerMutex);
+        auto iter = m_coTimers.begin();
+        while (iter != m_coTimers.end() && iter->first <= now)
+        {
+            expired.push_back(iter->second);
+            iter = m_coTimers.erase(iter);
+        }
+    }
+    for (void* addr : expired)
+    {
+        PostResume(std::coroutine_handle<>::from_address(addr));
+    }
+}
+
+void CThreadPool::AddEventWaiter(std::coroutine_handle<> h, CCoEvent* pEvent)
+{
+    std::lock_guard<std::mutex> lock(m_coWaiterMutex);
+    m_coWaiters[h.address()] = pEvent;
+}
+
+void CThreadPool::RemoveEventWaiter(std::coroutine_handle<> h)
+{
+    std::lock_guard<std::mutex> lock(m_coWaiterMutex);
+    m_coWaiters.erase(h.address());
+}
+
+//线程都退出以后，还在恢复队列、定时器上和挂在CCoEvent上的协程直接销毁，协程帧里接管的消息内存随之释放
+void CThreadPool::destroyPendingCoroutines()
+{
+    //先处理挂在事件上的：抢在Set()之前把事件标成已Set()的才归这里销毁，Set()抢先了的会被放进恢复队列，下面一起销毁
+    //事件可能就在协程帧里，销毁帧之前就得标好，销毁放到锁外做
+    std::vector<void*> waiters;
+    {
+        std::lock_guard<std::mutex> lock(m_coWaiterMutex);
+        for (auto& waiter : m_coWaiters)
+        {
+            if (waiter.second->m_state.exchange(waiter.second->setMark(), std::memory_order_acq_rel) == waiter.first)
+                waiters.push_back(waiter.first);
+        }
+        m_coWaiters.clear();
+    }
+    for (void* addr : waiters)
+    {
+        std::coroutine_handle<>::from_address(addr).destroy();
+    }
+
+    std::coroutine_handle<> h;
+    while (popResume(h))
+    {
+        h.destroy();
+    }
+    std::lock_guard<std::mutex> lock(m_coTimerMutex);
+    for (auto& timer : m_coTimers)
+    {
+        std::coroutine_handle<>::from_address(timer.second).destroy();
+    }
+    m_coTimers.clear();
+}
+
+//新建一条线程，只在共享队列模式下由管理线程调用
+CThreadPool::ThreadItem* CThreadPool::startThread()
+{
+    auto pNew = new ThreadItem(this, (int)m_threadVector.size());
+    m_threadVector.push_back(pNew);
+    ++m_iThreadNum;
+    pNew->_Handle = std::thread(&CThreadPool::ThreadFunc, pNew);
+    return pNew;
+}
+
+//领取一个缩容请求，领到了返回true，本线程应该退出
+bool CThreadPool::tryRetire()
+{
+    int n = m_iRetireRequest.load(std::memory_order_relaxed);
+    while (n > 0)
+    {
+        if (m_iRetireRequest.compare_exchange_weak(n, n - 1))
+        {
+            --m_iThreadNum;
+            return true;
+        }
+    }
+    return false;
+}
+
+//回收因缩容而退出的线程
+void CThreadPool::reapRetiredThreads()
+{
+    for (auto iter = m_threadVector.begin(); iter != m_threadVector.end(); )
+    {
+        ThreadItem* pItem = *iter;
+        if (pItem->ifRetired)
+        {
+            if (pItem->_Handle.joinable())
+                pItem->_Handle.join();
+            delete pItem;
+            iter = m_threadVector.erase(iter);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+}
+
+//根据一个周期的统计决定扩容还是缩容
+//忙：平均排队时延超过上限，或者利用率很高且队列有积压，或者队列有积压却一条消息都没取走(线程都阻塞住了)
+//闲：平均排队时延很低且利用率很低
+//扩容要连续忙几个周期，缩容要连续闲更多周期，每次只伸缩一部分，避免突发流量下来回抖动
+void CThreadPool::adjustThreadNum(uint64_t runningSum, int samples)
+{
+    uint64_t delayCount = m_iDelayCount.exchange(0);
+    uint64_t delaySum = m_iDelaySumUs.exchange(0);
+    int threads = m_iThreadNum - m_iRetireRequest; //已经请求退出但还没退出的线程不算
+    if (threads < 1 || samples <= 0)
+        return;
+
+    int avgDelay = delayCount > 0 ? (int)(delaySum / delayCount) : 0;
+    int utilization = (int)(runningSum * 100 / ((uint64_t)samples * threads));
+    int backlog = m_iRecvMsgQueueCount;
+    m_iAvgDelayUs = avgDelay;
+    m_iUtilization = utilization;
+
+    bool hot = (avgDelay > m_iDelayHighUs)
+        || (utilization >= POOL_BUSY_PERCENT && backlog > 0)
+        || (delayCount == 0 && backlog > 0);
+    bool cold = (avgDelay <= m_iDelayLowUs && utilization < POOL_IDLE_PERCENT && backlog == 0);
+
+    if (hot) {
+        ++m_iHotTicks;
+        m_iColdTicks = 0;
+    }
+    else if (cold) {
+        ++m_iColdTicks;
+        m_iHotTicks = 0;
+    }
+    else {
+        m_iHotTicks = 0;
+        m_iColdTicks = 0;
+    }
+
+    if (m_iHotTicks >= POOL_GROW_TICKS && threads < m_iMaxThreadNum)
+    {
+        int add = std::max(1, threads / 4);
+        add = std::min(add, m_iMaxThreadNum - threads);
+        //还没被领取的缩容请求先撤销掉，那些线程留下来接着干活，不够的再新建
+        int kept = m_iRetireRequest.exchange(0);
+        if (kept > add) {
+            m_iRetireRequest += kept - add;
+        }
+        for (int i = kept; i < add; ++i) {
+            startThread();
+        }
+        ++m_iGrowCount;
+        m_iHotTicks = 0;
+        globallogger->flog(LogLevel::NOTICE, "CThreadPool[%s]扩容%d->%d个线程，平均排队时延%dus，利用率%d%%，积压%d条.",
+            m_strName.c_str(), threads, threads + add, avgDelay, utilization, backlog);
+    }
+    else if (m_iColdTicks >= POOL_SHRINK_TICKS && threads > m_iMinThreadNum)
+    {
+        int sub = std::max(1, threads / 8);
+        sub = std::min(sub, threads - m_iMinThreadNum);
+        m_iRetireRequest += sub;
+        m_evRecv.Notify(sub); //让睡着的线程醒来领取退出请求
+        ++m_iShrinkCount;
+        m_iColdTicks = 0;
+        globallogger->flog(LogLevel::NOTICE, "CThreadPool[%s]缩容%d->%d个线程，平均排队时延%dus，利用率%d%%.",
+            m_strName.c_str(), threads, threads - sub, avgDelay, utilization);
+    }
+}
+
+//管理线程：每POOL_SAMPLE_INTERVAL_MS检查一次协程定时器、采样一次正在干活的线程数，自动伸缩时每POOL_ADJUST_INTERVAL_MS做一次伸缩决定
+void CThreadPool::ManageThreadFunc(void* threadData)
+{
+    CThreadPool* pThreadPoolObj = static_cast<CThreadPool*>(threadData);
+    uint64_t lastAdjust = nowUs();
+    uint64_t runningSum = 0;
+    int samples = 0;
+
+    while (!pThreadPoolObj->m_shutdown)
+    {
+        usleep(POOL_SAMPLE_INTERVAL_MS * 1000);
+        pThreadPoolObj->fireCoTimers();
+        if (pThreadPoolObj->isAutoResize() == false)
+            continue;
+
+        runningSum += pThreadPoolObj->m_iRunningThreadNum;
+        ++samples;
+
+        uint64_t now = nowUs();
+        if (now - lastAdjust < POOL_ADJUST_INTERVAL_MS * 1000ULL)
+            continue;
+
+        pThreadPoolObj->reapRetiredThreads();
+        pThreadPoolObj->adjustThreadNum(runningSum, samples);
+        lastAdjust = now;
+        runningSum = 0;
+        samples = 0;
     }
 }
 
 void CThreadPool::clearMsgRecvQueue() {
-    while (!m_MsgRecvQueue.empty()) {
-        char* msg = m_MsgRecvQueue.front();
-        delete[] msg;  // Deallocate the memory
-        m_MsgRecvQueue.pop_front();  // Remove the element from the queue
+    char* msg;
+    if (hasLanes()) {
+        for (auto& threadItem : m_threadVector) {
+            while (threadItem->laneQueue.Pop(msg)) {
+                CMsgBuf::Adopt(msg);
+                --m_iRecvMsgQueueCount;
+            }
+        }
+        return;
+    }
+    for (int prio = 0; prio < _MSG_PRIO_CLASSES; ++prio) {
+        while (m_MsgRecvQueue[prio].Pop(msg)) {
+            CMsgBuf::Adopt(msg);
+            --m_iRecvMsgQueueCount;
+        }
     }
-}
\ No newline at end of file
+    clearFairQueue();
+}
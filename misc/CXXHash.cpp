@@ -0,0 +1,247 @@
+#include "CXXHash.h"
+#include <string.h>
+
+//按xxHash规范（doc/xxhash_spec.md）写的标量版本，按长度分0、1~3、4~8、9~16、17~128、129~240、240以上几段处理
+
+static const uint32_t PRIME32_1 = 0x9E3779B1U;
+static const uint32_t PRIME32_2 = 0x85EBCA77U;
+static const uint32_t PRIME32_3 = 0xC2B2AE3DU;
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+static const uint64_t PRIME_MX1 = 0x165667919E3779F9ULL;
+static const uint64_t PRIME_MX2 = 0x9FB21C651E98DF25ULL;
+
+#define XXH3_SECRET_SIZE      192
+#define XXH3_SECRET_SIZE_MIN  136
+#define XXH3_STRIPE_LEN       64
+#define XXH3_SECRET_CONSUME   8
+#define XXH3_MIDSIZE_START    3
+#define XXH3_MIDSIZE_LAST     17
+#define XXH3_LASTACC_START    7
+#define XXH3_MERGEACCS_START  11
+
+//默认密钥
+static const unsigned char kSecret[XXH3_SECRET_SIZE] =
+{
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+//规范里的整数都是小端读
+static inline uint32_t readLE32(const unsigned char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline uint64_t readLE64(const unsigned char* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+//64位乘64位得128位，高低两半异或
+static inline uint64_t mul128Fold64(uint64_t lhs, uint64_t rhs)
+{
+	unsigned __int128 product = (unsigned __int128)lhs * rhs;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t xxh64Avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static inline uint64_t xxh3Avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= PRIME_MX1;
+	h ^= h >> 32;
+	return h;
+}
+
+static inline uint64_t rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= rotl64(h, 49) ^ rotl64(h, 24);
+	h *= PRIME_MX2;
+	h ^= (h >> 35) + len;
+	h *= PRIME_MX2;
+	h ^= h >> 28;
+	return h;
+}
+
+static inline uint64_t mix16B(const unsigned char* input, const unsigned char* secret)
+{
+	return mul128Fold64(readLE64(input) ^ readLE64(secret), readLE64(input + 8) ^ readLE64(secret + 8));
+}
+
+static uint64_t len0To16(const unsigned char* input, size_t len)
+{
+	if (len > 8)
+	{
+		uint64_t bitflip1 = readLE64(kSecret + 24) ^ readLE64(kSecret + 32);
+		uint64_t bitflip2 = readLE64(kSecret + 40) ^ readLE64(kSecret + 48);
+		uint64_t lo = readLE64(input) ^ bitflip1;
+		uint64_t hi = readLE64(input + len - 8) ^ bitflip2;
+		uint64_t acc = len + __builtin_bswap64(lo) + hi + mul128Fold64(lo, hi);
+		return xxh3Avalanche(acc);
+	}
+	if (len >= 4)
+	{
+		uint32_t in1 = readLE32(input);
+		uint32_t in2 = readLE32(input + len - 4);
+		uint64_t bitflip = readLE64(kSecret + 8) ^ readLE64(kSecret + 16);
+		uint64_t in64 = in2 + ((uint64_t)in1 << 32);
+		return rrmxmx(in64 ^ bitflip, len);
+	}
+	if (len > 0)
+	{
+		uint32_t c1 = input[0];
+		uint32_t c2 = input[len >> 1];
+		uint32_t c3 = input[len - 1];
+		uint32_t combined = (c1 << 16) | (c2 << 24) | c3 | ((uint32_t)len << 8);
+		uint64_t bitflip = (uint64_t)(readLE32(kSecret) ^ readLE32(kSecret + 4));
+		return xxh64Avalanche((uint64_t)combined ^ bitflip);
+	}
+	return xxh64Avalanche(readLE64(kSecret + 56) ^ readLE64(kSecret + 64));
+}
+
+static uint64_t len17To128(const unsigned char* input, size_t len)
+{
+	uint64_t acc = len * PRIME64_1;
+	if (len > 32)
+	{
+		if (len > 64)
+		{
+			if (len > 96)
+			{
+				acc += mix16B(input + 48, kSecret + 96);
+				acc += mix16B(input + len - 64, kSecret + 112);
+			}
+			acc += mix16B(input + 32, kSecret + 64);
+			acc += mix16B(input + len - 48, kSecret + 80);
+		}
+		acc += mix16B(input + 16, kSecret + 32);
+		acc += mix16B(input + len - 32, kSecret + 48);
+	}
+	acc += mix16B(input, kSecret);
+	acc += mix16B(input + len - 16, kSecret + 16);
+	return xxh3Avalanche(acc);
+}
+
+static uint64_t len129To240(const unsigned char* input, size_t len)
+{
+	uint64_t acc = len * PRIME64_1;
+	int rounds = (int)(len / 16);
+	for (int i = 0; i < 8; i++)
+	{
+		acc += mix16B(input + 16 * i, kSecret + 16 * i);
+	}
+	acc = xxh3Avalanche(acc);
+	uint64_t accEnd = mix16B(input + len - 16, kSecret + XXH3_SECRET_SIZE_MIN - XXH3_MIDSIZE_LAST);
+	for (int i = 8; i < rounds; i++)
+	{
+		accEnd += mix16B(input + 16 * i, kSecret + 16 * (i - 8) + XXH3_MIDSIZE_START);
+	}
+	return xxh3Avalanche(acc + accEnd);
+}
+
+//一条64字节的条带累加进8个累加器
+static inline void accumulate512(uint64_t* acc, const unsigned char* input, const unsigned char* secret)
+{
+	for (int i = 0; i < 8; i++)
+	{
+		uint64_t dataVal = readLE64(input + 8 * i);
+		uint64_t dataKey = dataVal ^ readLE64(secret + 8 * i);
+		acc[i ^ 1] += dataVal;
+		acc[i] += (uint64_t)(uint32_t)dataKey * (dataKey >> 32);
+	}
+}
+
+static inline void scrambleAcc(uint64_t* acc, const unsigned char* secret)
+{
+	for (int i = 0; i < 8; i++)
+	{
+		uint64_t a = acc[i];
+		a ^= a >> 47;
+		a ^= readLE64(secret + 8 * i);
+		a *= PRIME32_1;
+		acc[i] = a;
+	}
+}
+
+static uint64_t hashLong(const unsigned char* input, size_t len)
+{
+	uint64_t acc[8] = { PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1 };
+	const size_t stripesPerBlock = (XXH3_SECRET_SIZE - XXH3_STRIPE_LEN) / XXH3_SECRET_CONSUME;
+	const size_t blockLen = XXH3_STRIPE_LEN * stripesPerBlock;
+	const size_t blocks = (len - 1) / blockLen;
+
+	for (size_t n = 0; n < blocks; n++)
+	{
+		for (size_t s = 0; s < stripesPerBlock; s++)
+		{
+			accumulate512(acc, input + n * blockLen + s * XXH3_STRIPE_LEN, kSecret + s * XXH3_SECRET_CONSUME);
+		}
+		scrambleAcc(acc, kSecret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN);
+	}
+
+	//最后不满一块的条带，再加上以末尾对齐的最后一条
+	size_t stripes = ((len - 1) - blockLen * blocks) / XXH3_STRIPE_LEN;
+	for (size_t s = 0; s < stripes; s++)
+	{
+		accumulate512(acc, input + blocks * blockLen + s * XXH3_STRIPE_LEN, kSecret + s * XXH3_SECRET_CONSUME);
+	}
+	accumulate512(acc, input + len - XXH3_STRIPE_LEN, kSecret + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN - XXH3_LASTACC_START);
+
+	uint64_t result = len * PRIME64_1;
+	for (int i = 0; i < 4; i++)
+	{
+		const unsigned char* secret = kSecret + XXH3_MERGEACCS_START + 16 * i;
+		result += mul128Fold64(acc[2 * i] ^ readLE64(secret), acc[2 * i + 1] ^ readLE64(secret + 8));
+	}
+	return xxh3Avalanche(result);
+}
+
+uint64_t CXXHash::XXH3_64(const void* data, size_t len)
+{
+	const unsigned char* input = (const unsigned char*)data;
+	if (len <= 16)
+		return len0To16(input, len);
+	if (len <= 128)
+		return len17To128(input, len);
+	if (len <= 240)
+		return len129To240(input, len);
+	return hashLong(input, len);
+}
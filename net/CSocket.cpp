@@ -2,11 +2,15 @@
 #include "global.h"
 #include"macro.h"
 #include"CMemory.h"
+#include"CReqArena.h"
+#include"CNuma.h"
+#include"CCRC32.h"
 
 #include <mutex>
 #include <condition_variable>
 #include <thread>
 #include <vector>
+#include <algorithm>
 #include <memory>
 #include <atomic>
 #include <iostream>
@@ -21,6 +25,7 @@
 //#include <sys/socket.h>
 #include <sys/ioctl.h> //ioctl
 #include <arpa/inet.h>
+#include <linux/filter.h> //SO_ATTACH_REUSEPORT_CBPF用的sock_filter
 
 /**
  * @brief 构造函数.
@@ -31,6 +36,8 @@ CSocket::CSocket()
 	// 配置相关
 	m_worker_connections = 1;      ///< epoll连接最大项数
 	m_ListenPortCount = 1;         ///< 监听一个端口
+	m_iNumaEnable = 0;             ///< 默认不按NUMA节点绑定
+	m_iWorkerIndex = 0;
 	m_RecyConnectionWaitTime = 60; ///< 等待这么些秒后才回收连接
 
 	// epoll相关
@@ -50,6 +57,18 @@ CSocket::CSocket()
 	// 在线用户相关
 	m_onlineUserCount = 0;         ///< 在线用户数量统计
 	m_lastprintTime = 0;           ///< 上次打印统计信息的时间
+	m_lastMemProfileTime = time(NULL);
+	for (auto& count : m_lastMemTagAlloc)
+		count = 0;
+
+	for (auto& batch : m_recvBatch)
+		batch.reserve(MAX_EVENTS); ///< 一轮epoll_wait最多MAX_EVENTS个事件，每个读事件最多收完整一个包
+	m_iInlinePkgCount = 0;
+	m_iRejectPkgCount = 0;
+	m_iStreamCrc = 0;
+	m_iCrcDropCount = 0;
+	m_iIntegrityAllowMask = 0;
+	m_iPurgedSendPkgCount = 0;
 }
 
 CSocket::~CSocket()
@@ -84,6 +103,7 @@ bool CSocket::Initialize_subproc()
 		globallogger->flog(LogLevel::ERROR, "CSocekt::Initialize_subproc() 中信号量初始化失败.");
 		return false;
 	}
+	m_sendPurgeQueue.Init(SEND_PURGE_QUEUE_SIZE);
 	
 
 	// 创建线程（发送数据）
@@ -162,15 +182,7 @@ void CSocket::Shutdown_subproc()
  */
 void CSocket::clearMsgSendQueue()
 {
-	char* sTmpMempoint;
-	CMemory* p_memory = CMemory::GetInstance();
-
-	while (!m_MsgSendQueue.empty())
-	{
-		sTmpMempoint = m_MsgSendQueue.front();
-		m_MsgSendQueue.pop_front();
-		p_memory->FreeMemory(sTmpMempoint);
-	}
+	m_MsgSendQueue.clear();  //队列里的句柄析构时释放内存
 }
 
 /**
@@ -186,6 +198,7 @@ void CSocket::printTDInfo()
 	{
 		//超过10秒我们打印一次
 		int tmprmqc = g_threadpool.getRecvMsgQueueCount(); //收消息队列
+		int tmpdrpc = g_threadpool.getDiscardRecvPkgCount(); //收消息队列满而丢弃的包
 
 		m_lastprintTime = currtime;
 		int tmpoLUC = m_onlineUserCount;    //atomic做个中转，直接打印atomic类型报错；
@@ -196,6 +209,34 @@ void CSocket::printTDInfo()
 			<< m_connectionList.size() << "/" << m_recyconnectionList.size() << ")." << std::endl;
 		std::cout << "当前时间队列大小(" << m_timerQueuemap.size() << ")." << std::endl;
 		std::cout << "当前收消息队列/发消息队列大小分别为(" << tmprmqc << "/" << tmpsmqc << ")，丢弃的待发送数据包数量为" << m_iDiscardSendPkgCount << "." << std::endl;
+		std::cout << "收消息队列满而丢弃的数据包数量为" << tmpdrpc << "，收包线程直接处理的数据包数量为" << m_iInlinePkgCount
+			<< "，收包线程上CRC校验不过而丢弃的数据包数量为" << m_iCrcDropCount << "，命令表不接受而丢弃的数据包数量为" << m_iRejectPkgCount << "." << std::endl;
+		std::cout << "连接已关闭而跳过的收到的数据包/清掉的待发送数据包数量为(" << g_threadpool.getCancelledCount() << "/" << m_iPurgedSendPkgCount << ")." << std::endl;
+		std::cout << "排队过久而丢弃的数据包数量为" << g_threadpool.getStaleDropCount() << (g_threadpool.isOverloaded() ? "，线程池当前处于过载状态." : ".") << std::endl;
+		std::cout << "收消息队列中高/普通/低优先级消息分别为(" << g_threadpool.getRecvMsgQueueCount(_MSG_PRIO_HIGH) << "/"
+			<< g_threadpool.getRecvMsgQueueCount(_MSG_PRIO_NORMAL) << "/" << g_threadpool.getRecvMsgQueueCount(_MSG_PRIO_LOW) << ")." << std::endl;
+		std::cout << "线程池窃取消息次数/线程睡眠次数(" << g_threadpool.getStealCount() << "/" << g_threadpool.getIdleCount() << ")，公平队列中排队的连接数" << g_threadpool.getFairFlowCount() << "." << std::endl;
+		std::cout << "线程池当前线程数/扩容次数/缩容次数(" << g_threadpool.getThreadNum() << "/" << g_threadpool.getGrowCount() << "/" << g_threadpool.getShrinkCount()
+			<< ")，平均排队时延" << g_threadpool.getAvgQueueDelayUs() << "微秒，利用率" << g_threadpool.getUtilization() << "%." << std::endl;
+		if (g_heavythreadpool.isRunning())
+		{
+			std::cout << "heavy线程池收消息队列大小/队列满丢弃/排队过久丢弃的数据包数量/当前线程数(" << g_heavythreadpool.getRecvMsgQueueCount() << "/"
+				<< g_heavythreadpool.getDiscardRecvPkgCount() << "/" << g_heavythreadpool.getStaleDropCount() << "/" << g_heavythreadpool.getThreadNum() << ")." << std::endl;
+		}
+		//内存池：各档在用的块数/从系统要来的块数，没用过的档位不打印
+		MemClassStats memStats[MEM_CLASS_COUNT + 1];
+		CMemory::GetInstance()->GetStats(memStats);
+		std::cout << "内存池各档在用/总块数";
+		for (int i = 0; i <= MEM_CLASS_COUNT; ++i)
+		{
+			if (memStats[i].iAllocCount == 0)
+				continue;
+			if (i < MEM_CLASS_COUNT)
+				std::cout << " " << memStats[i].iBlockSize << "B:" << (memStats[i].iAllocCount - memStats[i].iFreeCount) << "/" << memStats[i].iCarved;
+			else
+				std::cout << " 超大:" << memStats[i].iCarved;
+		}
+		std::cout << "，请求临时内存不够而向内存池要块" << CReqArena::GetChunkAllocCount() << "次." << std::endl;
 		if (tmprmqc > 100000)
 		{
 			//接收队列过大，报一下，这个属于应该 引起警觉的，考虑限速等等手段
@@ -206,6 +247,58 @@ void CSocket::printTDInfo()
 	return;
 }
 
+/**
+ * @brief 把内存池按子系统的统计输出到控制台日志。
+ *
+ * 每个分配过内存的子系统一行：在用字节数、最高值、累计分配/释放次数，以及距上次输出的平均分配速率；
+ * 再一行按档位的分配次数，用来调各档大小。采样方式下都是估计值。
+ * 工作进程收到 SIGUSR1 时在事件循环里调用，内存统计没打开时只记一句提示。
+ */
+void CSocket::printMemProfile()
+{
+	CMemory* p_memory = CMemory::GetInstance();
+	int mode = p_memory->GetProfilingMode();
+	if (mode == MEM_PROFILE_OFF)
+	{
+		globallogger->clog(LogLevel::NOTICE, "内存统计没有打开，配置MemProfile后重启.");
+		return;
+	}
+
+	MemTagStats tagStats[MEM_TAG_COUNT];
+	p_memory->GetTagStats(tagStats);
+	time_t currtime = time(NULL);
+	long elapsed = (long)(currtime - m_lastMemProfileTime);
+	if (elapsed < 1)
+		elapsed = 1;
+
+	globallogger->clog(LogLevel::NOTICE, "内存统计(%s)，距上次%ld秒:", mode == MEM_PROFILE_SAMPLED ? "采样估计" : "精确", elapsed);
+	for (int tag = 0; tag < MEM_TAG_COUNT; ++tag)
+	{
+		MemTagStats& st = tagStats[tag];
+		if (st.iAllocCount == 0)
+			continue;
+		globallogger->clog(LogLevel::NOTICE, "  %-6s 在用%lldKB 最高%lldKB 分配/释放%llu/%llu次 共%lluKB 分配速率%llu次/秒",
+			CMemory::GetTagName(tag), (long long)(st.iLiveBytes >> 10), (long long)(st.iPeakBytes >> 10),
+			(unsigned long long)st.iAllocCount, (unsigned long long)st.iFreeCount, (unsigned long long)(st.iAllocBytes >> 10),
+			(unsigned long long)((st.iAllocCount - m_lastMemTagAlloc[tag]) / elapsed));
+
+		char hist[512];
+		int len = 0;
+		for (int cls = 0; cls <= MEM_CLASS_COUNT && len < (int)sizeof(hist); ++cls)
+		{
+			if (st.iHist[cls] == 0)
+				continue;
+			if (cls < MEM_CLASS_COUNT)
+				len += snprintf(hist + len, sizeof(hist) - len, " %dB:%llu", 1 << (cls + MEM_MIN_CLASS_SHIFT), (unsigned long long)st.iHist[cls]);
+			else
+				len += snprintf(hist + len, sizeof(hist) - len, " 超大:%llu", (unsigned long long)st.iHist[cls]);
+		}
+		globallogger->clog(LogLevel::NOTICE, "  %-6s 各档分配次数%s", CMemory::GetTagName(tag), hist);
+		m_lastMemTagAlloc[tag] = st.iAllocCount;
+	}
+	m_lastMemProfileTime = currtime;
+}
+
 //--------------------------------------------------------------------
 /**
  * @brief 初始化 epoll 功能，子进程中进行。
@@ -233,6 +326,13 @@ int CSocket::epoll_init()
 	//(3)遍历所有监听socket【监听端口】，我们为每个监听socket增加一个 连接池中的连接【说白了就是让一个socket和一个内存绑定，以方便记录该sokcet相关的数据、状态等等】
 	for (auto& pos : CSocket::m_ListenSocketList)
 	{
+		//按NUMA节点分发连接时只管自己那个socket，别的worker的socket在本进程里关掉；每个socket在自己的worker里一直开着，组里的下标不会变
+		if (pos->worker != -1 && pos->worker != m_iWorkerIndex)
+		{
+			close(pos->fd);
+			pos->fd = -1;
+			continue;
+		}
 		lpconnection_t p_Conn = get_connection(pos->fd);
 		if (p_Conn == nullptr)
 		{
@@ -429,9 +529,29 @@ int CSocket::epoll_init()
 		}
 	}
 
+	//本轮事件处理中收完整的包一次性交给线程池，只入队一次、按需唤醒线程
+	flushRecvBatch();
 	return 0;
 }
 
+/**
+ * @brief 把本轮epoll事件处理中攒下的完整包一次性投递给线程池。
+ *
+ * 一次epoll_wait可能收完整几百个包，逐个入队要逐个唤醒线程，批量投递只需一次入队操作，
+ * 并且只唤醒有活可干的那么多个线程。
+ */
+void CSocket::flushRecvBatch()
+{
+	for (int i = 0; i < _MSG_POOL_COUNT; ++i)
+	{
+		std::vector<CMsgBuf>& batch = m_recvBatch[i];
+		if (batch.empty())
+			continue;
+		g_msgpools[i]->inMsgRecvQueueBatchAndSignal(batch.data(), (int)batch.size());
+		batch.clear();
+	}
+}
+
 /**
  * @brief 执行 epoll 操作（增加、修改或删除事件）。
  *
@@ -505,20 +625,44 @@ int CSocket::epoll_oper_event(int fd, uint32_t eventtype, uint32_t flag, int bca
 	return 1;
 }
 
+/**
+ * @brief 发送用CPkgBuilder组好的包
+ * @details 包体已经由处理函数直接写在发送用的内存里，这里只填包头：包长、命令码，按包的校验算法算包体的crc32（只有包头的包为0），
+ *          然后和其他消息一样入发送队列，中间不再分配、拷贝。
+ *
+ * @param pkg 组好的包，发送后为空
+ */
+void CSocket::msgSend(CPkgBuilder&& pkg)
+{
+	msgSend(sealPkg(std::move(pkg)));
+}
+
+CMsgBuf CSocket::sealPkg(CPkgBuilder&& pkg)
+{
+	LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)(pkg.m_msg.Data() + m_iLenMsgHeader);
+	pPkgHeader->pkgLen = htons((unsigned short)(m_iLenPkgHeader + pkg.m_iBodyLen));
+	pPkgHeader->msgCode = htons(pkg.m_iMsgCode);
+	int crc = 0;
+	if (pkg.m_iBodyLen > 0)
+		crc = CCRC32::GetInstance()->Get_Checksum(pkg.m_iIntegrity, (unsigned char*)pkg.Body(), pkg.m_iBodyLen);
+	pPkgHeader->crc32 = htonl(crc);
+	return std::move(pkg.m_msg);
+}
+
 /**
  * @brief 将一个待发送消息入到发送消息队列中，并处理相关的安全检查。
  *
  * 该函数负责将消息放入发送队列。如果队列过大或者消息发送过慢，则采取相应的安全措施（例如丢弃消息或关闭连接）。
  *
- * @param psendbuf 待发送的消息缓冲区。
+ * @param msg 待发送的消息（消息头+包头+包体），被丢弃时在这里释放。
  */
-void CSocket::msgSend(char* psendbuf)
+void CSocket::msgSend(CMsgBuf&& msg)
 {
-	// 获取内存管理单例对象
-	CMemory* p_memory = CMemory::GetInstance();
+	// 接过来，丢弃的消息在函数返回时释放
+	CMsgBuf sendMsg(std::move(msg));
 
 	// 使用互斥量保护发送队列
-	std::lock_guard<std::mutex> lock(m_sendMessageQueueMutex); // 使用C++的锁自动管理
+	std::unique_lock<std::mutex> lock(m_sendMessageQueueMutex); // 使用C++的锁自动管理
 
 	// 检查发送队列是否过大，避免内存溢出等问题
 	if (m_iSendMsgQueueCount > 50000)
@@ -526,12 +670,11 @@ void CSocket::msgSend(char* psendbuf)
 		// 发送队列过大，可能是由于客户端不接收数据导致队列不断积压
 		// 为了防止服务器不稳定，丢弃当前消息
 		m_iDiscardSendPkgCount++;
-		p_memory->FreeMemory(psendbuf);
 		return;
 	}
 
 	// 提取消息头并检查该用户的消息发送队列状态
-	LPSTRUC_MSG_HEADER pMsgHeader = reinterpret_cast<LPSTRUC_MSG_HEADER>(psendbuf);
+	LPSTRUC_MSG_HEADER pMsgHeader = sendMsg.Header();
 	lpconnection_t p_Conn = pMsgHeader->pConn;
 
 	if (p_Conn->iSendCount > 400)
@@ -541,7 +684,7 @@ void CSocket::msgSend(char* psendbuf)
 		std::cerr << "CSocekt::msgSend() 中发现某用户 " << p_Conn->fd
 			<< " 积压了大量待发送数据包，切断与他的连接！" << std::endl;
 		m_iDiscardSendPkgCount++;
-		p_memory->FreeMemory(psendbuf);
+		lock.unlock();             // zdClosesocketProc()要清发送队列，先放开锁
 		zdClosesocketProc(p_Conn); // 关闭连接
 		return;
 	}
@@ -550,7 +693,7 @@ void CSocket::msgSend(char* psendbuf)
 	++p_Conn->iSendCount;
 
 	// 将消息缓冲区放入发送队列
-	m_MsgSendQueue.push_back(psendbuf);
+	pushSendQueue(std::move(sendMsg));
 	++m_iSendMsgQueueCount; // 原子操作增加队列大小
 
 	//将信号量的值+1,这样其他卡在sem_wait的就可以走下去
@@ -561,6 +704,87 @@ void CSocket::msgSend(char* psendbuf)
 	return;
 }
 
+void CSocket::pushSendQueue(CMsgBuf&& msg)
+{
+	lpconnection_t pConn = msg.Header()->pConn;
+	m_MsgSendQueue.push_back(std::move(msg));
+	pConn->sendQueued.push_back(std::prev(m_MsgSendQueue.end()));
+}
+
+//发送线程按队列顺序处理，删掉的一般就是这个连接最早的那个包
+std::list<CMsgBuf>::iterator CSocket::eraseSendQueue(lpconnection_t pConn, std::list<CMsgBuf>::iterator pos)
+{
+	auto& queued = pConn->sendQueued;
+	if (queued.empty() == false && queued.front() == pos)
+	{
+		queued.pop_front();
+	}
+	else
+	{
+		auto it = std::find(queued.begin(), queued.end(), pos);
+		if (it != queued.end())
+			queued.erase(it);
+	}
+	--m_iSendMsgQueueCount;
+	return m_MsgSendQueue.erase(pos);
+}
+
+/**
+ * @brief 在收包线程上直接把一个数据包写到socket，不经过发送队列和发送线程。
+ *
+ * 连接上没有排队待发的数据、也没有等epoll驱动发送的数据时才直接send()，否则为了不乱序还是放进发送队列。
+ * 一次没发完的部分按发送线程的做法拷贝一份交给epoll驱动继续发送。
+ * 发送线程send()期间不持锁，但要发完才减这个连接的iSendCount，所以持锁看到iSendCount为0时没有别的线程在写这个socket。
+ *
+ * @param pConn 连接对象
+ * @param pPkg 包头+包体，包头里的长度、命令码已经是网络序
+ * @param iPkgLen 包头+包体的长度
+ */
+void CSocket::sendPkgInline(lpconnection_t pConn, char* pPkg, unsigned short iPkgLen)
+{
+	ssize_t sendsize = -1;
+
+	std::unique_lock<std::mutex> lock(m_sendMessageQueueMutex);
+	bool direct = pConn->iSendCount == 0 && pConn->iThrowsendCount == 0;
+	if (direct)
+	{
+		sendsize = sendproc(pConn, pPkg, iPkgLen);
+		if (sendsize == iPkgLen)
+			return;  //一次发完，最常见的情况，没有任何内存分配
+		if (sendsize == 0 || sendsize == -2)
+			return;  //对端断开了，等recv()去收尾
+		if (sendsize < 0)
+			sendsize = 0; //发送缓冲区满，一个字节都没发出去
+	}
+	else
+	{
+		lock.unlock();  //msgSend()要加这把锁
+	}
+
+	//发不了或者没发完，拷贝成消息头+包头+包体的格式，和其他要发送的数据一样处理
+	CMsgBuf sendMsg = CMsgBuf::Alloc(m_iLenMsgHeader + iPkgLen, false, MEM_TAG_SEND);
+	LPSTRUC_MSG_HEADER pMsgHeader = sendMsg.Header();
+	pMsgHeader->pConn = pConn;
+	pMsgHeader->iCurrsequence = pConn->iCurrsequence;
+	memcpy(sendMsg.Data() + m_iLenMsgHeader, pPkg, iPkgLen);
+
+	if (direct == false)
+	{
+		msgSend(std::move(sendMsg));
+		return;
+	}
+
+	//剩下的部分交给epoll驱动发送，和ServerSendQueueThread()里发送缓冲区满时的处理一样
+	pConn->psendbuf = sendMsg.Data() + m_iLenMsgHeader + sendsize;
+	pConn->psendMemPointer = std::move(sendMsg);
+	pConn->isendlen = iPkgLen - sendsize;
+	++pConn->iThrowsendCount;
+	if (epoll_oper_event(pConn->fd, EPOLL_CTL_MOD, EPOLLOUT, 0, pConn) == -1)
+	{
+		globallogger->clog(LogLevel::ERROR, "CSocekt::sendPkgInline()中epoll_oper_event()失败.");
+	}
+}
+
 /**
  * @brief 主动关闭一个连接时的善后处理函数。
  *
@@ -585,9 +809,53 @@ void CSocket::zdClosesocketProc(lpconnection_t p_Conn)
 		--p_Conn->iThrowsendCount;   //归0
 
 	inRecyConnectQueue(p_Conn);
+	purgeSendQueue(p_Conn);      //序号已经变了，发送队列里这个连接的包都作废了
 	return;
 }
 
+/**
+ * @brief 让发送线程清掉已关闭连接在发送队列里的包。
+ *
+ * 连接的序号变了之后调用。发送队列只由发送线程删元素，它在锁外send()时靠这一点保住迭代器，所以这里不直接删，
+ * 只把连接交给发送线程，发送线程下一轮拿到锁时按连接的待发列表直接删，只碰这个连接自己的包。
+ * 交接队列满了就不管了，发送线程遇到序号对不上的包本来也会逐个丢弃。
+ *
+ * @param pConn 已关闭的连接
+ */
+void CSocket::purgeSendQueue(lpconnection_t pConn)
+{
+	if (pConn->iSendCount <= 0)
+		return;
+	if (m_sendPurgeQueue.Push(pConn) == false)
+		return;
+	if (sem_post(&m_semEventSendQueue) == -1)
+	{
+		globallogger->clog(LogLevel::ERROR, "CSocekt::purgeSendQueue()中sem_post(&m_semEventSendQueue)失败.");
+	}
+}
+
+/**
+ * @brief 清掉已关闭连接在发送队列里的包。
+ * @details 只由发送线程在持有m_sendMessageQueueMutex时调用。连接的待发列表按入队顺序排，序号对不上的都在前面，
+ *          删到序号对得上的为止，花的时间只和这个连接排队的包数有关。
+ *          和发送线程丢弃过期包一样不动iSendCount：连接可能已经被重新取用，iSendCount已经清零记的是新连接的包。
+ */
+void CSocket::drainSendPurge()
+{
+	lpconnection_t pConn;
+	while (m_sendPurgeQueue.Pop(pConn))
+	{
+		while (pConn->sendQueued.empty() == false)
+		{
+			auto pos = pConn->sendQueued.front();
+			if (pos->Header()->iCurrsequence == pConn->iCurrsequence)
+				break;
+			eraseSendQueue(pConn, pos);
+			++m_iPurgedSendPkgCount;
+		}
+	}
+}
+
 /**
  * @brief 读取各种配置项。
  *
@@ -598,6 +866,7 @@ void CSocket::ReadConf()
 	m_worker_connections = globalconfig->GetIntDefault("worker_connections", m_worker_connections); //epoll连接的最大项数
 	m_ListenPortCount = globalconfig->GetIntDefault("ListenPortCount", m_ListenPortCount);       //取得要监听的端口数量
 	m_RecyConnectionWaitTime = globalconfig->GetIntDefault("Sock_RecyConnectionWaitTime", m_RecyConnectionWaitTime); //等待这么些秒后才回收连接
+	m_iNumaEnable = globalconfig->GetIntDefault("NumaEnable", 0);                                            //是否按NUMA节点绑定worker、分发连接
 
 	m_ifkickTimeCount = globalconfig->GetIntDefault("Sock_WaitTimeEnable", 0);                                //是否开启踢人时钟，1：开启   0：不开启
 	m_iWaitTime = globalconfig->GetIntDefault("Sock_MaxWaitTime", m_iWaitTime);                         //多少秒检测一次是否 心跳超时，只有当Sock_WaitTimeEnable = 1时，本项才有用	
@@ -607,6 +876,10 @@ void CSocket::ReadConf()
 	m_floodAkEnable = globalconfig->GetIntDefault("Sock_FloodAttackKickEnable", 0);                          //Flood攻击检测是否开启,1：开启   0：不开启
 	m_floodTimeInterval = globalconfig->GetIntDefault("Sock_FloodTimeInterval", 100);                            //表示每次收到数据包的时间间隔是100(毫秒)
 	m_floodKickCount = globalconfig->GetIntDefault("Sock_FloodKickCounter", 10);                              //累积多少次踢出此人
+	m_rejectKickCount = globalconfig->GetIntDefault("Sock_RejectKickCounter", 0);                             //连着多少个包被命令表扔掉踢出此人，0：不踢
+	m_rateLimitEnable = globalconfig->GetIntDefault("Sock_CmdRateLimitEnable", 0);                            //是否按命令表里的限速扔包，1：开启   0：不开启
+	m_iStreamCrc = globalconfig->GetIntDefault("Sock_StreamCrc", 0);                                          //收包线程边收边校验CRC，1：开启   0：不开启
+	m_iIntegrityAllowMask = globalconfig->GetIntDefault("Sock_IntegrityAllowMask", 0x7);                      //默认允许crc32、crc32c、xxh3，不允许切成不校验
 
 	return;
 }
@@ -630,68 +903,111 @@ bool CSocket::open_listening_sockets()
 	serv_addr.sin_family = AF_INET;			//选择协议族为IPV4
 	serv_addr.sin_addr.s_addr = inet_addr("192.168.72.130"); //监听本地所有的IP地址INADDR_ANY
 
+	//按NUMA节点分发连接：每个端口给每个worker开一个SO_REUSEPORT的socket，内核按收到连接的CPU选socket，
+	//这样连接由收到它的网卡队列所在节点上的worker处理；只有一个节点或者只有一个worker时没必要，还是所有worker共用一个socket
+	int workerCount = globalconfig->GetIntDefault("WorkerProcesses", 1);
+	int copies = 1;
+	if (m_iNumaEnable == 1 && CNuma::NodeCount() > 1 && workerCount > 1)
+		copies = workerCount;
+
 	//中途用到的一些配置信息
 	for (int i = 0; i < m_ListenPortCount; i++) //要监听这么多个端口
 	{
-		//参数1：AF_INET：使用ipv4协议，一般就这么写
-	   //参数2：SOCK_STREAM：使用TCP，表示可靠连接【相对还有一个UDP套接字，表示不可靠连接】
-	   //参数3：给0，固定用法，就这么记
-		isock = socket(AF_INET, SOCK_STREAM, 0);
-		if (isock == -1)
-		{
-			globallogger->flog(LogLevel::ERROR, "CSocekt::Initialize()中socket()失败,i=%d.", i);
-			return false;
-		}
-
-		//setsockopt（）:设置一些套接字参数选项；
-		//参数2：是表示级别，和参数3配套使用，也就是说，参数3如果确定了，参数2就确定了;
-		//参数3：允许重用本地地址
-		//设置 SO_REUSEADDR
-		int reuseaddr = 1;	//打开对应的设置项
-		if (setsockopt(isock, SOL_SOCKET, SO_REUSEADDR, (const void*)&reuseaddr, sizeof(reuseaddr)) == -1)
-		{
-			globallogger->flog(LogLevel::ERROR, "CSocekt::Initialize()中setsockopt(SO_REUSEADDR)失败,i=%d.", i);
-			close(isock); //无需理会是否正常执行了                                                  
-			return false;
-		}
-
-		//设置该socket为非阻塞
-		if (setnonblocking(isock) == false)
-		{
-			globallogger->flog(LogLevel::ERROR, "CSocekt::Initialize()中setnonblocking()失败,i=%d.", i);
-			close(isock);
-			return false;
-		}
-
 		//设置本服务器要监听的地址和端口，这样客户端才能连接到该地址和端口并发送数据        
 		strinfo[0] = 0;
 		sprintf(strinfo, "ListenPort%d", i);
 		iport = globalconfig->GetIntDefault(strinfo, 10000);
 		serv_addr.sin_port = htons((in_port_t)iport);   //in_port_t其实就是uint16_t
-
-		//绑定服务器地址结构体
-		if (bind(isock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1)
+		sprintf(strinfo, "ListenIntegrity%d", i);
+		int iIntegrity = globalconfig->GetIntDefault(strinfo, _PKG_INTEGRITY_CRC32);
+		if (iIntegrity < 0 || iIntegrity >= _PKG_INTEGRITY_COUNT)
 		{
-			globallogger->clog(LogLevel::ERROR, "CSocekt::Initialize()中bind()失败,i=%d.成为原因%s", i, strerror(errno));
-			close(isock);
-			return false;
+			globallogger->flog(LogLevel::WARN, "%s=%d不是有效的校验算法，按crc32处理!", strinfo, iIntegrity);
+			iIntegrity = _PKG_INTEGRITY_CRC32;
 		}
 
-		//开始监听
-		if (listen(isock, LISTEN_BACKLOG) == -1)
+		int firstsock = -1;
+		for (int w = 0; w < copies; w++) //按worker的顺序bind，socket在reuseport组里的下标就是worker的序号
 		{
-			globallogger->flog(LogLevel::ERROR, "CSocekt::Initialize()中listen()失败,i=%d.", i);
-			close(isock);
-			return false;
+			//参数1：AF_INET：使用ipv4协议，一般就这么写
+		   //参数2：SOCK_STREAM：使用TCP，表示可靠连接【相对还有一个UDP套接字，表示不可靠连接】
+		   //参数3：给0，固定用法，就这么记
+			isock = socket(AF_INET, SOCK_STREAM, 0);
+			if (isock == -1)
+			{
+				globallogger->flog(LogLevel::ERROR, "CSocekt::Initialize()中socket()失败,i=%d.", i);
+				return false;
+			}
+
+			//setsockopt（）:设置一些套接字参数选项；
+			//参数2：是表示级别，和参数3配套使用，也就是说，参数3如果确定了，参数2就确定了;
+			//参数3：允许重用本地地址
+			//设置 SO_REUSEADDR
+			int reuseaddr = 1;	//打开对应的设置项
+			if (setsockopt(isock, SOL_SOCKET, SO_REUSEADDR, (const void*)&reuseaddr, sizeof(reuseaddr)) == -1)
+			{
+				globallogger->flog(LogLevel::ERROR, "CSocekt::Initialize()中setsockopt(SO_REUSEADDR)失败,i=%d.", i);
+				close(isock); //无需理会是否正常执行了                                                  
+				return false;
+			}
+			if (copies > 1)
+			{
+				int reuseport = 1;
+				if (setsockopt(isock, SOL_SOCKET, SO_REUSEPORT, (const void*)&reuseport, sizeof(reuseport)) == -1)
+				{
+					globallogger->flog(LogLevel::ERROR, "CSocekt::Initialize()中setsockopt(SO_REUSEPORT)失败,i=%d.", i);
+					close(isock);
+					return false;
+				}
+			}
+
+			//设置该socket为非阻塞
+			if (setnonblocking(isock) == false)
+			{
+				globallogger->flog(LogLevel::ERROR, "CSocekt::Initialize()中setnonblocking()失败,i=%d.", i);
+				close(isock);
+				return false;
+			}
+
+			//绑定服务器地址结构体
+			if (bind(isock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1)
+			{
+				globallogger->clog(LogLevel::ERROR, "CSocekt::Initialize()中bind()失败,i=%d.成为原因%s", i, strerror(errno));
+				close(isock);
+				return false;
+			}
+
+			//开始监听
+			if (listen(isock, LISTEN_BACKLOG) == -1)
+			{
+				globallogger->flog(LogLevel::ERROR, "CSocekt::Initialize()中listen()失败,i=%d.", i);
+				close(isock);
+				return false;
+			}
+
+			auto p_listensocketitem = std::make_shared<listening_t>();
+			//lplistening_t p_listensocketitem = new listening_t;
+			memset(p_listensocketitem.get(), 0, sizeof(listening_t));      //注意后边用的是 ngx_listening_t而不是lpngx_listening_t
+			p_listensocketitem->port = iport;                          //记录下所监听的端口号
+			p_listensocketitem->fd = isock;                          //套接字木柄保存下来   
+			p_listensocketitem->worker = (copies > 1) ? w : -1;      //-1：所有worker共用
+			p_listensocketitem->integrity = iIntegrity;
+			m_ListenSocketList.push_back(p_listensocketitem);          //加入到队列中
+			if (firstsock == -1)
+				firstsock = isock;
 		}
 
-		auto p_listensocketitem = std::make_shared<listening_t>();
-		//lplistening_t p_listensocketitem = new listening_t;
-		memset(p_listensocketitem.get(), 0, sizeof(listening_t));      //注意后边用的是 ngx_listening_t而不是lpngx_listening_t
-		p_listensocketitem->port = iport;                          //记录下所监听的端口号
-		p_listensocketitem->fd = isock;                          //套接字木柄保存下来   
-		globallogger->clog(LogLevel::NOTICE, "监听%d端口成功!", iport); //显示一些信息到日志中
-		m_ListenSocketList.push_back(p_listensocketitem);          //加入到队列中
+		if (copies > 1)
+		{
+			//程序装在组里任意一个socket上就对整组生效；装不上内核按四元组哈希选socket，照样能用，只是不按节点分
+			if (attach_reuseport_steering(firstsock, workerCount) == false)
+				globallogger->flog(LogLevel::WARN, "端口%d按NUMA节点分发连接失败，退回按哈希分发!", iport);
+			globallogger->clog(LogLevel::NOTICE, "监听%d端口成功，每个worker一个socket，共%d个!", iport, copies);
+		}
+		else
+		{
+			globallogger->clog(LogLevel::NOTICE, "监听%d端口成功!", iport); //显示一些信息到日志中
+		}
 	}
 
 	if (m_ListenSocketList.size() <= 0)  //不可能一个端口都不监听吧
@@ -699,6 +1015,60 @@ bool CSocket::open_listening_sockets()
 	return true;
 }
 
+/**
+ * @brief 给一组 SO_REUSEPORT 监听 socket 装上按 CPU 选 socket 的 BPF 程序。
+ *
+ * 程序取处理这个连接的 CPU 号，返回这个 CPU 所在节点上某个 worker 的 socket 在组里的下标。
+ * 没有 worker 的节点上的 CPU 返回一个越界的下标，内核遇到越界就退回按哈希选 socket。
+ *
+ * @param fd 组里任意一个监听 socket。
+ * @param workerCount worker 进程数量，也就是组里 socket 的数量。
+ * @return bool 装上了返回 `true`。
+ */
+bool CSocket::attach_reuseport_steering(int fd, int workerCount)
+{
+	std::vector<int> cpuWorker;
+	CNuma::CpuToWorker(workerCount, cpuWorker);
+
+	//每个CPU两条指令：相等就返回对应的下标，不等跳过下一条
+	std::vector<struct sock_filter> code;
+	code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)));
+	for (size_t c = 0; c < cpuWorker.size(); c++)
+	{
+		if (cpuWorker[c] < 0)
+			continue;
+		code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)c, 0, 1));
+		code.push_back(BPF_STMT(BPF_RET | BPF_K, (uint32_t)cpuWorker[c]));
+	}
+	code.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+	if (code.size() > BPF_MAXINSNS)
+		return false;  //CPU太多，一条条比较放不下
+
+	struct sock_fprog prog;
+	prog.len = (unsigned short)code.size();
+	prog.filter = code.data();
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+
+/**
+ * @brief 主进程起完 worker 进程后关掉每个 worker 专用的监听 socket。
+ *
+ * 按 NUMA 节点分发连接时每个 worker 一个 socket，主进程不 accept，要是还开着，
+ * worker 退出后它的 socket 还留在 reuseport 组里，内核照样往里分连接，就再也没人 accept 了。
+ * 主进程关掉之后 socket 只在自己的 worker 里开着，worker 退出就跟着关掉、离开组，连接由别的 socket 接。
+ * 所有 worker 共用的 socket 不关。
+ */
+void CSocket::CloseWorkerListenSockets()
+{
+	for (auto& pos : m_ListenSocketList)
+	{
+		if (pos->worker == -1 || pos->fd == -1)
+			continue;
+		close(pos->fd);
+		pos->fd = -1;
+	}
+}
+
 /**
  * @brief 关闭所有监听端口。
  *
@@ -706,12 +1076,15 @@ bool CSocket::open_listening_sockets()
  */
 void CSocket::close_listening_sockets()
 {
-	for (int i = 0; i < m_ListenPortCount; i++) //要关闭这么多个监听端口
+	for (auto& pos : m_ListenSocketList) //按NUMA节点分发连接时一个端口有多个socket
 	{
 		//ngx_log_stderr(0,"端口是%d,socketid是%d.",m_ListenSocketList[i]->port,m_ListenSocketList[i]->fd);
-		close(m_ListenSocketList[i]->fd);
-		globallogger->flog(LogLevel::NOTICE, "关闭监听端口%d!", m_ListenSocketList[i]->port); //显示一些信息到日志中
-	}//end for(int i = 0; i < m_ListenPortCount; i++)
+		if (pos->fd == -1)
+			continue;  //epoll_init()里已经关掉的别的worker的socket
+		close(pos->fd);
+		pos->fd = -1;
+		globallogger->flog(LogLevel::NOTICE, "关闭监听端口%d!", pos->port); //显示一些信息到日志中
+	}
 	return;
 }
 
@@ -790,7 +1163,7 @@ void* CSocket::ServerSendQueueThread(void* threadData)
 	ThreadItem* pThread = static_cast<ThreadItem*>(threadData);
 	CSocket* pSocketObj = pThread->_pThis;
 	
-	std::list <char*>::iterator pos, pos2, posend;
+	std::list <CMsgBuf>::iterator pos;
 
 	char* pMsgBuf;
 	LPSTRUC_MSG_HEADER	pMsgHeader;
@@ -799,8 +1172,6 @@ void* CSocket::ServerSendQueueThread(void* threadData)
 	unsigned short      itmp;
 	ssize_t             sendsize;
 
-	CMemory* p_memory = CMemory::GetInstance();
-
 	while (g_stopEvent == 0) //不退出
 	{
 		//如果信号量值>0，则 -1(减1) 并走下去，否则卡这里卡着【为了让信号量值+1，可以在其他线程调用sem_post达到，实际上在CSocekt::msgSend()调用sem_post就达到了让这里sem_wait走下去的目的】
@@ -819,21 +1190,16 @@ void* CSocket::ServerSendQueueThread(void* threadData)
 
 		if (pSocketObj->m_iSendMsgQueueCount > 0) //原子的 
 		{
-			try {
-				std::lock_guard<std::mutex> lock(pSocketObj->m_sendMessageQueueMutex); // 自动加锁，作用域结束时自动解锁
-				// 这里是操作发送消息队列的代码
-			}
-			catch (const std::system_error& e) {
-				globallogger->clog(LogLevel::NOTICE,
-					"CSocekt::ServerSendQueueThread()中mutex lock失败，错误信息: %s", e.what());
-			}
+			//只在动发送队列时持锁，send()期间放开，msgSend()不用等发送线程发完一整轮
+			//放开锁期间别的线程只会往队列末尾加包，删包只在本线程做（关连接时的清理也交给本线程），所以pos不会失效
+			std::unique_lock<std::mutex> lock(pSocketObj->m_sendMessageQueueMutex);
+			pSocketObj->drainSendPurge();
 
 			pos = pSocketObj->m_MsgSendQueue.begin();
-			posend = pSocketObj->m_MsgSendQueue.end();
 
-			while (pos != posend)
+			while (pos != pSocketObj->m_MsgSendQueue.end())
 			{
-				pMsgBuf = (*pos);                          //拿到的每个消息都是 消息头+包头+包体【但要注意，我们是不发送消息头给客户端的】
+				pMsgBuf = pos->Data();                     //拿到的每个消息都是 消息头+包头+包体【但要注意，我们是不发送消息头给客户端的】
 				pMsgHeader = (LPSTRUC_MSG_HEADER)pMsgBuf;  //指向消息头
 				pPkgHeader = (LPCOMM_PKG_HEADER)(pMsgBuf + pSocketObj->m_iLenMsgHeader);	//指向包头
 				p_Conn = pMsgHeader->pConn;
@@ -843,11 +1209,7 @@ void* CSocket::ServerSendQueueThread(void* threadData)
 				if (p_Conn->iCurrsequence != pMsgHeader->iCurrsequence)
 				{
 					//本包中保存的序列号与p_Conn【连接池中连接】中实际的序列号已经不同，丢弃此消息，小心处理该消息的删除
-					pos2 = pos;
-					pos++;
-					pSocketObj->m_MsgSendQueue.erase(pos2);
-					--pSocketObj->m_iSendMsgQueueCount; //发送消息队列容量少1		
-					p_memory->FreeMemory(pMsgBuf);
+					pos = pSocketObj->eraseSendQueue(p_Conn, pos);  //句柄析构时释放内存，发送消息队列容量少1
 					continue;
 				} //end if
 
@@ -858,14 +1220,9 @@ void* CSocket::ServerSendQueueThread(void* threadData)
 					continue;
 				}
 
-				--p_Conn->iSendCount;   //发送队列中有的数据条目数-1；
-
 				//走到这里，可以发送消息，一些必须的信息记录，要发送的东西也要从发送队列里干掉
-				p_Conn->psendMemPointer = pMsgBuf;      //发送后释放用的，因为这段内存是new出来的
-				pos2 = pos;
-				pos++;
-				pSocketObj->m_MsgSendQueue.erase(pos2);
-				--pSocketObj->m_iSendMsgQueueCount;      //发送消息队列容量少1	
+				p_Conn->psendMemPointer = std::move(*pos); //消息内存从队列移交给连接，发送完成后释放
+				pos = pSocketObj->eraseSendQueue(p_Conn, pos); //发送消息队列容量少1
 				p_Conn->psendbuf = (char*)pPkgHeader;   //要发送的数据的缓冲区指针，因为发送数据不一定全部都能发送出去，我们要记录数据发送到了哪里，需要知道下次数据从哪里开始发送
 				itmp = ntohs(pPkgHeader->pkgLen);        //包头+包体 长度 ，打包时用了htons【本机序转网络序】，所以这里为了得到该数值，用了个ntohs【网络序转本机序】；
 				p_Conn->isendlen = itmp;                 //要发送多少数据，因为发送数据不一定全部都能发送出去，我们需要知道剩余有多少数据还没发送
@@ -879,14 +1236,14 @@ void* CSocket::ServerSendQueueThread(void* threadData)
 				//(1)直接调用write或者send发送数据
 				//ngx_log_stderr(errno,"即将发送数据%ud。",p_Conn->isendlen);
 
+				lock.unlock();
 				sendsize = pSocketObj->sendproc(p_Conn, p_Conn->psendbuf, p_Conn->isendlen); //注意参数
 				if (sendsize > 0)
 				{
 					if (sendsize == p_Conn->isendlen) //成功发送出去了数据，一下就发送出去这很顺利
 					{
 						//成功发送的和要求发送的数据相等，说明全部发送成功了 发送缓冲区去了【数据全部发完】
-						p_memory->FreeMemory(p_Conn->psendMemPointer);  //释放内存
-						p_Conn->psendMemPointer = NULL;
+						p_Conn->psendMemPointer.Reset();  //释放内存
 						p_Conn->iThrowsendCount = 0;  //这行其实可以没有，因此此时此刻这东西就是=0的                        
 						//ngx_log_stderr(0,"CSocekt::ServerSendQueueThread()中数据发送完毕，很好。"); //做个提示吧，商用时可以干掉
 					}
@@ -913,7 +1270,6 @@ void* CSocket::ServerSendQueueThread(void* threadData)
 						//ngx_log_stderr(errno,"CSocekt::ServerSendQueueThread()中数据没发送完毕【发送缓冲区满】，整个要发送%d，实际发送了%d。",p_Conn->isendlen,sendsize);
 
 					} //end if(sendsize > 0)
-					continue;  //继续处理其他消息                    
 				}  //end if(sendsize > 0)
 
 				//能走到这里，应该是有点问题的
@@ -924,10 +1280,8 @@ void* CSocket::ServerSendQueueThread(void* threadData)
 					//这个打印下日志，我还真想观察观察是否真有这种现象发生
 					//ngx_log_stderr(errno,"CSocekt::ServerSendQueueThread()中sendproc()居然返回0？"); //如果对方关闭连接出现send=0，那么这个日志可能会常出现，商用时就 应该干掉
 					//然后这个包干掉，不发送了
-					p_memory->FreeMemory(p_Conn->psendMemPointer);  //释放内存
-					p_Conn->psendMemPointer = NULL;
+					p_Conn->psendMemPointer.Reset();  //释放内存
 					p_Conn->iThrowsendCount = 0;  //这行其实可以没有，因此此时此刻这东西就是=0的    
-					continue;
 				}
 
 				//能走到这里，继续处理问题
@@ -947,22 +1301,19 @@ void* CSocket::ServerSendQueueThread(void* threadData)
 						//有这情况发生？这可比较麻烦，不过先do nothing
 						globallogger->clog(LogLevel::ERROR, "CSocekt::ServerSendQueueThread()中ngx_epoll_add_event()_2失败.");
 					}
-					continue;
 				}
 
 				else
 				{
 					//能走到这里的，应该就是返回值-2了，一般就认为对端断开了，等待recv()来做断开socket以及回收资源
-					p_memory->FreeMemory(p_Conn->psendMemPointer);  //释放内存
-					p_Conn->psendMemPointer = NULL;
+					p_Conn->psendMemPointer.Reset();  //释放内存
 					p_Conn->iThrowsendCount = 0;  //这行其实可以没有，因此此时此刻这东西就是=0的  
-					continue;
 				}
 
-			} //end while(pos != posend)
-
-			/*err = pthread_mutex_unlock(&pSocketObj->m_sendMessageQueueMutex);
-			if (err != 0)  globallogger->clog(LogLevel::ERROR, "CSocekt::ServerSendQueueThread()pthread_mutex_unlock()失败，返回的错误码为%d!", err);*/
+				//发完、或者交给epoll驱动之后才减：sendPkgInline()在锁里看到iSendCount为0才直接发，这样不会和这里同时往一个socket里写
+				lock.lock();
+				--p_Conn->iSendCount;   //发送队列中有的数据条目数-1；
+			} //end while(pos != m_MsgSendQueue.end())
 
 		} //if(pSocketObj->m_iSendMsgQueueCount > 0)
 	} //end while
@@ -124,6 +124,7 @@ void CSocket::event_accept(lpconnection_t oldc)
 		}
 
 		newc->listening = oldc->listening;                    //连接对象 和监听对象关联，方便通过连接对象找监听对象
+		newc->iIntegrity = oldc->listening->integrity;        //校验算法先用这个端口配置的，客户端之后可以再切换
 		//newc->w_ready = 1;                                    //标记可以写，新连接写事件肯定是ready的，这是从连接池拿出一个连接时就要初始化好的属性            
 
 		newc->rhandler = &CSocket::read_request_handler;  //设置数据来时的读处理函数，其实官方nginx中是ngx_http_wait_request_handler()
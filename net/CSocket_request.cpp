@@ -3,7 +3,10 @@
 #include <sys/ioctl.h> //ioctl
 #include <arpa/inet.h>
 #include <pthread.h>   //多线程
+#include <sys/time.h>  //gettimeofday
+#include <algorithm>
 #include "CMemory.h"
+#include "CCRC32.h"
 
 /**
  * @brief 处理接收到的数据包
@@ -17,6 +20,12 @@ void CSocket::read_request_handler(lpconnection_t pConn)
 {
     bool isflood = false; //是否flood攻击成立
 
+    if (pConn->curStat == _PKG_BD_DISCARD)
+    {
+        discard_request_handler(pConn);
+        return;
+    }
+
     //收包，注意我们用的第二个和第三个参数，我们用的始终是这两个参数，因为我们要保证 c->precvbuf指向正确的收包位置，保证c->irecvlen指向正确的收包长度
     ssize_t reco = recvproc(pConn, pConn->precvbuf, pConn->irecvlen);
     if (reco <= 0)  
@@ -24,6 +33,14 @@ void CSocket::read_request_handler(lpconnection_t pConn)
         return;//该处理在recvproc()中已经处理过了，这里<=0就直接return        
     }
 
+    if (m_iStreamCrc == 1 && (pConn->curStat == _PKG_BD_INIT || pConn->curStat == _PKG_BD_RECVING))
+    {
+        //刚收到的包体还在缓存里，顺手把CRC算了，收完整时不用再从头读一遍；XXH3不能分段算，收完整再算
+        int iIntegrity = pConn->precvMemPointer.Header()->iIntegrity;
+        if (CCRC32::IsStreamable(iIntegrity))
+            pConn->irecvcrc = CCRC32::GetInstance()->UpdateChecksum(iIntegrity, pConn->irecvcrc, (const unsigned char*)pConn->precvbuf, (size_t)reco);
+    }
+
     //走到这里，说明成功收到了一些字节（>0），我们要开始判断收到了多少数据     
     if (pConn->curStat == _PKG_HD_INIT) //连接建立起来时肯定是这个状态，因为在get_connection()中已经把curStat成员赋值成_PKG_HD_INIT了
     {
@@ -184,13 +201,12 @@ ssize_t CSocket::recvproc(lpconnection_t c, char* buff, ssize_t buflen)
  */
 void CSocket::wait_request_handler_proc_p1(lpconnection_t pConn, bool& isflood)
 {
-    CMemory* p_memory = CMemory::GetInstance();
-
     LPCOMM_PKG_HEADER pPkgHeader;
     pPkgHeader = (LPCOMM_PKG_HEADER)pConn->dataHeadInfo; //正好收到包头时，包头信息肯定是在dataHeadInfo里；
 
     unsigned short e_pkgLen;
     e_pkgLen = ntohs(pPkgHeader->pkgLen);  //注意这里网络序转本机序，所有传输到网络上的2字节数据，都要用htons()转成网络序，所有从网络上收到的2字节数据，都要用ntohs()转成本机序
+    const MsgMeta* pMeta = getMsgMeta(ntohs(pPkgHeader->msgCode)); //命令表按命令码直接下标取，不认识的命令为nullptr
     //ntohs/htons的目的就是保证不同操作系统之间收发数据的正确性，操作系统不同，可能整数在内存中存储的顺序不同，收到的就不对了。
     //不理解的同学，直接百度"网络字节序" "主机字节序" "c++ 大端" "c++ 小端"
     //针对二进制数据的处理判断
@@ -210,17 +226,70 @@ void CSocket::wait_request_handler_proc_p1(lpconnection_t pConn, bool& isflood)
         pConn->precvbuf = pConn->dataHeadInfo;
         pConn->irecvlen = m_iLenPkgHeader;
     }
+    else if (pMeta == nullptr
+        || e_pkgLen - m_iLenPkgHeader < pMeta->minBodyLen || e_pkgLen - m_iLenPkgHeader > pMeta->maxBodyLen
+        || checkMsgRate(pConn, pMeta) == false)
+    {
+        //不认识的命令、包体长度不对、超过了这个命令的限速：不分配内存也不进线程池，包体收下来直接扔掉，后面的包照常收
+        ++m_iRejectPkgCount;
+        if (m_floodAkEnable == 1)
+        {
+            isflood = TestFlood(pConn);  //扔掉的包也算发包频率，不然只发不合规矩的包就能绕开Flood检测
+        }
+        if (m_rejectKickCount > 0 && ++pConn->RejectPkgCount >= m_rejectKickCount)
+        {
+            isflood = true;  //连着这么多个包都被扔掉，不是正常的客户端，踢掉
+        }
+        if (e_pkgLen == m_iLenPkgHeader)
+        {
+            pConn->curStat = _PKG_HD_INIT;
+            pConn->precvbuf = pConn->dataHeadInfo;
+            pConn->irecvlen = m_iLenPkgHeader;
+        }
+        else
+        {
+            pConn->curStat = _PKG_BD_DISCARD;
+            pConn->irecvlen = e_pkgLen - m_iLenPkgHeader;  //还要扔掉这么多字节
+        }
+    }
+    else if (e_pkgLen == m_iLenPkgHeader && pMeta->inlineSafe)
+    {
+        //只有包头、并且命令可以在收包线程上直接处理（比如心跳包）：直接用dataHeadInfo里的包头处理，不分配内存，不进线程池
+        pConn->RejectPkgCount = 0;
+        if (m_floodAkEnable == 1)
+        {
+            isflood = TestFlood(pConn);
+        }
+        if (isflood == false)
+        {
+            procInlinePkg(pConn, pPkgHeader);
+            ++m_iInlinePkgCount;
+        }
+        pConn->curStat = _PKG_HD_INIT;
+        pConn->precvbuf = pConn->dataHeadInfo;
+        pConn->irecvlen = m_iLenPkgHeader;
+    }
     else
     {
         //合法的包头，继续处理
+        pConn->RejectPkgCount = 0;
         //我现在要分配内存开始收包体，因为包体长度并不是固定的，所以内存肯定要new出来；
-        char* pTmpBuffer = (char*)p_memory->AllocMemory(m_iLenMsgHeader + e_pkgLen, false); //分配内存【消息头 + 包头 + 包体】，最后参数先给false，表示内存不需要memset；        
-        pConn->precvMemPointer = pTmpBuffer;  //内存开始指针
+        pConn->precvMemPointer = CMsgBuf::Alloc(m_iLenMsgHeader + e_pkgLen, false, MEM_TAG_RECV); //分配内存【消息头 + 包头 + 包体】，不需要memset，连接持有这块内存直到收完整
+        char* pTmpBuffer = pConn->precvMemPointer.Data();  //内存开始指针
 
         //a)先填写消息头内容
         LPSTRUC_MSG_HEADER ptmpMsgHeader = (LPSTRUC_MSG_HEADER)pTmpBuffer;
         ptmpMsgHeader->pConn = pConn;
         ptmpMsgHeader->iCurrsequence = pConn->iCurrsequence; //收到包时的连接池中连接序号记录到消息头里来，以备将来用；
+        ptmpMsgHeader->iPriority = pMeta->priority; //线程池按这个优先级排队
+        int iPool = pMeta->pool;
+        if (iPool < 0 || iPool >= _MSG_POOL_COUNT || g_msgpools[iPool]->isRunning() == false)
+        {
+            iPool = _MSG_POOL_DEFAULT;  //命令要去的线程池没开，并入默认线程池
+        }
+        ptmpMsgHeader->iPool = (unsigned char)iPool;
+        ptmpMsgHeader->iCrcChecked = 0;
+        ptmpMsgHeader->iIntegrity = pConn->iIntegrity.load(std::memory_order_relaxed);
         //b)再填写包头内容
         pTmpBuffer += m_iLenMsgHeader;                 //往后跳，跳过消息头，指向包头
         memcpy(pTmpBuffer, pPkgHeader, m_iLenPkgHeader); //直接把收到的包头内容原封不动的拷贝进来
@@ -241,6 +310,7 @@ void CSocket::wait_request_handler_proc_p1(lpconnection_t pConn, bool& isflood)
             pConn->curStat = _PKG_BD_INIT;                   //当前状态发生改变，包头刚好收完，准备接收包体	    
             pConn->precvbuf = pTmpBuffer + m_iLenPkgHeader;  //pTmpBuffer指向包头，这里 + m_iLenPkgHeader后指向包体 weizhi
             pConn->irecvlen = e_pkgLen - m_iLenPkgHeader;    //e_pkgLen是整个包【包头+包体】大小，-m_iLenPkgHeader【包头】  = 包体
+            pConn->irecvcrc = CCRC32::Begin();
         }
     }  //end if(e_pkgLen < m_iLenPkgHeader) 
 
@@ -249,7 +319,7 @@ void CSocket::wait_request_handler_proc_p1(lpconnection_t pConn, bool& isflood)
 
 /**
  * @brief 接收到一个完整包后的处理函数
- * @details 该函数在接收到完整包后，将数据包消息放入处理线程池处理。如果检测到Flood攻击，则释放内存。处理完后，恢复连接的状态以便接收下一个包。
+ * @details 该函数在接收到完整包后，将数据包消息放入本轮的批量投递列表，由epoll_process_events()在本轮事件处理完后统一交给线程池处理。如果检测到Flood攻击，则释放内存。处理完后，恢复连接的状态以便接收下一个包。
  *
  * @param pConn 当前连接对象
  * @param isflood 输出参数，用于指示是否检测到Flood攻击
@@ -262,24 +332,115 @@ void CSocket::wait_request_handler_proc_plast(lpconnection_t pConn, bool& isfloo
     //激发线程池中的某个线程来处理业务逻辑
     //g_threadpool.Call(irmqc);
 
-    if (isflood == false)
+    if (isflood == false && m_iStreamCrc == 1 && checkStreamCrc(pConn) == false)
     {
-        g_threadpool.inMsgRecvQueueAndSignal(pConn->precvMemPointer); //入消息队列并触发线程处理消息
+        //CRC不对，不占线程池的队列，也不用唤醒线程
+        pConn->precvMemPointer.Reset();
+        ++m_iCrcDropCount;
+    }
+    else if (isflood == false)
+    {
+        LPSTRUC_MSG_HEADER pMsgHeader = pConn->precvMemPointer.Header();
+        m_recvBatch[pMsgHeader->iPool].push_back(std::move(pConn->precvMemPointer)); //先攒着，本轮epoll事件处理完后再一起入消息队列并触发线程处理消息
     }
     else
     {
         //对于有攻击倾向的恶人，先把他的包丢掉
-        CMemory* p_memory = CMemory::GetInstance();
-        p_memory->FreeMemory(pConn->precvMemPointer); //直接释放掉内存，根本不往消息队列入
+        pConn->precvMemPointer.Reset(); //直接释放掉内存，根本不往消息队列入
     }
 
-    pConn->precvMemPointer = NULL;
     pConn->curStat = _PKG_HD_INIT;     //收包状态机的状态恢复为原始态，为收下一个包做准备                    
     pConn->precvbuf = pConn->dataHeadInfo;  //设置好收包的位置
     pConn->irecvlen = m_iLenPkgHeader;  //设置好要接收数据的大小
     return;
 }
 
+/**
+ * @brief 校验边收边算出来的CRC
+ * @details 包体收完整时调用，和包头里的crc32比较；只有包头没有包体的包crc32应该为0。校验过了在消息头里做个标记，业务线程不再算一遍。
+ *          按收到包头时连接用的校验算法校验：CRC32、CRC32C用边收边算的结果，XXH3在这里对整个包体算一次，不校验的直接通过。
+ *
+ * @param pConn 当前连接对象，precvMemPointer里是收完整的包
+ * @return CRC正确返回true
+ */
+bool CSocket::checkStreamCrc(lpconnection_t pConn)
+{
+    LPSTRUC_MSG_HEADER pMsgHeader = pConn->precvMemPointer.Header();
+    LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)(pConn->precvMemPointer.Data() + m_iLenMsgHeader);
+    int pkgcrc = (int)ntohl(pPkgHeader->crc32);
+    int iIntegrity = pMsgHeader->iIntegrity;
+    unsigned short pkglen = ntohs(pPkgHeader->pkgLen);
+    int calccrc = 0;  //只有包头的包crc32应该为0
+    if (pkglen > m_iLenPkgHeader)
+    {
+        if (iIntegrity == _PKG_INTEGRITY_NONE)
+            calccrc = pkgcrc;  //不校验，填什么都行
+        else if (CCRC32::IsStreamable(iIntegrity))
+            calccrc = CCRC32::Final(pConn->irecvcrc);
+        else
+            calccrc = CCRC32::GetInstance()->Get_Checksum(iIntegrity, (unsigned char*)pPkgHeader + m_iLenPkgHeader, pkglen - m_iLenPkgHeader);
+    }
+    if (calccrc != pkgcrc)
+    {
+        globallogger->clog(LogLevel::ERROR, "CSocket::checkStreamCrc()中CRC错误[服务器:%d/客户端:%d]，丢弃数据包!", calccrc, pkgcrc);
+        return false;
+    }
+    pMsgHeader->iCrcChecked = 1;
+    return true;
+}
+
+/**
+ * @brief 按命令的限速检查这个连接
+ * @details 收到包头时调用，每个限速命令在连接上有自己的计数槽，按1秒的固定窗口计数，只有收包线程访问，不用加锁。
+ *          Sock_CmdRateLimitEnable没开时不限速。
+ *
+ * @param pConn 当前连接对象
+ * @param pMeta 命令的元数据
+ * @return 没超过限速返回true
+ */
+bool CSocket::checkMsgRate(lpconnection_t pConn, const MsgMeta* pMeta)
+{
+    if (m_rateLimitEnable != 1 || pMeta->rateLimit == 0)
+        return true;
+
+    struct timeval sCurrTime;
+    gettimeofday(&sCurrTime, NULL);
+    uint64_t iCurrTime = (sCurrTime.tv_sec * 1000 + sCurrTime.tv_usec / 1000);  //毫秒
+    int slot = pMeta->rateSlot;
+    if (iCurrTime - pConn->rateWindowStart[slot] >= 1000)
+    {
+        pConn->rateWindowStart[slot] = iCurrTime;
+        pConn->rateCount[slot] = 0;
+    }
+    if (pConn->rateCount[slot] >= pMeta->rateLimit)
+        return false;
+    ++pConn->rateCount[slot];
+    return true;
+}
+
+/**
+ * @brief 收下命令表不接受的包的包体直接扔掉
+ * @details 包头检查不过时不分配内存，包体收进栈上的临时缓冲扔掉，收完回到收包头的状态，连接上后面的包照常处理。
+ *
+ * @param pConn 当前连接对象，irecvlen是还要扔掉的字节数
+ */
+void CSocket::discard_request_handler(lpconnection_t pConn)
+{
+    char discardbuf[4096];
+    ssize_t reco = recvproc(pConn, discardbuf, std::min<ssize_t>(pConn->irecvlen, sizeof(discardbuf)));
+    if (reco <= 0)
+    {
+        return; //该处理在recvproc()中已经处理过了
+    }
+    pConn->irecvlen -= reco;
+    if (pConn->irecvlen == 0)
+    {
+        pConn->curStat = _PKG_HD_INIT;
+        pConn->precvbuf = pConn->dataHeadInfo;
+        pConn->irecvlen = m_iLenPkgHeader;
+    }
+}
+
 /**
  * @brief 发送数据包并处理状态
  * @details 该函数用于向连接发送数据。处理各种发送结果，包括成功发送、发送缓冲区已满、对端断开连接等情况。如果发送缓冲区已满返回-1，如果对端断开返回0，如果发生其他错误返回-2。
@@ -300,7 +461,7 @@ ssize_t CSocket::sendproc(lpconnection_t c, char* buff, ssize_t size)  //ssize_t
 
     for (;; )
     {
-        n = send(c->fd, buff, size, 0); //send()系统函数， 最后一个参数flag，一般为0； 
+        n = send(c->fd, buff, size, MSG_NOSIGNAL); //send()系统函数；对端已经重置的连接上send()会产生SIGPIPE，默认动作是杀掉进程，这里不要这个信号，按EPIPE返回 
         if (n > 0) //成功发送了一些数据
         {
             //发送成功一些数据，但发送了多少，我这里不关心，也不需要再次send
@@ -349,8 +510,6 @@ ssize_t CSocket::sendproc(lpconnection_t c, char* buff, ssize_t size)  //ssize_t
  */
 void CSocket::write_request_handler(lpconnection_t pConn)
 {
-    CMemory* p_memory = CMemory::GetInstance();
-
     //这些代码的书写可以参考 void* CSocket::ServerSendQueueThread(void* threadData)
     ssize_t sendsize = sendproc(pConn, pConn->psendbuf, pConn->isendlen);
 
@@ -400,8 +559,7 @@ void CSocket::write_request_handler(lpconnection_t pConn)
     --pConn->iThrowsendCount;  //这个值恢复了
     */
     //2019.4.2调整的顺序
-    p_memory->FreeMemory(pConn->psendMemPointer);  //释放内存
-    pConn->psendMemPointer = NULL;
+    pConn->psendMemPointer.Reset();  //释放内存
     --pConn->iThrowsendCount;//这个值减减，表示出了一个发送消息队列
     if (sem_post(&m_semEventSendQueue) == -1)
         globallogger->clog(LogLevel::ERROR, "CSocket::write_request_handler()中sem_post(&m_semEventSendQueue)失败.");
@@ -413,9 +571,46 @@ void CSocket::write_request_handler(lpconnection_t pConn)
  * @brief 处理接收到的TCP消息
  * @details 该函数专门用于处理接收到的TCP消息。消息格式对讲用，通过包头以及包体内容的长度。该函数目前是一个占位函数，具体消息处理逻辑未实现。
  *
- * @param pMsgBuf 接收到的消息缓冲区
+ * @param msg 接收到的消息（消息头+包头+包体），要交给挂起的协程就把它移走，没移走的由线程池释放
+ */
+void CSocket::threadRecvProcFunc(CMsgBuf& msg)
+{
+    return;
+}
+
+/**
+ * @brief 线程池丢弃一条消息前调用
+ * @details 队列满时在收包线程上调用，排队过久时在线程池的线程上调用。消息内存由线程池的句柄持有，这里只能读。本类什么都不做，子类可以给客户端回个"服务器忙"。
+ *
+ * @param msg 被丢弃的消息（消息头+包头+包体）
+ */
+void CSocket::procRejectedMsg(const CMsgBuf& msg)
+{
+    return;
+}
+
+/**
+ * @brief 取命令码对应的元数据
+ * @details 收到包头时由收包线程调用，返回nullptr的命令包体收下来直接扔掉；优先级、线程池记录在消息头里给线程池用。
+ *          本类没有命令表，什么命令都收，包体长度不限，按普通优先级交给默认线程池，子类按自己的命令表重新实现。
+ *
+ * @param iMsgCode 命令码（本机序）
+ * @return const MsgMeta* 命令的元数据，必须在整个进程期间有效
+ */
+const MsgMeta* CSocket::getMsgMeta(unsigned short iMsgCode)
+{
+    static const MsgMeta s_anyMsg = { 0, _PKG_MAX_LENGTH, 0, 0, _MSG_PRIO_NORMAL, _MSG_POOL_DEFAULT, false };
+    return &s_anyMsg;
+}
+
+/**
+ * @brief 在收包线程上直接处理只有包头的包
+ * @details 只有元数据里inlineSafe为true的命令才会调用到这里，包头还在pConn->dataHeadInfo里，处理完就会被下一个包覆盖。回包用sendPkgInline()。
+ *
+ * @param pConn 当前连接
+ * @param pPkgHeader 包头（网络序）
  */
-void CSocket::threadRecvProcFunc(char* pMsgBuf)
+void CSocket::procInlinePkg(lpconnection_t pConn, LPCOMM_PKG_HEADER pPkgHeader)
 {
     return;
 }
\ No newline at end of file
@@ -32,7 +32,7 @@ void CSocket::AddToTimerQueue(lpconnection_t pConn)
 
 	//CLock lock(&m_timequeueMutex); //互斥，因为要操作m_timeQueuemap了
 	std::lock_guard<std::mutex> lock(m_timequeueMutex);
-	LPSTRUC_MSG_HEADER tmpMsgHeader = (LPSTRUC_MSG_HEADER)p_memory->AllocMemory(m_iLenMsgHeader, false);
+	LPSTRUC_MSG_HEADER tmpMsgHeader = (LPSTRUC_MSG_HEADER)p_memory->AllocMemory(m_iLenMsgHeader, false, MEM_TAG_TIMER);
 	tmpMsgHeader->pConn = pConn;
 	tmpMsgHeader->iCurrsequence = pConn->iCurrsequence;
 	m_timerQueuemap.insert(std::make_pair(futtime, tmpMsgHeader)); //按键 自动排序 小->大
@@ -105,7 +105,7 @@ LPSTRUC_MSG_HEADER CSocket::GetOverTimeTimer(time_t cur_time)
 			//如果不是要踢人，则最后一次超时的那个时间点开始重新计时
 			//因为下次超时的时间点还是要判断的，所以还要把这个节点加回来        
 			time_t newinqueutime = cur_time + (m_iWaitTime);
-			LPSTRUC_MSG_HEADER tmpMsgHeader = (LPSTRUC_MSG_HEADER)p_memory->AllocMemory(sizeof(STRUC_MSG_HEADER), false);
+			LPSTRUC_MSG_HEADER tmpMsgHeader = (LPSTRUC_MSG_HEADER)p_memory->AllocMemory(sizeof(STRUC_MSG_HEADER), false, MEM_TAG_TIMER);
 			tmpMsgHeader->pConn = ptmp->pConn;
 			tmpMsgHeader->iCurrsequence = ptmp->iCurrsequence;
 			m_timerQueuemap.insert(std::make_pair(newinqueutime, tmpMsgHeader)); //自动排序 小->大			
@@ -42,7 +42,6 @@ connection_s::~connection_s()//析构函数
  * - 更新当前序列号 `iCurrsequence`
  * - 将 `fd` 设置为-1
  * - 初始化包头接收状态和接收缓冲区 `precvbuf`
- * - 初始化发送缓冲区指针 `psendMemPointer`
  * - 初始化发送队列计数器 `iThrowsendCount`
  * - 更新时间戳 `lastPingTime` 和防止Flood攻击相关计数
  */
@@ -54,15 +53,17 @@ void connection_s::GetOneToUse()
     curStat = _PKG_HD_INIT;                           //收包状态机的 初始状态，准备接收数据包头的状态
     precvbuf = dataHeadInfo;                          //收包要先收到这里来，因为要先收包头，所以收数据的buff直接就是dataHeadInfo
     irecvlen = sizeof(COMM_PKG_HEADER);               //这里指定收数据的长度，这里先要收包头这么长字节的数据
+    memset(rateCount, 0, sizeof(rateCount));          //限速计数从0开始
+    memset(rateWindowStart, 0, sizeof(rateWindowStart));
+    iIntegrity = _PKG_INTEGRITY_CRC32;                //accept时再按监听端口的配置改
 
-    precvMemPointer = NULL;                         //既然没new内存，那自然指向的内存地址先给NULL
     iThrowsendCount = 0;                            //原子的
-    psendMemPointer = NULL;                         //发送数据头指针记录
     events = 0;                            //epoll事件先给0 
     lastPingTime = time(NULL);                   //上次ping的时间
 
     FloodkickLastTime = 0;                            //Flood攻击上次收到包的时间
     FloodAttackCount = 0;	                          //Flood攻击在该时间内收到包的次数统计
+    RejectPkgCount = 0;                               //连着被命令表扔掉的包数
     iSendCount = 0;                            //发送队列中有的数据条目数，若client只发不收，则可能造成此数据的不断增长 
 }
 
@@ -77,16 +78,8 @@ void connection_s::GetOneToUse()
 void connection_s::PutOneToFree()
 {
     ++iCurrsequence;
-    if (precvMemPointer != NULL)//如果该指针不为空，则表示有内存分配，需要释放内存
-    {
-        CMemory::GetInstance()->FreeMemory(precvMemPointer);
-        precvMemPointer = NULL;
-    }
-    if (psendMemPointer != NULL) //如果该指针不为空，则表示有内存分配，需要释放内存
-    {
-        CMemory::GetInstance()->FreeMemory(psendMemPointer);
-        psendMemPointer = NULL;
-    }
+    precvMemPointer.Reset();                          //收了一半的包，释放内存
+    psendMemPointer.Reset();                          //发了一半的包，释放内存
 
     iThrowsendCount = 0;                              //设置回原值，这个感觉应该用原子操作         
 }
@@ -107,7 +100,7 @@ void CSocket::initconnection()
     int ilenconnpool = sizeof(connection_t);
     for (int i = 0; i < m_worker_connections; ++i) //先创建这么多个连接，后续不够再增加
     {
-        p_Conn = (lpconnection_t)p_memory->AllocMemory(ilenconnpool, true); //创建内存，因为这里涉及到内存分配new char，所以无法执行构造函数，所以这里使用
+        p_Conn = (lpconnection_t)p_memory->AllocMemory(ilenconnpool, true, MEM_TAG_CONN); //创建内存，因为这里涉及到内存分配new char，所以无法执行构造函数，所以这里使用
         //手工调用构造函数，因为AllocMemory里无法调用构造函数
         p_Conn = new(p_Conn) connection_t();  //定位new，释放则显式调用p_Conn->~ngx_connection_t();		
         p_Conn->GetOneToUse();
@@ -161,7 +154,7 @@ lpconnection_t CSocket::get_connection(int isock)
 
     //走到这里表示没有空闲的连接了，那就考虑重新创建一个连接
     CMemory* p_memory = CMemory::GetInstance();
-    lpconnection_t p_Conn = (lpconnection_t)p_memory->AllocMemory(sizeof(connection_t), true);
+    lpconnection_t p_Conn = (lpconnection_t)p_memory->AllocMemory(sizeof(connection_t), true, MEM_TAG_CONN);
     p_Conn = new(p_Conn) connection_t();
     p_Conn->GetOneToUse();
     m_connectionList.push_back(p_Conn); //入到总表中来，但不能入到空闲表中来，因为这个连接即将被使用
@@ -338,5 +331,6 @@ void CSocket::close_connection(lpconnection_t pConn)
         close(pConn->fd);
         pConn->fd = -1;
     }
+    purgeSendQueue(pConn);  //序号已经变了，发送队列里这个连接的包都作废了
     return;
 }
\ No newline at end of file
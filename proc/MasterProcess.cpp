@@ -30,6 +30,8 @@ void MasterProcess::start()
     // 从配置文件中读取工作进程数量
     int worker_count = globalconfig->GetIntDefault("WorkerProcesses", 1);
     start_worker_processes(worker_count);
+    // 每个worker专用的监听socket已经带到worker里了，主进程不留，worker退出时它的socket才会真正关掉
+    g_socket.CloseWorkerListenSockets();
 
     // 等待信号处理
     wait_for_signal();
@@ -77,7 +79,7 @@ void MasterProcess::spawn_worker_process(int num)
         // 子进程处理
         try {
             // 创建 WorkerProcess 实例
-            std::unique_ptr<WorkerProcess> worker = std::make_unique<WorkerProcess>();
+            std::unique_ptr<WorkerProcess> worker = std::make_unique<WorkerProcess>(num);
             // 确保 worker 不为 nullptr
             if (worker) {
                 worker->start();  // 启动工作进程
@@ -1,4 +1,7 @@
 #include "WorkerProcess.h"
+#include "CNuma.h"
+
+volatile sig_atomic_t WorkerProcess::memProfileRequested_ = 0;
 
 /**
  * @brief 初始化工作进程。
@@ -20,15 +23,84 @@ void WorkerProcess::init_process()
     signalHandler_->unmask_and_set_handler(SIGTERM, handleSIGTERM);
     signalHandler_->unmask_and_set_handler(SIGINT, handleSIGINT);
     signalHandler_->unmask_and_set_handler(SIGHUP, handleSIGHUP);
-    signalHandler_->unmask_and_set_handler(SIGUSR1, handleSIGUSR1);
+    // SIGUSR1先不解除屏蔽，下面起的线程都继承屏蔽，到run()里只给事件循环的线程解除，信号才能打断epoll_wait()
+    signalHandler_->set_handler(SIGUSR1, handleSIGUSR1);
     signalHandler_->unmask_and_set_handler(SIGUSR2, handleSIGUSR2);
+
+    // 按NUMA节点绑定：CPU亲和性和内存策略会被之后起的线程继承，所以要在起线程、分配内存池和连接池之前绑好
+    g_socket.SetWorkerIndex(workerIndex_);
+    if (globalconfig->GetIntDefault("NumaEnable", 0) == 1 && CNuma::NodeCount() > 1) {
+        int node = CNuma::WorkerNode(workerIndex_);
+        if (CNuma::BindToNode(node)) {
+            globallogger->clog(LogLevel::NOTICE, "worker进程%d绑定到NUMA节点%d.", workerIndex_, node);
+        }
+        else {
+            globallogger->clog(LogLevel::WARN, "worker进程%d绑定到NUMA节点%d失败.", workerIndex_, node);
+        }
+    }
+
+    // 内存池按子系统统计，kill -USR1 worker进程输出统计
+    int tmpmemprofile = globalconfig->GetIntDefault("MemProfile", MEM_PROFILE_OFF);
+    if (tmpmemprofile != MEM_PROFILE_OFF) {
+        CMemory::GetInstance()->SetProfiling(tmpmemprofile, globalconfig->GetIntDefault("MemProfileSampleEvery", 64));
+    }
+
+    // 内存池向系统要内存的方式，要在分配连接池、起线程之前设置好
+    int tmphugepages = globalconfig->GetIntDefault("MemHugePages", MEM_BACKING_HEAP);
+    if (tmphugepages != MEM_BACKING_HEAP) {
+        size_t tmpprealloc = (size_t)globalconfig->GetIntDefault("MemPreallocMB", 0) * 1024 * 1024;
+        bool tmplock = globalconfig->GetIntDefault("MemLock", 0) == 1;
+        CMemory::GetInstance()->SetBacking(tmphugepages, tmpprealloc, tmplock);
+        size_t hugeBytes, thpBytes, lockedBytes;
+        CMemory::GetInstance()->GetBackingInfo(hugeBytes, thpBytes, lockedBytes);
+        globallogger->clog(LogLevel::NOTICE, "内存池预先映射显式大页%zuMB，透明大页%zuMB，锁住%zuMB.",
+            hugeBytes >> 20, thpBytes >> 20, lockedBytes >> 20);
+        if (tmplock && lockedBytes < hugeBytes + thpBytes) {
+            globallogger->clog(LogLevel::WARN, "内存池要求锁住内存，但有%zuMB没锁住，检查RLIMIT_MEMLOCK(ulimit -l).",
+                (hugeBytes + thpBytes - lockedBytes) >> 20);
+        }
+    }
   
     // 初始化线程池，处理接收到的消息
     int tmpthreadnums = globalconfig->GetIntDefault("ProcMsgRecvWorkThreadCount", 5);
-    if (g_threadpool.Create(tmpthreadnums) == false) {
+    int tmpqueuesize = globalconfig->GetIntDefault("ProcMsgRecvQueueSize", RECVMSGQUEUE_DEFAULT_SIZE);
+    int tmpschedmode = globalconfig->GetIntDefault("ProcMsgDispatchMode", POOL_SCHED_SHARED);
+    int tmpthreadmax = globalconfig->GetIntDefault("ProcMsgRecvWorkThreadMax", 0);
+    if (tmpthreadmax > 0) {
+        // 配置了线程数上限，线程池按排队时延和利用率在上下限之间自动伸缩
+        g_threadpool.SetAutoResize(globalconfig->GetIntDefault("ProcMsgRecvWorkThreadMin", 1), tmpthreadmax,
+            globalconfig->GetIntDefault("ProcMsgRecvQueueDelayHigh", 10), globalconfig->GetIntDefault("ProcMsgRecvQueueDelayLow", 1));
+    }
+    // 排队过久的消息丢弃，回客户端"服务器忙"
+    int tmpqueuetarget = globalconfig->GetIntDefault("ProcMsgQueueTargetMs", POOL_CODEL_TARGET_MS);
+    int tmpqueueinterval = globalconfig->GetIntDefault("ProcMsgQueueIntervalMs", POOL_CODEL_INTERVAL_MS);
+    int tmpqueuedeadline = globalconfig->GetIntDefault("ProcMsgQueueDeadlineMs", POOL_QUEUE_DEADLINE_MS);
+    g_threadpool.SetQueueDelayLimit(tmpqueuetarget, tmpqueueinterval, tmpqueuedeadline);
+    // 公平队列模式下每轮每个连接的额度和每个连接的队列长度
+    g_threadpool.SetFairQueue(globalconfig->GetIntDefault("ProcMsgFairQuantum", POOL_FAIR_QUANTUM),
+        globalconfig->GetIntDefault("ProcMsgFairFlowQueueSize", POOL_FAIR_FLOW_MAX));
+    g_threadpool.SetMsgProc([](CMsgBuf& msg) { g_socket.threadRecvProcFunc(msg); });
+    g_threadpool.SetMsgReject([](const CMsgBuf& msg) { g_socket.procRejectedMsg(msg); });
+    if (g_threadpool.Create(tmpthreadnums, tmpqueuesize, tmpschedmode) == false) {
         // 如果线程池创建失败，退出
         exit(-2);
     }
+
+    // 开销大的命令单独一个线程池，线程数配成0就不开，这些命令并入默认线程池
+    // 连接亲和模式要保证同一连接的消息按顺序处理，命令分到两个线程池就保证不了，这时不开
+    int tmpheavythreadnums = globalconfig->GetIntDefault("ProcMsgHeavyWorkThreadCount", 0);
+    if (tmpheavythreadnums > 0 && tmpschedmode == POOL_SCHED_AFFINE) {
+        globallogger->clog(LogLevel::WARN, "ProcMsgDispatchMode为连接亲和模式，ProcMsgHeavyWorkThreadCount=%d不生效，所有命令都在默认线程池处理.", tmpheavythreadnums);
+        tmpheavythreadnums = 0;
+    }
+    if (tmpheavythreadnums > 0) {
+        g_heavythreadpool.SetQueueDelayLimit(tmpqueuetarget, tmpqueueinterval, tmpqueuedeadline);
+        g_heavythreadpool.SetMsgProc([](CMsgBuf& msg) { g_socket.threadRecvProcFunc(msg); });
+        g_heavythreadpool.SetMsgReject([](const CMsgBuf& msg) { g_socket.procRejectedMsg(msg); });
+        if (g_heavythreadpool.Create(tmpheavythreadnums, tmpqueuesize, POOL_SCHED_SHARED) == false) {
+            exit(-2);
+        }
+    }
     sleep(1); // 休息一下
     
     // 初始化子进程相关的多线程资源
@@ -123,7 +195,8 @@ void WorkerProcess::handleSIGHUP(int signo, siginfo_t* siginfo, void* ucontext)
 void WorkerProcess::handleSIGUSR1(int signo, siginfo_t* siginfo, void* ucontext)
 {
     globallogger->clog(LogLevel::INFO, "Worker process received SIGUSR1, performing specific task...");
-    // 执行用户自定义操作
+    // 只做个标记，事件循环里再输出内存统计，统计要加锁写日志
+    memProfileRequested_ = 1;
 }
 
 /**
@@ -150,12 +223,25 @@ void WorkerProcess::handleSIGUSR2(int signo, siginfo_t* siginfo, void* ucontext)
  */
 void WorkerProcess::run()
 {
+    // 只有本线程收SIGUSR1，epoll_wait()被打断返回后马上输出内存统计，不用等下一个网络事件
+    sigset_t usr1set;
+    sigemptyset(&usr1set);
+    sigaddset(&usr1set, SIGUSR1);
+    if (pthread_sigmask(SIG_UNBLOCK, &usr1set, nullptr) != 0) {
+        globallogger->clog(LogLevel::ALERT, "pthread_sigmask()解除SIGUSR1失败!");
+    }
+
     // 进入子进程的事件循环
     for (;;) {
         g_socket.epoll_process_events(-1);
+        if (memProfileRequested_) {
+            memProfileRequested_ = 0;
+            g_socket.printMemProfile();
+        }
     }
 
     // 退出事件循环，停止线程池和释放资源
     g_threadpool.StopAll();      // 停止线程池
+    g_heavythreadpool.StopAll();
     g_socket.Shutdown_subproc(); // 释放与 socket 相关的资源
 }
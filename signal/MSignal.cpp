@@ -72,7 +72,19 @@ void MSignal::unmask_and_set_handler(int signo, SignalHandlerFunction handler)
         globallogger->flog(LogLevel::ALERT, "sigprocmask()解除信号失败!");
     }
 
-    // 设置该信号的处理器
+    set_handler(signo, handler);
+}
+
+/**
+ * @brief 设置信号处理函数，不解除屏蔽。
+ *
+ * 之后起的线程都继承屏蔽，只有自己解除了屏蔽的线程会收到这个信号。
+ *
+ * @param signo 信号编号。
+ * @param handler 信号处理函数。
+ */
+void MSignal::set_handler(int signo, SignalHandlerFunction handler)
+{
     struct sigaction sa;
     sa.sa_flags = SA_SIGINFO;
     sa.sa_sigaction = handler;
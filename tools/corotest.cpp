@@ -0,0 +1,149 @@
+//协程在线程池上挂起、恢复、线程池退出时销毁的测试，直接驱动线程池，不用起服务器
+//协程在主线程上Start()，挂起后由线程池的线程恢复；最后一组在线程池退出时还挂着，要被销毁，帧里的对象要析构
+//用法：make test，或者make bench之后运行 tools/corotest，全部通过返回0
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "CThreadPool.h"
+#include "CCoroutine.h"
+#include "CSocket.h"
+#include "Logger.h"
+#include "Config.h"
+
+Logger* globallogger = Logger::GetInstance();
+Config* globalconfig = Config::GetInstance();
+CThreadPool g_threadpool("corotest");  //协程不在线程池的线程上挂起时交给它
+
+//线程池只用到连接对象的地址和iCurrsequence，不链接网络部分的代码，构造、析构在这里给个最简单的
+connection_s::connection_s() : iCurrsequence(0) {}
+connection_s::~connection_s() {}
+
+static int s_iFailed = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("  失败：%s（第%d行）\n", #cond, __LINE__); s_iFailed++; } } while (0)
+
+//协程帧里放一个，帧销毁时（跑完或者被线程池销毁）计数
+struct FrameGuard
+{
+	std::atomic<int>& iDestroyed;
+	explicit FrameGuard(std::atomic<int>& n) : iDestroyed(n) {}
+	~FrameGuard() { ++iDestroyed; }
+};
+
+static CMsgBuf makeMsg()
+{
+	return CMsgBuf::Alloc(sizeof(STRUC_MSG_HEADER) + sizeof(COMM_PKG_HEADER), true);
+}
+
+//最多等iMs毫秒直到cond()为true
+template<typename Cond>
+static bool waitFor(Cond&& cond, int iMs)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(iMs);
+	while (!cond())
+	{
+		if (std::chrono::steady_clock::now() > deadline)
+			return false;
+		usleep(1000);
+	}
+	return true;
+}
+
+//等事件，记下是在哪个线程池的线程上恢复的
+static CCoTask waitEvent(CCoEvent& ev, std::atomic<int>& iDone, std::atomic<CThreadPool*>& pResumedOn, std::atomic<int>& iDestroyed)
+{
+	FrameGuard guard(iDestroyed);
+	co_await ev;
+	pResumedOn = CThreadPool::Current();
+	++iDone;
+}
+
+static CCoTask sleepThenDone(int iMs, std::atomic<int>& iDone, std::atomic<int>& iDestroyed)
+{
+	FrameGuard guard(iDestroyed);
+	co_await CCoSleep(iMs);
+	++iDone;
+}
+
+static CCoTask yieldTwice(std::atomic<int>& iDone, std::atomic<int>& iDestroyed)
+{
+	FrameGuard guard(iDestroyed);
+	co_await CCoYield();
+	co_await CCoYield();
+	++iDone;
+}
+
+static void testResume()
+{
+	printf("挂起后由线程池恢复：\n");
+	int iLive = CCoTask::GetLiveCount();
+	std::atomic<int> iDone(0), iDestroyed(0);
+	std::atomic<CThreadPool*> pResumedOn(nullptr);
+
+	CCoEvent ev;
+	waitEvent(ev, iDone, pResumedOn, iDestroyed).Start(makeMsg());
+	CHECK(iDone == 0);                        //还没Set()，挂着
+	CHECK(CCoTask::GetLiveCount() == iLive + 1);
+	ev.Set();
+	CHECK(waitFor([&]() { return iDone == 1; }, 2000));
+	CHECK(pResumedOn == &g_threadpool);       //主线程上挂起的交给g_threadpool恢复
+
+	//先Set()再co_await的不挂起，直接在主线程上跑完
+	CCoEvent evSet;
+	evSet.Set();
+	waitEvent(evSet, iDone, pResumedOn, iDestroyed).Start(makeMsg());
+	CHECK(iDone == 2);
+	CHECK(pResumedOn == nullptr);
+
+	sleepThenDone(20, iDone, iDestroyed).Start(makeMsg());
+	yieldTwice(iDone, iDestroyed).Start(makeMsg());
+	CHECK(waitFor([&]() { return iDone == 4; }, 2000));
+	CHECK(waitFor([&]() { return CCoTask::GetLiveCount() == iLive; }, 2000));
+	CHECK(iDestroyed == 4);
+}
+
+static void testDestroyOnStop()
+{
+	printf("线程池退出时销毁还挂着的协程：\n");
+	int iLive = CCoTask::GetLiveCount();
+	std::atomic<int> iDone(0), iDestroyed(0);
+	std::atomic<CThreadPool*> pResumedOn(nullptr);
+
+	CCoEvent ev1, ev2;
+	waitEvent(ev1, iDone, pResumedOn, iDestroyed).Start(makeMsg());
+	waitEvent(ev2, iDone, pResumedOn, iDestroyed).Start(makeMsg());
+	sleepThenDone(60000, iDone, iDestroyed).Start(makeMsg());
+	CHECK(CCoTask::GetLiveCount() == iLive + 3);
+
+	g_threadpool.StopAll();
+	CHECK(iDone == 0);
+	CHECK(iDestroyed == 3);                   //挂在事件上的、定时器上的都销毁了
+	CHECK(CCoTask::GetLiveCount() == iLive);
+
+	//等待者已经销毁，之后再Set()不能再把它交回线程池
+	ev1.Set();
+	ev2.Set();
+	CHECK(iDone == 0);
+}
+
+int main()
+{
+	g_threadpool.SetMsgProc([](CMsgBuf&) {});
+	if (g_threadpool.Create(2) == false)
+	{
+		printf("线程池创建失败\n");
+		return 1;
+	}
+	testResume();
+	testDestroyOnStop();
+	if (s_iFailed != 0)
+	{
+		printf("有%d项失败\n", s_iFailed);
+		return 1;
+	}
+	printf("全部通过\n");
+	return 0;
+}
@@ -0,0 +1,114 @@
+//CRC32几种算法的吞吐量对比，先核对各算法和查表法算出来的值一样，再按包长测GB/s
+//用法：make bench 之后运行 tools/crcbench [每种包长算多少MB=256]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "CCRC32.h"
+
+static const unsigned int s_sizes[] = { 64, 256, 1024, 4096, 65536 }; //测速用的包长
+
+static double nowSec()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//各种长度、各种起点对齐都和查表法比一遍，长度跨过pclmul的64字节门槛和16字节尾巴
+static bool verify(CCRC32* pCrc, int impl, const unsigned char* buf, size_t bufLen)
+{
+	for (size_t off = 0; off < 16; off++)
+	{
+		for (size_t len = 0; len + off <= bufLen && len <= 1100; len++)
+		{
+			pCrc->SetImpl(CRC32_IMPL_TABLE);
+			int expect = pCrc->Get_CRC((unsigned char*)buf + off, (unsigned int)len);
+			pCrc->SetImpl(impl);
+			int got = pCrc->Get_CRC((unsigned char*)buf + off, (unsigned int)len);
+			if (got != expect)
+			{
+				printf("  %s 和 table 不一致：起点偏移%zu，长度%zu，%08x != %08x\n", CCRC32::GetImplName(impl), off, len, (unsigned)got, (unsigned)expect);
+				return false;
+			}
+		}
+	}
+	//分段算的结果也要和一次算完相同
+	pCrc->SetImpl(impl);
+	unsigned int crc = CCRC32::Begin();
+	for (size_t pos = 0; pos < bufLen; pos += 37)
+		crc = pCrc->Update(crc, buf + pos, (pos + 37 <= bufLen) ? 37 : bufLen - pos);
+	pCrc->SetImpl(CRC32_IMPL_TABLE);
+	if (CCRC32::Final(crc) != pCrc->Get_CRC((unsigned char*)buf, (unsigned int)bufLen))
+	{
+		printf("  %s 分段计算和一次算完不一致\n", CCRC32::GetImplName(impl));
+		return false;
+	}
+	return true;
+}
+
+//返回GB/s
+static double measure(CCRC32* pCrc, int impl, const unsigned char* buf, unsigned int size, size_t totalBytes)
+{
+	pCrc->SetImpl(impl);
+	size_t rounds = totalBytes / size;
+	volatile int sink = 0;  //不让编译器把计算优化掉
+	double start = nowSec();
+	for (size_t i = 0; i < rounds; i++)
+		sink = sink + pCrc->Get_CRC((unsigned char*)buf, size);
+	double elapsed = nowSec() - start;
+	return (double)rounds * size / elapsed / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+	int iMB = (argc > 1) ? atoi(argv[1]) : 256;
+	if (iMB <= 0)
+	{
+		fprintf(stderr, "用法: %s [每种包长算多少MB]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<unsigned char> buf(65536 + 64);
+	srand(12345);
+	for (auto& c : buf)
+		c = (unsigned char)rand();
+
+	CCRC32* pCrc = CCRC32::GetInstance();
+	int iDefault = pCrc->GetImpl();
+	std::vector<int> impls;
+	bool bOk = true;
+	printf("核对结果（以查表法为准）：\n");
+	for (int impl = CRC32_IMPL_SLICE8; impl < CRC32_IMPL_COUNT; impl++)
+	{
+		if (!CCRC32::IsImplSupported(impl))
+		{
+			printf("  %s 当前CPU不支持，跳过\n", CCRC32::GetImplName(impl));
+			continue;
+		}
+		if (!verify(pCrc, impl, buf.data(), buf.size()))
+		{
+			bOk = false;
+			continue;
+		}
+		printf("  %s 一致\n", CCRC32::GetImplName(impl));
+		impls.push_back(impl);
+	}
+
+	printf("吞吐量(GB/s)，每种包长算%dMB，服务器默认用%s：\n", iMB, CCRC32::GetImplName(iDefault));
+	printf("  %8s", "包长");
+	printf(" %9s", CCRC32::GetImplName(CRC32_IMPL_TABLE));
+	for (int impl : impls)
+		printf(" %9s", CCRC32::GetImplName(impl));
+	printf("\n");
+	for (unsigned int size : s_sizes)
+	{
+		printf("  %8u", size);
+		printf(" %9.2f", measure(pCrc, CRC32_IMPL_TABLE, buf.data(), size, (size_t)iMB << 20));
+		for (int impl : impls)
+			printf(" %9.2f", measure(pCrc, impl, buf.data(), size, (size_t)iMB << 20));
+		printf("\n");
+	}
+	pCrc->SetImpl(iDefault);
+	return bOk ? 0 : 1;
+}
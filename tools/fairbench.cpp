@@ -0,0 +1,86 @@
+//公平队列分派方式(ProcMsgDispatchMode=3)和共享队列分派方式(0)的排队时延对比，直接驱动线程池，不用起服务器
+//一个连接先突发一批请求，另一个连接紧接着发一个请求，看后面这个请求等了多久才处理完
+//用法：make bench 之后运行 tools/fairbench [线程数=2] [突发请求数=200] [每个请求的处理耗时(微秒)=5000]
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+
+#include "CThreadPool.h"
+#include "CSocket.h"
+#include "Logger.h"
+#include "Config.h"
+
+Logger* globallogger = Logger::GetInstance();
+Config* globalconfig = Config::GetInstance();
+
+//线程池只用到连接对象的地址和iCurrsequence，不链接网络部分的代码，构造、析构在这里给个最简单的
+connection_s::connection_s() : iCurrsequence(0) {}
+connection_s::~connection_s() {}
+
+#define BENCH_PKG_BODY_LEN 100  //每个请求按这么长的包体算公平队列的额度
+
+static uint64_t nowUs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static CMsgBuf makeMsg(lpconnection_t pConn)
+{
+	CMsgBuf msg = CMsgBuf::Alloc(sizeof(STRUC_MSG_HEADER) + sizeof(COMM_PKG_HEADER) + BENCH_PKG_BODY_LEN, true);
+	LPSTRUC_MSG_HEADER pMsgHeader = msg.Header();
+	pMsgHeader->pConn = pConn;
+	pMsgHeader->iCurrsequence = pConn->iCurrsequence;
+	pMsgHeader->iPriority = _MSG_PRIO_NORMAL;
+	LPCOMM_PKG_HEADER pPkgHeader = (LPCOMM_PKG_HEADER)(msg.Data() + sizeof(STRUC_MSG_HEADER));
+	pPkgHeader->pkgLen = htons((unsigned short)(sizeof(COMM_PKG_HEADER) + BENCH_PKG_BODY_LEN));
+	return msg;
+}
+
+//返回安静连接那个请求从入队到处理完的微秒数
+static uint64_t runOnce(int iSchedMode, int iThreads, int iBurst, int iCostUs)
+{
+	connection_s noisy, quiet;
+	std::atomic<int> iDone(0);
+	std::atomic<uint64_t> iQuietDoneUs(0);
+
+	CThreadPool pool("bench");
+	pool.SetQueueDelayLimit(0, 1, 0); //不按排队时延丢弃，只比较调度顺序
+	pool.SetMsgProc([&](CMsgBuf& msg) {
+		usleep(iCostUs);
+		if (msg.Header()->pConn == &quiet)
+			iQuietDoneUs = nowUs();
+		++iDone;
+	});
+	if (pool.Create(iThreads, RECVMSGQUEUE_DEFAULT_SIZE, iSchedMode) == false)
+		exit(1);
+
+	for (int i = 0; i < iBurst; i++)
+		pool.inMsgRecvQueueAndSignal(makeMsg(&noisy));
+	uint64_t iStartUs = nowUs();
+	pool.inMsgRecvQueueAndSignal(makeMsg(&quiet));
+
+	while (iDone < iBurst + 1)
+		usleep(1000);
+	pool.StopAll();
+	return iQuietDoneUs - iStartUs;
+}
+
+int main(int argc, char* argv[])
+{
+	int iThreads = (argc > 1) ? atoi(argv[1]) : 2;
+	int iBurst = (argc > 2) ? atoi(argv[2]) : 200;
+	int iCostUs = (argc > 3) ? atoi(argv[3]) : 5000;
+	if (iThreads <= 0 || iBurst < 0 || iCostUs < 0)
+	{
+		fprintf(stderr, "用法: %s [线程数] [突发请求数] [每个请求的处理耗时(微秒)]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%d个线程，一个连接突发%d个请求，每个请求处理%d微秒，另一个连接的请求排在后面：\n", iThreads, iBurst, iCostUs);
+	printf("  共享队列(0): %.1fms\n", runOnce(POOL_SCHED_SHARED, iThreads, iBurst, iCostUs) / 1000.0);
+	printf("  公平队列(3): %.1fms\n", runOnce(POOL_SCHED_FAIR, iThreads, iBurst, iCostUs) / 1000.0);
+	return 0;
+}
@@ -0,0 +1,516 @@
+//消息编解码代码生成工具：读proto/下的.msg消息定义，生成_include/下的头文件
+//编译时由tools/makefile先编出来再运行，它自己不链接进服务器
+//用法：msggen xxx.msg xxx.msg.h
+//
+//.msg文件格式：
+//  //消息前面单独成行的注释是消息的说明
+//  message Register
+//  {
+//      i32      type;                //字段后面的注释是字段的说明
+//      string   username max 55;     //字符串要给最大字节数
+//      u32[]    items max 16;        //数组要给最多元素个数，元素只能是整数或者bool
+//      optional u32 version;         //optional字段只能放在消息末尾
+//  }
+//  字段类型：bool u8 i8 u16 i16 u32 i32 u64 i64 string，整数和bool可以加[]成为数组
+//  编码方式见_include/CMsgCodec.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#define MSGGEN_MAX_BODY  65535   //包体长度用unsigned short表示
+
+struct TypeInfo
+{
+	const char* cppType;  //生成代码里的C++类型
+	size_t      size;     //编码后的字节数，string为0
+};
+
+static const std::map<std::string, TypeInfo> s_types =
+{
+	{ "bool",   { "bool",        1 } },
+	{ "u8",     { "uint8_t",     1 } },
+	{ "i8",     { "int8_t",      1 } },
+	{ "u16",    { "uint16_t",    2 } },
+	{ "i16",    { "int16_t",     2 } },
+	{ "u32",    { "uint32_t",    4 } },
+	{ "i32",    { "int32_t",     4 } },
+	{ "u64",    { "uint64_t",    8 } },
+	{ "i64",    { "int64_t",     8 } },
+	{ "string", { "std::string_view", 0 } },
+};
+
+struct Field
+{
+	std::string name;
+	std::string type;      //s_types里的名字
+	bool        isArray = false;
+	bool        optional = false;
+	size_t      maxCount = 0;  //string的最大字节数、数组的最多元素个数
+	std::string comment;
+	int         line = 0;
+
+	const TypeInfo& info() const { return s_types.at(type); }
+	bool isString() const { return type == "string"; }
+	bool isVar() const { return isString() || isArray; }
+	size_t elemSize() const { return isString() ? 1 : info().size; }
+	size_t minSize() const { return optional ? 0 : (isVar() ? 2 : elemSize()); }
+	size_t maxSize() const { return (optional ? 1 : 0) + (isVar() ? 2 + maxCount * elemSize() : elemSize()); }
+};
+
+struct Message
+{
+	std::string              name;
+	std::vector<std::string> comments;
+	std::vector<Field>       fields;
+	int                      line = 0;
+};
+
+struct Token
+{
+	std::string text;
+	int         line;
+};
+
+static std::string s_srcName;
+
+static void fail(int line, const std::string& msg)
+{
+	fprintf(stderr, "%s:%d: %s\n", s_srcName.c_str(), line, msg.c_str());
+	exit(1);
+}
+
+static bool isIdent(const std::string& s)
+{
+	if (s.empty() || !(isalpha((unsigned char)s[0]) || s[0] == '_'))
+		return false;
+	for (char c : s)
+	{
+		if (!(isalnum((unsigned char)c) || c == '_'))
+			return false;
+	}
+	return true;
+}
+
+static std::string trim(const std::string& s)
+{
+	size_t b = s.find_first_not_of(" \t\r");
+	if (b == std::string::npos)
+		return "";
+	size_t e = s.find_last_not_of(" \t\r");
+	return s.substr(b, e - b + 1);
+}
+
+//把文件拆成记号，每行的注释单独记下来
+static void tokenize(std::istream& in, std::vector<Token>& tokens, std::map<int, std::string>& lineComments, std::set<int>& commentOnlyLines)
+{
+	std::string text;
+	int line = 0;
+	while (std::getline(in, text))
+	{
+		line++;
+		size_t pos = text.find("//");
+		if (pos != std::string::npos)
+		{
+			lineComments[line] = trim(text.substr(pos + 2));
+			if (trim(text.substr(0, pos)).empty())
+				commentOnlyLines.insert(line);
+			text.resize(pos);
+		}
+		std::string cur;
+		for (char c : text)
+		{
+			if (c == ' ' || c == '\t' || c == '\r' || c == '{' || c == '}' || c == ';' || c == '[' || c == ']')
+			{
+				if (!cur.empty())
+					tokens.push_back({ cur, line });
+				cur.clear();
+				if (c != ' ' && c != '\t' && c != '\r')
+					tokens.push_back({ std::string(1, c), line });
+			}
+			else
+			{
+				cur += c;
+			}
+		}
+		if (!cur.empty())
+			tokens.push_back({ cur, line });
+	}
+}
+
+static std::vector<Message> parse(std::istream& in)
+{
+	std::vector<Token> tokens;
+	std::map<int, std::string> lineComments;
+	std::set<int> commentOnlyLines;
+	tokenize(in, tokens, lineComments, commentOnlyLines);
+
+	size_t i = 0;
+	auto peek = [&]() -> const std::string& { static const std::string eof; return i < tokens.size() ? tokens[i].text : eof; };
+	auto line = [&]() { return i < tokens.size() ? tokens[i].line : (tokens.empty() ? 0 : tokens.back().line); };
+	auto expect = [&](const char* what)
+	{
+		if (peek() != what)
+			fail(line(), std::string("这里应该是'") + what + "'");
+		i++;
+	};
+
+	std::vector<Message> msgs;
+	std::set<std::string> msgNames;
+	while (i < tokens.size())
+	{
+		Message msg;
+		msg.line = line();
+		expect("message");
+		for (int l = msg.line - 1; commentOnlyLines.count(l) != 0; l--)  //紧挨着的注释行
+			msg.comments.insert(msg.comments.begin(), lineComments[l]);
+		msg.name = peek();
+		if (!isIdent(msg.name))
+			fail(line(), "消息名不合法：" + msg.name);
+		if (!msgNames.insert(msg.name).second)
+			fail(line(), "消息重名：" + msg.name);
+		i++;
+		expect("{");
+
+		std::set<std::string> fieldNames;
+		size_t maxSize = 0;
+		while (peek() != "}")
+		{
+			if (i >= tokens.size())
+				fail(line(), "消息" + msg.name + "没有结束的'}'");
+			Field f;
+			f.line = line();
+			if (peek() == "optional")
+			{
+				f.optional = true;
+				i++;
+			}
+			else if (!msg.fields.empty() && msg.fields.back().optional)
+			{
+				fail(line(), "optional字段后面不能再有必填字段");
+			}
+			f.type = peek();
+			if (s_types.count(f.type) == 0)
+				fail(line(), "不认识的类型：" + f.type);
+			i++;
+			if (peek() == "[")
+			{
+				i++;
+				expect("]");
+				if (f.isString())
+					fail(f.line, "不支持字符串数组");
+				f.isArray = true;
+			}
+			f.name = peek();
+			if (!isIdent(f.name))
+				fail(line(), "字段名不合法：" + f.name);
+			if (!fieldNames.insert(f.name).second)
+				fail(line(), "字段重名：" + f.name);
+			i++;
+			if (peek() == "max")
+			{
+				i++;
+				const std::string& n = peek();
+				if (n.empty() || n.size() > 5 || n.find_first_not_of("0123456789") != std::string::npos || atoi(n.c_str()) > 65535)
+					fail(line(), "max后面应该是不超过65535的数字");
+				f.maxCount = (size_t)atoi(n.c_str());
+				i++;
+				if (!f.isVar())
+					fail(f.line, "只有string和数组能写max");
+			}
+			else if (f.isVar())
+			{
+				fail(f.line, "string和数组必须写max");
+			}
+			int endLine = line();
+			expect(";");
+			auto it = lineComments.find(endLine);
+			if (it != lineComments.end() && commentOnlyLines.count(endLine) == 0)
+				f.comment = it->second;
+			maxSize += f.maxSize();
+			msg.fields.push_back(f);
+		}
+		i++;
+		if (maxSize > MSGGEN_MAX_BODY)
+			fail(msg.line, "消息" + msg.name + "最长" + std::to_string(maxSize) + "字节，超过包体能表示的长度");
+		msgs.push_back(std::move(msg));
+	}
+	return msgs;
+}
+
+static std::string upperFirst(const std::string& s)
+{
+	std::string r = s;
+	r[0] = (char)toupper((unsigned char)r[0]);
+	return r;
+}
+
+static std::string tail(const Field& f)
+{
+	return f.comment.empty() ? "" : "  //" + f.comment;
+}
+
+//Reader里这个字段的访问器的返回类型
+static std::string readType(const Field& f)
+{
+	if (f.isString())
+		return "std::string_view";
+	if (f.isArray)
+		return std::string("CMsgArray<") + f.info().cppType + ">";
+	return f.info().cppType;
+}
+
+//Writer里这个字段的类型
+static std::string writeType(const Field& f)
+{
+	std::string t = f.isArray ? std::string("std::span<const ") + f.info().cppType + ">" : f.info().cppType;
+	return f.optional ? "std::optional<" + t + ">" : t;
+}
+
+static void genReader(std::ostream& o, const Message& m)
+{
+	o << "\t//收到的包体的只读视图，不拷贝：先Parse()，成功了才能用访问器，访问期间包体要一直有效\n";
+	o << "\t//所有边界都在Parse()里检查过，访问器直接按记下的位置读\n";
+	o << "\tclass Reader\n\t{\n\tpublic:\n";
+	o << "\t\t//包体长度、字符串和数组长度、optional标志不合法返回false\n";
+	o << "\t\tbool Parse(const char* pBody, size_t iLen)\n\t\t{\n";
+	o << "\t\t\tCMsgCursor cur(pBody, iLen);\n";
+	o << "\t\t\tm_p = pBody;\n";
+	for (const Field& f : m.fields)
+	{
+		if (f.optional)
+			o << "\t\t\tm_bHas_" << f.name << " = false;\n";
+		if (f.optional && f.isVar())
+			o << "\t\t\tm_iCnt_" << f.name << " = 0;\n";  //没带的时候访问器返回空的
+	}
+	for (const Field& f : m.fields)
+	{
+		std::string indent = "\t\t\t";
+		if (f.optional)
+		{
+			o << indent << "if (cur.AtEnd())\n" << indent << "\treturn true; //后面的optional字段都没带\n";
+			o << indent << "if (!cur.Presence(m_bHas_" << f.name << "))\n" << indent << "\treturn false;\n";
+			o << indent << "if (m_bHas_" << f.name << ")\n" << indent << "{\n";
+			indent += "\t";
+		}
+		if (f.isVar())
+			o << indent << "if (!cur.Var(" << f.elemSize() << ", " << f.maxCount << ", m_iOff_" << f.name << ", m_iCnt_" << f.name << "))\n";
+		else
+			o << indent << "if (!cur.Fixed(" << f.elemSize() << ", m_iOff_" << f.name << "))\n";
+		o << indent << "\treturn false;\n";
+		if (f.optional)
+			o << "\t\t\t}\n";
+	}
+	o << "\t\t\treturn cur.AtEnd();\n\t\t}\n\n";
+
+	for (const Field& f : m.fields)
+	{
+		if (f.optional)
+			o << "\t\tbool has" << upperFirst(f.name) << "() const { return m_bHas_" << f.name << "; }\n";
+		std::string value;
+		if (f.isString())
+			value = "std::string_view(m_p + m_iOff_" + f.name + ", m_iCnt_" + f.name + ")";
+		else if (f.isArray)
+			value = readType(f) + "(m_p + m_iOff_" + f.name + ", m_iCnt_" + f.name + ")";
+		else
+			value = std::string("CMsgCodec::Load<") + f.info().cppType + ">(m_p + m_iOff_" + f.name + ")";
+		if (f.optional && !f.isVar())
+			value = "m_bHas_" + f.name + " ? " + value + " : " + readType(f) + "()";
+		o << "\t\t" << readType(f) << " " << f.name << "() const { return " << value << "; }" << tail(f) << "\n";
+	}
+
+	o << "\n\tprivate:\n";
+	o << "\t\tconst char*    m_p = nullptr;\n";
+	for (const Field& f : m.fields)
+	{
+		o << "\t\tunsigned short m_iOff_" << f.name << " = 0;\n";
+		if (f.isVar())
+			o << "\t\tunsigned short m_iCnt_" << f.name << " = 0;\n";
+		if (f.optional)
+			o << "\t\tbool           m_bHas_" << f.name << " = false;\n";
+	}
+	o << "\t};\n";
+}
+
+static void genWriter(std::ostream& o, const Message& m)
+{
+	o << "\t//要发出去的包体：填好字段后用Size()得到包体长度，Write()直接写进发送缓冲\n";
+	o << "\t//字符串、数组只记指针不拷贝，Write()之前指向的内容要一直有效；超长的按最大长度截断，需要时先用Fits()检查\n";
+	o << "\tstruct Writer\n\t{\n";
+	for (const Field& f : m.fields)
+	{
+		std::string init = (f.isVar() || f.optional) ? "" : (f.type == "bool" ? " = false" : " = 0");
+		o << "\t\t" << writeType(f) << " " << f.name << init << ";" << tail(f) << "\n";
+	}
+	o << "\n";
+
+	auto valueOf = [](const Field& f) { return f.optional ? "(*" + f.name + ")" : f.name; };
+	auto countOf = [&](const Field& f) { return "std::min<size_t>(" + valueOf(f) + ".size(), " + std::to_string(f.maxCount) + ")"; };
+
+	//Fits()
+	std::vector<std::string> checks;
+	for (const Field& f : m.fields)
+	{
+		if (!f.isVar())
+			continue;
+		std::string c = valueOf(f) + ".size() <= " + std::to_string(f.maxCount);
+		checks.push_back(f.optional ? "(!" + f.name + " || " + c + ")" : c);
+	}
+	o << "\t\t//字符串、数组都没超过最大长度\n";
+	o << "\t\tbool Fits() const { return " << (checks.empty() ? std::string("true") : "") ;
+	for (size_t k = 0; k < checks.size(); k++)
+		o << (k ? " && " : "") << checks[k];
+	o << "; }\n\n";
+
+	//Size()
+	size_t fixed = 0;
+	for (const Field& f : m.fields)
+	{
+		if (!f.isVar() && !f.optional)
+			fixed += f.elemSize();
+		else if (f.isVar() && !f.optional)
+			fixed += 2;
+		else
+			fixed += 1;
+	}
+	o << "\t\tunsigned short Size() const\n\t\t{\n";
+	o << "\t\t\tsize_t n = " << fixed << ";\n";
+	for (const Field& f : m.fields)
+	{
+		std::string add;
+		if (f.isVar())
+			add = (f.optional ? "2 + " : "") + countOf(f) + (f.elemSize() > 1 ? " * " + std::to_string(f.elemSize()) : "");
+		else if (f.optional)
+			add = std::to_string(f.elemSize());
+		else
+			continue;
+		if (f.optional)
+			o << "\t\t\tif (" << f.name << ")\n\t\t\t\tn += " << add << ";\n";
+		else
+			o << "\t\t\tn += " << add << ";\n";
+	}
+	o << "\t\t\treturn (unsigned short)n;\n\t\t}\n\n";
+
+	//Write()
+	o << "\t\t//p至少要有Size()字节，返回写了多少字节\n";
+	o << "\t\tunsigned short Write(char* p) const\n\t\t{\n";
+	o << "\t\t\tchar* q = p;\n";
+	for (const Field& f : m.fields)
+	{
+		std::string indent = "\t\t\t";
+		if (f.optional)
+		{
+			o << indent << "*q++ = " << f.name << " ? 1 : 0;\n";
+			o << indent << "if (" << f.name << ")\n" << indent << "{\n";
+			indent += "\t";
+		}
+		if (f.isString())
+		{
+			o << indent << "size_t n_" << f.name << " = " << countOf(f) << ";\n";
+			o << indent << "CMsgCodec::Store<uint16_t>(q, (uint16_t)n_" << f.name << ");\n";
+			o << indent << "memcpy(q + 2, " << valueOf(f) << ".data(), n_" << f.name << ");\n";
+			o << indent << "q += 2 + n_" << f.name << ";\n";
+		}
+		else if (f.isArray)
+		{
+			o << indent << "size_t n_" << f.name << " = " << countOf(f) << ";\n";
+			o << indent << "CMsgCodec::Store<uint16_t>(q, (uint16_t)n_" << f.name << ");\n";
+			o << indent << "q += 2;\n";
+			o << indent << "for (size_t k = 0; k < n_" << f.name << "; k++, q += " << f.elemSize() << ")\n";
+			o << indent << "\tCMsgCodec::Store<" << f.info().cppType << ">(q, " << valueOf(f) << "[k]);\n";
+		}
+		else
+		{
+			o << indent << "CMsgCodec::Store<" << f.info().cppType << ">(q, " << valueOf(f) << ");\n";
+			o << indent << "q += " << f.elemSize() << ";\n";
+		}
+		if (f.optional)
+			o << "\t\t\t}\n";
+	}
+	o << "\t\t\treturn (unsigned short)(q - p);\n\t\t}\n";
+	o << "\t};\n";
+}
+
+static void genMessage(std::ostream& o, const Message& m)
+{
+	size_t minSize = 0, maxSize = 0;
+	for (const Field& f : m.fields)
+	{
+		minSize += f.minSize();
+		maxSize += f.maxSize();
+	}
+
+	o << "/**\n * @struct Msg" << m.name << "\n";
+	if (m.comments.empty())
+		o << " * @brief " << m.name << "消息\n";
+	else
+	{
+		o << " * @brief " << m.comments[0] << "\n";
+		if (m.comments.size() > 1)
+		{
+			o << " *\n";
+			for (size_t k = 1; k < m.comments.size(); k++)
+				o << " * " << m.comments[k] << "\n";
+		}
+	}
+	o << " */\n";
+	o << "struct Msg" << m.name << "\n{\n";
+	o << "\tstatic constexpr unsigned short kMinSize = " << minSize << "; //最短包体，命令表里用CMD_BODY_MSG(Msg" << m.name << ")\n";
+	o << "\tstatic constexpr unsigned short kMaxSize = " << maxSize << "; //最长包体\n\n";
+	genReader(o, m);
+	o << "\n";
+	genWriter(o, m);
+	o << "};\n\n";
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 3)
+	{
+		fprintf(stderr, "用法：%s xxx.msg xxx.msg.h\n", argv[0]);
+		return 1;
+	}
+	s_srcName = argv[1];
+	std::ifstream in(argv[1]);
+	if (!in)
+	{
+		fprintf(stderr, "打不开%s\n", argv[1]);
+		return 1;
+	}
+	std::vector<Message> msgs = parse(in);
+
+	std::string srcBase = s_srcName.substr(s_srcName.find_last_of('/') + 1);
+	std::ostringstream o;
+	o << "//由tools/msggen根据proto/" << srcBase << "生成，不要手改\n";
+	o << "#pragma once\n";
+	o << "#include <stddef.h>\n#include <stdint.h>\n#include <string.h>\n";
+	o << "#include <algorithm>\n#include <optional>\n#include <span>\n#include <string_view>\n\n";
+	o << "#include \"CMsgCodec.h\"\n\n";
+	for (const Message& m : msgs)
+		genMessage(o, m);
+
+	//先写临时文件再改名，生成一半失败不会留下不完整的头文件
+	std::string tmp = std::string(argv[2]) + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::trunc);
+		out << o.str();
+		if (!out)
+		{
+			fprintf(stderr, "写%s失败\n", tmp.c_str());
+			return 1;
+		}
+	}
+	if (rename(tmp.c_str(), argv[2]) != 0)
+	{
+		fprintf(stderr, "写%s失败\n", argv[2]);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,121 @@
+//账号、会话表(CUserStore/CStripedTable)随线程数的吞吐量，分片数为1时就是整张表一把锁，和分片加锁对比
+//登录：按用户名查账号(读锁)再换掉这个账号的会话(写锁)；续登：按用户名查账号和会话，只加读锁
+//用法：make bench 之后运行 tools/storebench [最多线程数=8] [每个线程做多少次=100000]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CUserStore.h"
+#include "logiccomm.h"
+
+#define BENCH_USERS  10000  //先注册这么多个账号，各线程轮着登录
+
+static double nowSec()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//iThreads个线程同时跑fn(线程序号)，返回总的每秒次数（万次）
+template<typename Fn>
+static double runThreads(int iThreads, int iOps, Fn&& fn)
+{
+	std::atomic<int> iReady(0);
+	std::atomic<bool> bGo(false);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < iThreads; t++)
+	{
+		threads.emplace_back([&, t]() {
+			++iReady;
+			while (!bGo)
+				std::this_thread::yield();
+			fn(t);
+		});
+	}
+	while (iReady < iThreads)
+		std::this_thread::yield();
+	double start = nowSec();
+	bGo = true;
+	for (auto& th : threads)
+		th.join();
+	return (double)iThreads * iOps / (nowSec() - start) / 1e4;
+}
+
+//一种分片数、一种线程数跑一遍登录和续登，返回false表示结果码不对
+static bool runOnce(int iShards, int iThreads, int iOps, const std::vector<std::string>& names, double& login, double& resume)
+{
+	CUserStore store;
+	//上限平均分到各分片，哈希分得不会绝对均匀，留一倍余量，免得个别分片先满；每个账号只有一个会话
+	store.Init(iShards, BENCH_USERS * 2, BENCH_USERS * 2, USER_STORE_SESSION_TIMEOUT);
+	uint32_t iUserId;
+	for (const auto& name : names)
+	{
+		if (store.Register(name, "pwd", 0, iUserId) != _RESULT_OK)
+			return false;
+	}
+
+	std::atomic<int> iErrors(0);
+	login = runThreads(iThreads, iOps, [&](int t) {
+		char token[SESSION_TOKEN_LEN];
+		uint32_t id;
+		for (int i = 0; i < iOps; i++)
+		{
+			if (store.Login(names[(t * 7919 + i) % names.size()], "pwd", id, token) != _RESULT_OK)
+				++iErrors;
+		}
+	});
+
+	//登录会顶掉原来的会话，测完登录每个账号再登录一次，续登用这次的令牌
+	std::vector<std::string> tokens(names.size());
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		char token[SESSION_TOKEN_LEN];
+		if (store.Login(names[i], "pwd", iUserId, token) != _RESULT_OK)
+			return false;
+		tokens[i].assign(token, SESSION_TOKEN_LEN);
+	}
+
+	resume = runThreads(iThreads, iOps, [&](int t) {
+		uint32_t id;
+		for (int i = 0; i < iOps; i++)
+		{
+			size_t k = (t * 7919 + i) % names.size();
+			if (store.Resume(names[k], tokens[k], id) != _RESULT_OK)
+				++iErrors;
+		}
+	});
+	return iErrors == 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int iMaxThreads = (argc > 1) ? atoi(argv[1]) : 8;
+	int iOps = (argc > 2) ? atoi(argv[2]) : 100000;
+	if (iMaxThreads <= 0 || iOps <= 0)
+	{
+		fprintf(stderr, "用法: %s [最多线程数] [每个线程做多少次]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<std::string> names;
+	for (int i = 0; i < BENCH_USERS; i++)
+		names.push_back("user" + std::to_string(i));
+
+	printf("%d个账号，每个线程%d次，单位万次/秒，本机%u个CPU：\n", BENCH_USERS, iOps, std::thread::hardware_concurrency());
+	printf("  %6s %14s %14s %14s %14s\n", "线程", "登录(1分片)", "登录(64分片)", "续登(1分片)", "续登(64分片)");
+	for (int iThreads = 1; iThreads <= iMaxThreads; iThreads *= 2)
+	{
+		double login1, resume1, login64, resume64;
+		if (!runOnce(1, iThreads, iOps, names, login1, resume1) || !runOnce(USER_STORE_SHARDS, iThreads, iOps, names, login64, resume64))
+		{
+			printf("  结果码不对，检查CUserStore\n");
+			return 1;
+		}
+		printf("  %6d %14.1f %14.1f %14.1f %14.1f\n", iThreads, login1, login64, resume1, resume64);
+	}
+	return 0;
+}